@@ -0,0 +1,282 @@
+// Microbenchmarks for the engine2D drawing API. Prints one JSON document to stdout so runs
+// can be kept and compared after SDL or compiler upgrades.
+//
+// Build:  g++ -O2 -I.. bench.cpp -o bench -lSDL2 -lSDL2_image
+// Run:    SDL_VIDEODRIVER=dummy SDL_AUDIODRIVER=dummy ./bench [--time ms] [name filter] > results.json
+//
+// The software renderer is used unless SDL_RENDER_DRIVER says otherwise, so results do not
+// depend on a GPU being present. Every case is timed until it has run for --time
+// milliseconds (default 200) and the renderer is flushed before the clock stops.
+
+#include <SDL2/SDL.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+
+// Count the SDL calls the engine makes. SDL's own declarations are already in, so these only
+// apply to the calls inside engine2D.h below.
+static unsigned long long sdl_calls = 0;
+#define BENCH_COUNTED(f) (sdl_calls++, f)
+#define SDL_RenderClear(...) BENCH_COUNTED(SDL_RenderClear(__VA_ARGS__))
+#define SDL_RenderDrawPoint(...) BENCH_COUNTED(SDL_RenderDrawPoint(__VA_ARGS__))
+#define SDL_RenderDrawPointF(...) BENCH_COUNTED(SDL_RenderDrawPointF(__VA_ARGS__))
+#define SDL_RenderDrawPoints(...) BENCH_COUNTED(SDL_RenderDrawPoints(__VA_ARGS__))
+#define SDL_RenderDrawPointsF(...) BENCH_COUNTED(SDL_RenderDrawPointsF(__VA_ARGS__))
+#define SDL_RenderDrawLine(...) BENCH_COUNTED(SDL_RenderDrawLine(__VA_ARGS__))
+#define SDL_RenderDrawLineF(...) BENCH_COUNTED(SDL_RenderDrawLineF(__VA_ARGS__))
+#define SDL_RenderDrawLines(...) BENCH_COUNTED(SDL_RenderDrawLines(__VA_ARGS__))
+#define SDL_RenderDrawRect(...) BENCH_COUNTED(SDL_RenderDrawRect(__VA_ARGS__))
+#define SDL_RenderDrawRectF(...) BENCH_COUNTED(SDL_RenderDrawRectF(__VA_ARGS__))
+#define SDL_RenderFillRect(...) BENCH_COUNTED(SDL_RenderFillRect(__VA_ARGS__))
+#define SDL_RenderFillRectF(...) BENCH_COUNTED(SDL_RenderFillRectF(__VA_ARGS__))
+#define SDL_RenderFillRects(...) BENCH_COUNTED(SDL_RenderFillRects(__VA_ARGS__))
+#define SDL_RenderCopy(...) BENCH_COUNTED(SDL_RenderCopy(__VA_ARGS__))
+#define SDL_RenderCopyEx(...) BENCH_COUNTED(SDL_RenderCopyEx(__VA_ARGS__))
+#define SDL_RenderCopyExF(...) BENCH_COUNTED(SDL_RenderCopyExF(__VA_ARGS__))
+#define SDL_RenderGeometry(...) BENCH_COUNTED(SDL_RenderGeometry(__VA_ARGS__))
+#define SDL_RenderReadPixels(...) BENCH_COUNTED(SDL_RenderReadPixels(__VA_ARGS__))
+#define SDL_UpdateTexture(...) BENCH_COUNTED(SDL_UpdateTexture(__VA_ARGS__))
+#define SDL_CreateTexture(...) BENCH_COUNTED(SDL_CreateTexture(__VA_ARGS__))
+#define SDL_CreateTextureFromSurface(...) BENCH_COUNTED(SDL_CreateTextureFromSurface(__VA_ARGS__))
+#define SDL_SetRenderDrawColor(...) BENCH_COUNTED(SDL_SetRenderDrawColor(__VA_ARGS__))
+#define SDL_SetRenderDrawBlendMode(...) BENCH_COUNTED(SDL_SetRenderDrawBlendMode(__VA_ARGS__))
+#define SDL_SetRenderTarget(...) BENCH_COUNTED(SDL_SetRenderTarget(__VA_ARGS__))
+#define SDL_RenderSetClipRect(...) BENCH_COUNTED(SDL_RenderSetClipRect(__VA_ARGS__))
+#define SDL_SetTextureColorMod(...) BENCH_COUNTED(SDL_SetTextureColorMod(__VA_ARGS__))
+#define SDL_SetTextureBlendMode(...) BENCH_COUNTED(SDL_SetTextureBlendMode(__VA_ARGS__))
+#define SDL_MixAudioFormat(...) BENCH_COUNTED(SDL_MixAudioFormat(__VA_ARGS__))
+#define SDL_QueueAudio(...) BENCH_COUNTED(SDL_QueueAudio(__VA_ARGS__))
+
+#include "engine2D.h"
+
+using namespace engine2D;
+
+static const int SCREEN_W = 640;
+static const int SCREEN_H = 480;
+
+typedef struct
+{
+    string name;
+    int size;
+    function<void(int)> op;     // Called with the iteration number.
+} BenchCase;
+
+static double time_budget_ms = 200.0;
+static bool first_result = true;
+
+static void RunCase(const BenchCase& c)
+{
+    SDL_SetRenderTarget(window_renderer, screen_texture);
+    // Warm up caches, lazily created textures and the frame arena.
+    for(int i = 0; i < 16; i++)
+        c.op(i);
+    SDL_RenderFlush(window_renderer);
+    GetFrameArena().Reset();
+
+    long long ops = 0;
+    unsigned long long calls = 0;
+    double elapsed_ms = 0.0;
+    int batch = 16;
+    while(elapsed_ms < time_budget_ms)
+    {
+        unsigned long long calls_before = sdl_calls;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < batch; i++)
+            c.op((int)(ops + i));
+        SDL_RenderFlush(window_renderer);
+        auto end = std::chrono::steady_clock::now();
+        calls += sdl_calls - calls_before;
+        elapsed_ms += std::chrono::duration<double, std::milli>(end - start).count();
+        ops += batch;
+        GetFrameArena().Reset();
+        if(elapsed_ms < time_budget_ms / 4)
+            batch *= 2;
+    }
+
+    double ns_per_op = elapsed_ms * 1e6 / ops;
+    printf("%s\n    {\"name\": \"%s\", \"size\": %d, \"ops\": %lld, \"ns_per_op\": %.1f, \"sdl_calls_per_op\": %.2f, \"ops_per_sec\": %.0f}",
+           first_result ? "" : ",", c.name.c_str(), c.size, ops, ns_per_op, (double)calls / ops, 1e9 / ns_per_op);
+    fflush(stdout);
+    first_result = false;
+}
+
+// Deterministic spread of positions over the screen.
+static int PosX(int i, int margin) { return margin + (i * 97) % max(SCREEN_W - 2 * margin, 1); }
+static int PosY(int i, int margin) { return margin + (i * 61) % max(SCREEN_H - 2 * margin, 1); }
+
+// Opaque RGBA checkerboard, kept alive for the images that point at its pixels.
+static SDL_Surface* MakeSurface(int w, int h)
+{
+    SDL_Surface* s = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+    for(int y = 0; y < h; y++)
+    {
+        uint32_t* row = (uint32_t*)((uint8_t*)s->pixels + y * s->pitch);
+        for(int x = 0; x < w; x++)
+            row[x] = ((x / 4 + y / 4) % 2) ? 0xFFFFFFFF : 0xFF4080C0;
+    }
+    return s;
+}
+
+// Writes a mono 16-bit PCM file of the given length so Sound has something to load.
+static bool WriteWav(const char* path, int samples)
+{
+    FILE* f = fopen(path, "wb");
+    if(f == NULL)
+        return false;
+    uint32_t data_size = samples * 2, riff_size = 36 + data_size, fmt_size = 16, rate = 44100, byte_rate = rate * 2;
+    uint16_t format = 1, channels = 1, align = 2, bits = 16;
+    fwrite("RIFF", 1, 4, f); fwrite(&riff_size, 4, 1, f); fwrite("WAVEfmt ", 1, 8, f);
+    fwrite(&fmt_size, 4, 1, f); fwrite(&format, 2, 1, f); fwrite(&channels, 2, 1, f);
+    fwrite(&rate, 4, 1, f); fwrite(&byte_rate, 4, 1, f); fwrite(&align, 2, 1, f); fwrite(&bits, 2, 1, f);
+    fwrite("data", 1, 4, f); fwrite(&data_size, 4, 1, f);
+    for(int i = 0; i < samples; i++)
+    {
+        int16_t v = (int16_t)(8000 * sin(i * 0.05));
+        fwrite(&v, 2, 1, f);
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* filter = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+            time_budget_ms = atof(argv[++i]);
+        else
+            filter = argv[i];
+    }
+
+    SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+    Init(SCREEN_W, SCREEN_H, 1);
+    SDL_RendererInfo info;
+    SDL_GetRendererInfo(window_renderer, &info);
+    SDL_version version;
+    SDL_GetVersion(&version);
+
+    vector<BenchCase> cases;
+    cases.push_back({"DrawPixel", 1, [](int i) { DrawPixel(PosX(i, 0), PosY(i, 0), 255, 255, 255); }});
+    for(int len : {8, 64, 512})
+        cases.push_back({"DrawLine", len, [len](int i) { int x = PosX(i, 0), y = PosY(i, 0); DrawLine(x, y, x + len, y + len / 2, 255, 0, 0); }});
+    for(int size : {8, 64, 256})
+    {
+        cases.push_back({"DrawBlock", size, [size](int i) { DrawBlock(PosX(i, 0), PosY(i, 0), size, size, 0, 255, 0); }});
+        cases.push_back({"DrawBlockFilled", size, [size](int i) { DrawBlock(PosX(i, 0), PosY(i, 0), size, size, 0, 255, 0, 255, true); }});
+    }
+    for(int rad : {4, 32, 128})
+    {
+        cases.push_back({"DrawCircle", rad, [rad](int i) { DrawCircle(PosX(i, 0), PosY(i, 0), rad, 0, 0, 255); }});
+        cases.push_back({"DrawCircleFilled", rad, [rad](int i) { DrawCircle(PosX(i, 0), PosY(i, 0), rad, 0, 0, 255, 255, true); }});
+    }
+    for(int sides : {3, 8, 32, 128})
+    {
+        for(int fill = 0; fill < 2; fill++)
+        {
+            cases.push_back({fill ? "PolygonFilled" : "Polygon", sides, [sides, fill](int i)
+            {
+                int cx = PosX(i, 100), cy = PosY(i, 100);
+                PolygonBegin(cx + 100, cy, 255, 255, 0, 255, fill != 0);
+                for(int k = 1; k < sides; k++)
+                    PolygonVertex(cx + (int)(100 * cos(k * 2 * M_PI / sides)), cy + (int)(100 * sin(k * 2 * M_PI / sides)));
+                PolygonEnd();
+            }});
+        }
+    }
+
+    vector<SDL_Surface*> surfaces;
+    for(int size : {16, 64, 256})
+    {
+        surfaces.push_back(MakeSurface(size, size));
+        Image* im = new Image(surfaces.back());
+        cases.push_back({"DrawImage", size, [im](int i) { im->DrawImage(PosX(i, 0), PosY(i, 0)); }});
+        cases.push_back({"DrawImageRotatedScaled", size, [im](int i)
+        {
+            im->DrawImage(PosX(i, 0), PosY(i, 0), 0, 0, 0, 0, (float)(i % 360), im->width / 2, im->height / 2, 1.5f);
+        }});
+    }
+    for(int size : {16, 64})
+    {
+        surfaces.push_back(MakeSurface(size * 4, size * 4));
+        Sprite* sprite = new Sprite(new Image(surfaces.back()), 4, 4);
+        cases.push_back({"DrawSprite", size, [sprite](int i) { sprite->DrawSprite(i % 16, PosX(i, 0), PosY(i, 0)); }});
+    }
+
+    // 16x16 glyphs of 8x8 pixels; the content does not matter for timing.
+    surfaces.push_back(MakeSurface(128, 128));
+    BitmapFont* font = new BitmapFont(new Image(surfaces.back()), 8, 8);
+    static string text_storage[3];
+    int text_index = 0;
+    for(int len : {8, 64, 512})
+    {
+        string& text = text_storage[text_index++];
+        for(int k = 0; k < len; k++)
+            text += (char)(' ' + k % 90);
+        const char* s = text.c_str();
+        cases.push_back({"BitmapFont::DrawString", len, [font, s](int i) { font->DrawString(s, PosX(i, 0) % 64, PosY(i, 0)); }});
+    }
+
+    for(int size : {64, 256})
+    {
+        PixelBlock* block = new PixelBlock(size, size);
+        cases.push_back({"PixelBlock::Read", size, [block](int) { block->Read(0, 0); }});
+        cases.push_back({"PixelBlock::Write", size, [block](int i) { block->Write(PosX(i, 0), PosY(i, 0)); }});
+    }
+
+    // A walled 24x24 map with a pillar row, textured floor and ceiling, turning on the spot.
+    {
+        surfaces.push_back(MakeSurface(256, 64));
+        Sprite* sheet = new Sprite(new Image(surfaces.back()), 4, 1);
+        Raycaster* raycaster = new Raycaster(24, 24, sheet, sheet);
+        for(int k = 0; k < 24; k++)
+        {
+            raycaster->SetCell(k, 0, 1); raycaster->SetCell(k, 23, 2);
+            raycaster->SetCell(0, k, 3); raycaster->SetCell(23, k, 4);
+        }
+        for(int k = 4; k < 20; k += 4)
+            raycaster->SetCell(k, 12, 2);
+        raycaster->floor_frame = 0;
+        raycaster->ceiling_frame = 1;
+        for(int k = 0; k < 8; k++)
+            raycaster->AddBillboard(sheet, 3, 3.5f + k * 2, 8.5f);
+        PixelBlock* block = new PixelBlock(640, 400);
+        cases.push_back({"Raycaster::Render", 400, [raycaster, block](int i)
+        {
+            raycaster->SetCamera(11.5f, 5.5f, (float)(i % 360));
+            raycaster->Render(block);
+        }});
+    }
+
+    // Sound::Play at reduced volume mixes the whole clip before queueing it.
+    for(int ms : {100, 1000})
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "engine2D_bench_%d.wav", ms);
+        if(!WriteWav(path, 44100 * ms / 1000))
+            continue;
+        Sound* sound = new Sound(path);
+        remove(path);
+        sound->SetVolume(0.5f);
+        cases.push_back({"Sound::Play", ms, [sound](int) { sound->Play(); sound->Stop(); }});
+    }
+
+    printf("{\n  \"renderer\": \"%s\",\n  \"sdl_version\": \"%d.%d.%d\",\n  \"screen\": [%d, %d],\n  \"results\": [",
+           info.name, version.major, version.minor, version.patch, SCREEN_W, SCREEN_H);
+    for(size_t i = 0; i < cases.size(); i++)
+    {
+        if(filter == NULL || strstr(cases[i].name.c_str(), filter) != NULL)
+            RunCase(cases[i]);
+    }
+    printf("\n  ]\n}\n");
+
+    for(size_t i = 0; i < surfaces.size(); i++)
+        SDL_FreeSurface(surfaces[i]);
+    SDL_Quit();
+    return 0;
+}
@@ -0,0 +1,277 @@
+// Stress test: for each feature, keeps adding moving objects until the average frame time
+// goes over budget, then reports the largest count that stayed within it as JSON.
+//
+// Build:  g++ -O2 -I.. bunnymark.cpp -o bunnymark -lSDL2 -lSDL2_image
+// Run:    SDL_VIDEODRIVER=dummy ./bunnymark [--budget ms] [--frames n] [feature filter] > capacity.json
+//
+// The simulation runs on a fixed 1/60 s step, so every run moves the objects the same way
+// and only the measured frame time depends on the machine. The default budget is 16.7 ms.
+// The normal renderer is used; under the dummy video driver that is the software one.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include "engine2D.h"
+
+using namespace engine2D;
+
+static const int SCREEN_W = 800;
+static const int SCREEN_H = 600;
+static const int MAX_COUNT = 1 << 20;
+
+enum class Feature
+{
+    IMAGE = 0,
+    IMAGE_ROTATED,
+    SPRITE,
+    CIRCLE,
+    TEXT,
+    PIXEL_BLOCK,
+    TOTAL_FEATURES
+};
+
+static const char* feature_names[] = {"DrawImage", "DrawImageRotatedScaled", "DrawSprite", "DrawCircle", "BitmapFont", "PixelBlock"};
+
+typedef struct
+{
+    float x, y;
+    float vx, vy;
+    float angle, spin;
+} Bunny;
+
+class BunnyMark : public Application
+{
+    float budget = 1.0f / 60.0f;
+    int window_frames = 30;
+    const char* filter = NULL;
+
+    SDL_Surface* bunny_surface = NULL;
+    SDL_Surface* sheet_surface = NULL;
+    SDL_Surface* font_surface = NULL;
+    Image* bunny = NULL;
+    Sprite* sheet = NULL;
+    BitmapFont* font = NULL;
+    vector<PixelBlock*> blocks;
+
+    vector<Bunny> bunnies;
+    uint32_t seed = 12345;
+
+    int feature = -1;
+    int count = 0;
+    // Largest count known to be within budget and smallest known to be over it.
+    int good = 0, bad = 0;
+    int frames = 0;
+    float frame_sum = 0.0f;
+    float good_frame_time = 0.0f;
+    bool first_result = true;
+
+    public:
+    BunnyMark(float budget, int window_frames, const char* filter)
+    {
+        this->budget = budget;
+        this->window_frames = window_frames;
+        this->filter = filter;
+    }
+
+    private:
+    float Random(float lo, float hi)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return lo + (hi - lo) * (seed & 0xFFFFFF) / (float)0x1000000;
+    }
+
+    static SDL_Surface* MakeSurface(int w, int h, uint32_t a, uint32_t b)
+    {
+        SDL_Surface* s = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+        for(int y = 0; y < h; y++)
+        {
+            uint32_t* row = (uint32_t*)((uint8_t*)s->pixels + y * s->pitch);
+            for(int x = 0; x < w; x++)
+                row[x] = ((x / 4 + y / 4) % 2) ? a : b;
+        }
+        return s;
+    }
+
+    void Create()
+    {
+        app_name = "engine2D BunnyMark";
+        SetFixedStep(1.0f / 60.0f);
+        bunny_surface = MakeSurface(26, 37, 0xFFFFFFFF, 0xFFC0C0C0);
+        sheet_surface = MakeSurface(128, 128, 0xFF80FFFF, 0xFF4040C0);
+        font_surface = MakeSurface(128, 128, 0xFFFFFFFF, 0x00000000);
+        bunny = new Image(bunny_surface);
+        sheet = new Sprite(new Image(sheet_surface), 4, 4);
+        font = new BitmapFont(new Image(font_surface), 8, 8);
+        printf("{\n  \"budget_ms\": %.2f,\n  \"screen\": [%d, %d],\n  \"results\": [", budget * 1000.0f, SCREEN_W, SCREEN_H);
+        NextFeature();
+    }
+
+    void NextFeature()
+    {
+        do
+        {
+            feature++;
+        }
+        while(feature < (int)Feature::TOTAL_FEATURES && filter != NULL && strstr(feature_names[feature], filter) == NULL);
+
+        if(feature == (int)Feature::TOTAL_FEATURES)
+        {
+            printf("\n  ]\n}\n");
+            fflush(stdout);
+            Quit();
+            return;
+        }
+        good = 0;
+        bad = 0;
+        good_frame_time = 0.0f;
+        SetCount(100);
+    }
+
+    void SetCount(int n)
+    {
+        count = min(n, MAX_COUNT);
+        while((int)bunnies.size() < count)
+        {
+            Bunny b;
+            b.x = Random(0, SCREEN_W);
+            b.y = Random(0, SCREEN_H / 2);
+            b.vx = Random(-200, 200);
+            b.vy = Random(-100, 100);
+            b.angle = Random(0, 360);
+            b.spin = Random(-180, 180);
+            bunnies.push_back(b);
+        }
+        if(feature == (int)Feature::PIXEL_BLOCK)
+        {
+            while((int)blocks.size() < count)
+                blocks.push_back(new PixelBlock(16, 16));
+        }
+        frames = -2;  // Skip the frames that create textures for the new objects.
+        frame_sum = 0.0f;
+    }
+
+    void Report()
+    {
+        int glyphs = (feature == (int)Feature::TEXT) ? good * 16 : good;
+        printf("%s\n    {\"feature\": \"%s\", \"max_count\": %d, \"draws_per_frame\": %d, \"frame_ms\": %.2f}",
+               first_result ? "" : ",", feature_names[feature], good, glyphs, good_frame_time * 1000.0f);
+        fflush(stdout);
+        first_result = false;
+    }
+
+    // Grows the count by half until a window goes over budget, then bisects between the
+    // last good and first bad counts until they are within 2% of each other.
+    void Measure()
+    {
+        if(frames++ < 0)
+            return;
+        frame_sum += GetFrameTime();
+        if(frames < window_frames)
+            return;
+
+        float average = frame_sum / frames;
+        if(average <= budget)
+        {
+            good = count;
+            good_frame_time = average;
+        }
+        else
+            bad = count;
+
+        if(bad == 0 && count < MAX_COUNT)
+            SetCount(count + count / 2);
+        else if(bad != 0 && bad - good > max(good / 50, 1))
+            SetCount((good + bad) / 2);
+        else
+        {
+            Report();
+            NextFeature();
+        }
+    }
+
+    void Update(float elapsed)
+    {
+        Measure();
+        for(int i = 0; i < count; i++)
+        {
+            Bunny& b = bunnies[i];
+            b.vy += 750.0f * elapsed;
+            b.x += b.vx * elapsed;
+            b.y += b.vy * elapsed;
+            b.angle += b.spin * elapsed;
+            if(b.x < 0 || b.x > SCREEN_W)
+            {
+                b.vx = -b.vx;
+                b.x = Clamp(b.x, 0.0, SCREEN_W);
+            }
+            if(b.y > SCREEN_H)
+            {
+                b.vy = -Random(300, 900);
+                b.y = SCREEN_H;
+            }
+        }
+    }
+
+    void Draw(float elapsed)
+    {
+        Feature f = (Feature)feature;
+        for(int i = 0; i < count; i++)
+        {
+            const Bunny& b = bunnies[i];
+            int x = (int)b.x, y = (int)b.y;
+            switch(f)
+            {
+                case Feature::IMAGE:
+                    bunny->DrawImage(x, y);
+                    break;
+                case Feature::IMAGE_ROTATED:
+                    bunny->DrawImage(x, y, 0, 0, 0, 0, b.angle, 13, 18, 0.5f + (i % 4) * 0.25f);
+                    break;
+                case Feature::SPRITE:
+                    sheet->DrawSprite(i % 16, x, y, b.angle, 16, 16);
+                    break;
+                case Feature::CIRCLE:
+                    DrawCircle(x, y, 8, i * 37, i * 91, 255, 255, true);
+                    break;
+                case Feature::TEXT:
+                    font->printf(x, y, 1, "bunny %010d", i);
+                    break;
+                case Feature::PIXEL_BLOCK:
+                {
+                    // A small moving plasma written fresh every frame.
+                    PixelBlock* block = blocks[i];
+                    int t = (int)(b.angle * 4);
+                    for(int py = 0; py < block->height; py++)
+                        for(int px = 0; px < block->width; px++)
+                            block->DrawPixel(px, py, (px * 16 + t) & 255, (py * 16 - t) & 255, (px ^ py) * 16, 255);
+                    block->Write(x, y);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+};
+
+int main(int argc, char** argv)
+{
+    float budget_ms = 1000.0f / 60.0f;
+    int frames = 30;
+    const char* filter = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+            budget_ms = atof(argv[++i]);
+        else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = max(atoi(argv[++i]), 1);
+        else
+            filter = argv[i];
+    }
+
+    Init(SCREEN_W, SCREEN_H, 1);
+    Start(new BunnyMark(budget_ms / 1000.0f, frames, filter));
+}
@@ -10,10 +10,33 @@
 #include <cstdlib>
 #include <cmath>
 #include <cstdint>
+#include <climits>
 #include <vector>
+#include <algorithm>
 #include <functional>
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 #ifdef ENGINE2D_EMSCRIPTEN_IMPLEMENTATION
 #include <emscripten.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define ENGINE2D_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && !defined(ENGINE2D_EMSCRIPTEN_IMPLEMENTATION)
+#define ENGINE2D_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define ENGINE2D_BACKTRACE
+#include <execinfo.h>
 #endif
 #define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
@@ -62,22 +85,25 @@ namespace engine2D
     {
         return m_min + (v - v_min) / (v_max - v_min) * (m_max - m_min);
     }
+
+    // floor() without the libm call, for grid cell lookups and angle reduction.
+    int _FloorToInt(float v)
+    {
+        int i = (int)v;
+        return i - (v < i);
+    }
     
     class Vector2
     {
         public:
         float x, y;
         
-        Vector2()
+        constexpr Vector2() : x(0.0f), y(0.0f)
         {
-            this->x = 0.0f;
-            this->y = 0.0f;
         }
 
-        Vector2(float x, float y)
+        constexpr Vector2(float x, float y) : x(x), y(y)
         {
-            this->x = x;
-            this->y = y;
         }
 
         void Set(float x, float y)
@@ -86,19 +112,21 @@ namespace engine2D
             this->y = y;
         }
 
-        float MagnitudeSquared()
+        constexpr float MagnitudeSquared() const
         {
             return (this->x * this->x + this->y * this->y);
         }
 
-        float Magnitude()
+        float Magnitude() const
         {
             return sqrt(this->MagnitudeSquared());
         }
         
         Vector2 Rotate(float angle)
         {
-            Set(this->x * cos(angle) - this->y * sin(angle), this->x * sin(angle) + this->y * cos(angle));
+            float s = sin(angle);
+            float c = cos(angle);
+            Set(this->x * c - this->y * s, this->x * s + this->y * c);
             return *this;
         }
 
@@ -128,531 +156,6673 @@ namespace engine2D
             return *this;
         }
 
-        static float DotProduct(Vector2& v1, Vector2& v2)
+        static constexpr float DotProduct(Vector2 const &v1, Vector2 const &v2)
         {
             return (v1.x * v2.x + v1.y * v2.y);
         }
 
     };
 
-    Vector2 operator+ (Vector2 const &v1, Vector2 const &v2)
+    constexpr Vector2 operator+ (Vector2 const &v1, Vector2 const &v2)
     {
         return Vector2(v1.x + v2.x, v1.y + v2.y);
     }
 
-    Vector2 operator- (Vector2 const &v1, Vector2 const &v2)
+    constexpr Vector2 operator- (Vector2 const &v1, Vector2 const &v2)
     {
         return Vector2(v1.x - v2.x, v1.y - v2.y);
     }
 
-    Vector2 operator+= (Vector2 const &v1, Vector2 const &v2)
+    constexpr Vector2 operator* (Vector2 const &v, float s)
     {
-        return Vector2(v1.x + v2.x, v1.y + v2.y);
+        return Vector2(v.x * s, v.y * s);
     }
 
-    Vector2 operator-= (Vector2 const &v1, Vector2 const &v2)
+    constexpr Vector2 operator* (float s, Vector2 const &v)
     {
-        return Vector2(v1.x - v2.x, v1.y - v2.y);
+        return Vector2(v.x * s, v.y * s);
     }
 
-    class Application
+    Vector2& operator+= (Vector2 &v1, Vector2 const &v2)
+    {
+        v1.x += v2.x;
+        v1.y += v2.y;
+        return v1;
+    }
+
+    Vector2& operator-= (Vector2 &v1, Vector2 const &v2)
+    {
+        v1.x -= v2.x;
+        v1.y -= v2.y;
+        return v1;
+    }
+
+    // 2x3 affine transform: x' = a * x + c * y + tx, y' = b * x + d * y + ty.
+    class Transform2D
     {
         public:
-        string app_name = "engine2D Application";
+        float a, b, c, d, tx, ty;
 
-        virtual void Create(void)
+        constexpr Transform2D() : a(1.0f), b(0.0f), c(0.0f), d(1.0f), tx(0.0f), ty(0.0f)
         {
+        }
 
+        constexpr Transform2D(float a, float b, float c, float d, float tx, float ty) : a(a), b(b), c(c), d(d), tx(tx), ty(ty)
+        {
         }
-        virtual void Update(float elapsed)
+
+        static constexpr Transform2D Translation(float x, float y)
         {
+            return Transform2D(1.0f, 0.0f, 0.0f, 1.0f, x, y);
+        }
 
+        static constexpr Transform2D Scale(float sx, float sy)
+        {
+            return Transform2D(sx, 0.0f, 0.0f, sy, 0.0f, 0.0f);
         }
 
-        virtual void Draw(float elapsed)
+        static Transform2D Rotation(float angle)
         {
-            
+            float s = sin(angle);
+            float c = cos(angle);
+            return Transform2D(c, s, -s, c, 0.0f, 0.0f);
         }
 
-        virtual void OnKeyPress(float elapsed, Button key)
+        constexpr Vector2 Apply(Vector2 const &v) const
         {
+            return Vector2(a * v.x + c * v.y + tx, b * v.x + d * v.y + ty);
+        }
 
+        Transform2D Inverse() const
+        {
+            float det = a * d - b * c;
+            if(det == 0.0f)
+                return Transform2D();
+            float inv = 1.0f / det;
+            return Transform2D(d * inv, -b * inv, -c * inv, a * inv, (c * ty - d * tx) * inv, (b * tx - a * ty) * inv);
         }
+    };
 
-        virtual void OnKeyPressed(float elapsed, Button key)
+    // t1 * t2 applies t2 first, then t1.
+    constexpr Transform2D operator* (Transform2D const &t1, Transform2D const &t2)
+    {
+        return Transform2D(t1.a * t2.a + t1.c * t2.b, t1.b * t2.a + t1.d * t2.b,
+                           t1.a * t2.c + t1.c * t2.d, t1.b * t2.c + t1.d * t2.d,
+                           t1.a * t2.tx + t1.c * t2.ty + t1.tx, t1.b * t2.tx + t1.d * t2.ty + t1.ty);
+    }
+
+    // Fast sine and cosine: the angle is reduced to [-pi/2, pi/2] and fed to an odd
+    // polynomial. Absolute error is around 1e-6 near zero and grows with the angle as float
+    // reduction loses precision (about 3e-4 at a few thousand radians).
+    const float _SIN_C3 = -1.0f / 6.0f;
+    const float _SIN_C5 = 1.0f / 120.0f;
+    const float _SIN_C7 = -1.0f / 5040.0f;
+    const float _SIN_C9 = 1.0f / 362880.0f;
+    const float _SIN_C11 = -1.0f / 39916800.0f;
+    const float _PI = 3.14159265358979f;
+
+    float FastSin(float angle)
+    {
+        // Into [-pi, pi], then fold the outer quarters back onto [-pi/2, pi/2].
+        float t = angle * (0.5f / _PI);
+        t -= (float)_FloorToInt(t + 0.5f);
+        float x = t * (2.0f * _PI);
+        float ax = fabs(x);
+        x = copysign(min(ax, _PI - ax), x);
+        float x2 = x * x;
+        return x * (1.0f + x2 * (_SIN_C3 + x2 * (_SIN_C5 + x2 * (_SIN_C7 + x2 * (_SIN_C9 + x2 * _SIN_C11)))));
+    }
+
+    float FastCos(float angle)
+    {
+        return FastSin(angle + 0.5f * _PI);
+    }
+
+    // Batch kernels over structure-of-arrays point sets: xs[i], ys[i] is point i. They use
+    // AVX or SSE2 when the compiler targets them (-mavx, or any x86-64 build for SSE2) and
+    // plain loops otherwise. Output arrays may alias the inputs.
+    #if defined(__AVX__)
+    typedef __m256 _simd_float;
+    const int _SIMD_WIDTH = 8;
+    inline _simd_float _SimdLoad(const float* p) { return _mm256_loadu_ps(p); }
+    inline void _SimdStore(float* p, _simd_float v) { _mm256_storeu_ps(p, v); }
+    inline _simd_float _SimdSet(float v) { return _mm256_set1_ps(v); }
+    inline _simd_float _SimdAdd(_simd_float a, _simd_float b) { return _mm256_add_ps(a, b); }
+    inline _simd_float _SimdSub(_simd_float a, _simd_float b) { return _mm256_sub_ps(a, b); }
+    inline _simd_float _SimdMul(_simd_float a, _simd_float b) { return _mm256_mul_ps(a, b); }
+    inline _simd_float _SimdDiv(_simd_float a, _simd_float b) { return _mm256_div_ps(a, b); }
+    inline _simd_float _SimdMin(_simd_float a, _simd_float b) { return _mm256_min_ps(a, b); }
+    inline _simd_float _SimdSqrt(_simd_float a) { return _mm256_sqrt_ps(a); }
+    inline _simd_float _SimdAnd(_simd_float a, _simd_float b) { return _mm256_and_ps(a, b); }
+    inline _simd_float _SimdAndNot(_simd_float a, _simd_float b) { return _mm256_andnot_ps(a, b); }
+    inline _simd_float _SimdOr(_simd_float a, _simd_float b) { return _mm256_or_ps(a, b); }
+    inline _simd_float _SimdNotZero(_simd_float a) { return _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_NEQ_OQ); }
+    inline _simd_float _SimdRound(_simd_float a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+    #elif defined(__SSE2__) || defined(_M_X64)
+    #define ENGINE2D_SIMD_SSE2
+    typedef __m128 _simd_float;
+    const int _SIMD_WIDTH = 4;
+    inline _simd_float _SimdLoad(const float* p) { return _mm_loadu_ps(p); }
+    inline void _SimdStore(float* p, _simd_float v) { _mm_storeu_ps(p, v); }
+    inline _simd_float _SimdSet(float v) { return _mm_set1_ps(v); }
+    inline _simd_float _SimdAdd(_simd_float a, _simd_float b) { return _mm_add_ps(a, b); }
+    inline _simd_float _SimdSub(_simd_float a, _simd_float b) { return _mm_sub_ps(a, b); }
+    inline _simd_float _SimdMul(_simd_float a, _simd_float b) { return _mm_mul_ps(a, b); }
+    inline _simd_float _SimdDiv(_simd_float a, _simd_float b) { return _mm_div_ps(a, b); }
+    inline _simd_float _SimdMin(_simd_float a, _simd_float b) { return _mm_min_ps(a, b); }
+    inline _simd_float _SimdSqrt(_simd_float a) { return _mm_sqrt_ps(a); }
+    inline _simd_float _SimdAnd(_simd_float a, _simd_float b) { return _mm_and_ps(a, b); }
+    inline _simd_float _SimdAndNot(_simd_float a, _simd_float b) { return _mm_andnot_ps(a, b); }
+    inline _simd_float _SimdOr(_simd_float a, _simd_float b) { return _mm_or_ps(a, b); }
+    inline _simd_float _SimdNotZero(_simd_float a) { return _mm_cmpneq_ps(a, _mm_setzero_ps()); }
+    inline _simd_float _SimdRound(_simd_float a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+    #else
+    const int _SIMD_WIDTH = 0;
+    #endif
+
+    #if defined(__AVX__) || defined(ENGINE2D_SIMD_SSE2)
+    #define ENGINE2D_SIMD
+    _simd_float _SimdSin(_simd_float angle)
+    {
+        const _simd_float sign_bit = _SimdSet(-0.0f);
+        _simd_float t = _SimdMul(angle, _SimdSet(0.5f / _PI));
+        t = _SimdSub(t, _SimdRound(t));
+        _simd_float x = _SimdMul(t, _SimdSet(2.0f * _PI));
+        _simd_float ax = _SimdAndNot(sign_bit, x);
+        x = _SimdOr(_SimdMin(ax, _SimdSub(_SimdSet(_PI), ax)), _SimdAnd(sign_bit, x));
+        _simd_float x2 = _SimdMul(x, x);
+        _simd_float p = _SimdAdd(_SimdSet(_SIN_C9), _SimdMul(x2, _SimdSet(_SIN_C11)));
+        p = _SimdAdd(_SimdSet(_SIN_C7), _SimdMul(x2, p));
+        p = _SimdAdd(_SimdSet(_SIN_C5), _SimdMul(x2, p));
+        p = _SimdAdd(_SimdSet(_SIN_C3), _SimdMul(x2, p));
+        p = _SimdAdd(_SimdSet(1.0f), _SimdMul(x2, p));
+        return _SimdMul(x, p);
+    }
+    #endif
+
+    void BatchSinCos(const float* angles, float* out_sin, float* out_cos, int n)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float quarter = _SimdSet(0.5f * _PI);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _simd_float a = _SimdLoad(angles + i);
+            _SimdStore(out_cos + i, _SimdSin(_SimdAdd(a, quarter)));
+            _SimdStore(out_sin + i, _SimdSin(a));
+        }
+        #endif
+        for(; i < n; i++)
         {
+            float a = angles[i];
+            out_cos[i] = FastCos(a);
+            out_sin[i] = FastSin(a);
+        }
+    }
+
+    void BatchAdd(float* v, int n, float d)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float vd = _SimdSet(d);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+            _SimdStore(v + i, _SimdAdd(_SimdLoad(v + i), vd));
+        #endif
+        for(; i < n; i++)
+            v[i] += d;
+    }
 
+    void BatchTranslate(float* xs, float* ys, int n, float dx, float dy)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float vdx = _SimdSet(dx), vdy = _SimdSet(dy);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _SimdStore(xs + i, _SimdAdd(_SimdLoad(xs + i), vdx));
+            _SimdStore(ys + i, _SimdAdd(_SimdLoad(ys + i), vdy));
         }
+        #endif
+        for(; i < n; i++)
+        {
+            xs[i] += dx;
+            ys[i] += dy;
+        }
+    }
 
-        virtual void OnMouseMove(float elapsed, int x, int y, int dx, int dy)
+    // xs[i] += vx[i] * scale, likewise for y. The usual position += velocity * elapsed step.
+    void BatchAddScaled(float* xs, float* ys, const float* vx, const float* vy, int n, float scale)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float vs = _SimdSet(scale);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _SimdStore(xs + i, _SimdAdd(_SimdLoad(xs + i), _SimdMul(_SimdLoad(vx + i), vs)));
+            _SimdStore(ys + i, _SimdAdd(_SimdLoad(ys + i), _SimdMul(_SimdLoad(vy + i), vs)));
+        }
+        #endif
+        for(; i < n; i++)
         {
+            xs[i] += vx[i] * scale;
+            ys[i] += vy[i] * scale;
+        }
+    }
 
+    void BatchScale(float* xs, float* ys, int n, float sx, float sy)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float vsx = _SimdSet(sx), vsy = _SimdSet(sy);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _SimdStore(xs + i, _SimdMul(_SimdLoad(xs + i), vsx));
+            _SimdStore(ys + i, _SimdMul(_SimdLoad(ys + i), vsy));
+        }
+        #endif
+        for(; i < n; i++)
+        {
+            xs[i] *= sx;
+            ys[i] *= sy;
         }
+    }
 
-        virtual void OnKeyRelease(float elapsed, Button key)
+    // Rotates every point about the origin by the same angle.
+    void BatchRotate(float* xs, float* ys, int n, float angle)
+    {
+        Transform2D r = Transform2D::Rotation(angle);
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float vc = _SimdSet(r.a), vs = _SimdSet(r.b);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _simd_float x = _SimdLoad(xs + i), y = _SimdLoad(ys + i);
+            _SimdStore(xs + i, _SimdSub(_SimdMul(x, vc), _SimdMul(y, vs)));
+            _SimdStore(ys + i, _SimdAdd(_SimdMul(x, vs), _SimdMul(y, vc)));
+        }
+        #endif
+        for(; i < n; i++)
         {
+            float x = xs[i], y = ys[i];
+            xs[i] = x * r.a - y * r.b;
+            ys[i] = x * r.b + y * r.a;
+        }
+    }
 
+    // Rotates point i about the origin by angles[i], using the fast sine and cosine.
+    void BatchRotateEach(float* xs, float* ys, const float* angles, int n)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float quarter = _SimdSet(0.5f * _PI);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _simd_float a = _SimdLoad(angles + i);
+            _simd_float s = _SimdSin(a), c = _SimdSin(_SimdAdd(a, quarter));
+            _simd_float x = _SimdLoad(xs + i), y = _SimdLoad(ys + i);
+            _SimdStore(xs + i, _SimdSub(_SimdMul(x, c), _SimdMul(y, s)));
+            _SimdStore(ys + i, _SimdAdd(_SimdMul(x, s), _SimdMul(y, c)));
+        }
+        #endif
+        for(; i < n; i++)
+        {
+            float s = FastSin(angles[i]), c = FastCos(angles[i]);
+            float x = xs[i], y = ys[i];
+            xs[i] = x * c - y * s;
+            ys[i] = x * s + y * c;
         }
+    }
 
-        virtual void OnTextInput(float elapsed, unsigned char key)
+    // Zero length vectors stay zero, as with Vector2::Normalise().
+    void BatchNormalise(float* xs, float* ys, int n)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float one = _SimdSet(1.0f);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
         {
-            
+            _simd_float x = _SimdLoad(xs + i), y = _SimdLoad(ys + i);
+            _simd_float l = _SimdSqrt(_SimdAdd(_SimdMul(x, x), _SimdMul(y, y)));
+            _simd_float inv = _SimdAnd(_SimdNotZero(l), _SimdDiv(one, l));
+            _SimdStore(xs + i, _SimdMul(x, inv));
+            _SimdStore(ys + i, _SimdMul(y, inv));
+        }
+        #endif
+        for(; i < n; i++)
+        {
+            float l = sqrt(xs[i] * xs[i] + ys[i] * ys[i]);
+            float inv = (l == 0.0f) ? 0.0f : 1.0f / l;
+            xs[i] *= inv;
+            ys[i] *= inv;
         }
+    }
 
-        virtual void OnTimerTick(float elapsed, Timer timer_id)
+    void BatchLength(const float* xs, const float* ys, float* out, int n)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
         {
+            _simd_float x = _SimdLoad(xs + i), y = _SimdLoad(ys + i);
+            _SimdStore(out + i, _SimdSqrt(_SimdAdd(_SimdMul(x, x), _SimdMul(y, y))));
+        }
+        #endif
+        for(; i < n; i++)
+            out[i] = sqrt(xs[i] * xs[i] + ys[i] * ys[i]);
+    }
+
+    void BatchDot(const float* ax, const float* ay, const float* bx, const float* by, float* out, int n)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+            _SimdStore(out + i, _SimdAdd(_SimdMul(_SimdLoad(ax + i), _SimdLoad(bx + i)), _SimdMul(_SimdLoad(ay + i), _SimdLoad(by + i))));
+        #endif
+        for(; i < n; i++)
+            out[i] = ax[i] * bx[i] + ay[i] * by[i];
+    }
 
+    void BatchTransform(Transform2D const &t, const float* xs, const float* ys, float* out_x, float* out_y, int n)
+    {
+        int i = 0;
+        #ifdef ENGINE2D_SIMD
+        const _simd_float va = _SimdSet(t.a), vb = _SimdSet(t.b), vc = _SimdSet(t.c), vd = _SimdSet(t.d);
+        const _simd_float vtx = _SimdSet(t.tx), vty = _SimdSet(t.ty);
+        for(; i + _SIMD_WIDTH <= n; i += _SIMD_WIDTH)
+        {
+            _simd_float x = _SimdLoad(xs + i), y = _SimdLoad(ys + i);
+            _SimdStore(out_x + i, _SimdAdd(_SimdAdd(_SimdMul(va, x), _SimdMul(vc, y)), vtx));
+            _SimdStore(out_y + i, _SimdAdd(_SimdAdd(_SimdMul(vb, x), _SimdMul(vd, y)), vty));
         }
+        #endif
+        for(; i < n; i++)
+        {
+            float x = xs[i], y = ys[i];
+            out_x[i] = t.a * x + t.c * y + t.tx;
+            out_y[i] = t.b * x + t.d * y + t.ty;
+        }
+    }
 
-        virtual void OnDestroy(void)
+    class BoundingBox
+    {
+        public:
+        float min_x, min_y, max_x, max_y;
+
+        BoundingBox()
         {
+            this->min_x = 0.0f; this->min_y = 0.0f;
+            this->max_x = 0.0f; this->max_y = 0.0f;
+        }
 
+        BoundingBox(float min_x, float min_y, float max_x, float max_y)
+        {
+            this->min_x = min_x; this->min_y = min_y;
+            this->max_x = max_x; this->max_y = max_y;
         }
 
-        
+        static BoundingBox FromCircle(float x, float y, float radius)
+        {
+            return BoundingBox(x - radius, y - radius, x + radius, y + radius);
+        }
 
-        Application()
+        bool Overlaps(const BoundingBox& b) const
         {
+            return min_x <= b.max_x && b.min_x <= max_x && min_y <= b.max_y && b.min_y <= max_y;
+        }
 
+        bool Contains(float x, float y) const
+        {
+            return x >= min_x && x <= max_x && y >= min_y && y <= max_y;
         }
     };
 
-    SDL_Window* application_window = NULL;
-    SDL_Renderer* window_renderer = NULL;
-    SDL_Texture* screen_texture = NULL;
-    
-    Application* app = NULL;
-
-    vector<uint16_t> shape_array_x;
-    vector<uint16_t> shape_array_y;
-    static _internal_timer_t timers[256];
+    typedef struct
+    {
+        uint32_t a, b;
+    } BroadPhasePair;
 
-    int shape_x, shape_y;
-    bool shape_free = true;
-    bool shape_fill;
-    uint8_t shape_r, shape_g, shape_b, shape_a;
+    const uint32_t _BROADPHASE_NIL = 0xFFFFFFFF;
 
-    bool key_array[static_cast<int>(Button::TOTAL_BUTTONS)];
+    // Shapes are a box plus a radius; a radius above zero means a circle centred in the box.
+    bool _BroadPhaseOverlapCircle(const BoundingBox& box, float radius, float x, float y, float r)
+    {
+        if(radius > 0.0f)
+        {
+            float dx = (box.min_x + radius) - x;
+            float dy = (box.min_y + radius) - y;
+            float rr = radius + r;
+            return dx * dx + dy * dy <= rr * rr;
+        }
+        float dx = x - Clamp(x, box.min_x, box.max_x);
+        float dy = y - Clamp(y, box.min_y, box.max_y);
+        return dx * dx + dy * dy <= r * r;
+    }
 
+    bool _BroadPhaseOverlapRegion(const BoundingBox& box, float radius, const BoundingBox& region)
+    {
+        if(!box.Overlaps(region))
+            return false;
+        if(radius <= 0.0f)
+            return true;
+        float cx = box.min_x + radius;
+        float cy = box.min_y + radius;
+        return _BroadPhaseOverlapCircle(box, radius, Clamp(cx, region.min_x, region.max_x), Clamp(cy, region.min_y, region.max_y), 0.0f);
+    }
 
-    unsigned int screen_width = 0;
-    unsigned int screen_height = 0;
-    unsigned int window_width = 0;
-    unsigned int window_height = 0;
-    unsigned int window_scale = 0;
+    bool _BroadPhaseOverlap(const BoundingBox& a, float radius_a, const BoundingBox& b, float radius_b)
+    {
+        if(!a.Overlaps(b))
+            return false;
+        if(radius_a > 0.0f)
+            return _BroadPhaseOverlapCircle(b, radius_b, a.min_x + radius_a, a.min_y + radius_a, radius_a);
+        if(radius_b > 0.0f)
+            return _BroadPhaseOverlapCircle(a, radius_a, b.min_x + radius_b, b.min_y + radius_b, radius_b);
+        return true;
+    }
 
-    class Image
+    // Narrows [*t0, *t1] to the part of the ray inside box. False when nothing is left.
+    bool _BroadPhaseRayClip(const BoundingBox& box, float ox, float oy, float dx, float dy, float* t0, float* t1)
     {
-        public:
-        int width, height;
-        SDL_Texture* data;
-        SDL_Surface* image;
-        
-        Image(string filename)
+        float o_axis[2] = {ox, oy};
+        float d_axis[2] = {dx, dy};
+        float lo[2] = {box.min_x, box.min_y};
+        float hi[2] = {box.max_x, box.max_y};
+        for(int i = 0; i < 2; i++)
         {
-            SDL_Surface* im = IMG_Load(filename.c_str());
-            this->image = im;
-            if(im == NULL)
+            if(d_axis[i] == 0.0f)
             {
-                ERROR_OUT("Could not load image: %s\nMessage: %s\n", filename.c_str(), SDL_GetError());
-                this->data = NULL;
-            }
-            else
-            {
-                this->data = SDL_CreateTextureFromSurface(window_renderer, im);
-                this->width = im->w;
-                this->height = im->h;
+                if(o_axis[i] < lo[i] || o_axis[i] > hi[i])
+                    return false;
+                continue;
             }
+            float inv = 1.0f / d_axis[i];
+            float ta = (lo[i] - o_axis[i]) * inv;
+            float tb = (hi[i] - o_axis[i]) * inv;
+            if(ta > tb)
+                swap(ta, tb);
+            *t0 = max(*t0, ta);
+            *t1 = min(*t1, tb);
+            if(!(*t0 <= *t1))
+                return false;
         }
+        return true;
+    }
 
-        Image(SDL_Surface* im)
+    // Distance along a normalised ray to the object, or a negative value on a miss.
+    float _BroadPhaseRayHit(const BoundingBox& box, float radius, float ox, float oy, float dx, float dy, float max_t)
+    {
+        if(radius > 0.0f)
         {
-            this->image = SDL_CreateRGBSurfaceFrom(im->pixels, im->w, im->h, im->format->BitsPerPixel, im->pitch, im->format->Rmask, im->format->Gmask, im->format->Bmask, im->format->Amask);
-            this->width = im->w;
-            this->height = im->h;
-            this->data = SDL_CreateTextureFromSurface(window_renderer, im);
+            float cx = ox - (box.min_x + radius);
+            float cy = oy - (box.min_y + radius);
+            float b = cx * dx + cy * dy;
+            float c = cx * cx + cy * cy - radius * radius;
+            if(c <= 0.0f)
+                return 0.0f;
+            float disc = b * b - c;
+            if(b > 0.0f || disc < 0.0f)
+                return -1.0f;
+            float t = -b - sqrt(disc);
+            return (t <= max_t) ? t : -1.0f;
         }
+        float t0 = 0.0f, t1 = max_t;
+        return _BroadPhaseRayClip(box, ox, oy, dx, dy, &t0, &t1) ? t0 : -1.0f;
+    }
 
-        void DrawImage(int x, int y, int offsetx=0, int offsety=0, int w=0, int h=0, float angle=0.0f, int pivotx=0, int pivoty=0, float scale = 1.0, bool h_flip=false, bool v_flip=false)
+    // Walks the cells of a uniform grid crossed by a ray, in order. visit(cx, cy, t_enter)
+    // returns false to stop early.
+    template<typename F>
+    void _TraverseGrid(float ox, float oy, float dx, float dy, float max_t, float cell_w, float cell_h, float grid_x, float grid_y, F visit)
+    {
+        float gx = (ox - grid_x) / cell_w;
+        float gy = (oy - grid_y) / cell_h;
+        int cx = _FloorToInt(gx);
+        int cy = _FloorToInt(gy);
+        int step_x = (dx > 0.0f) ? 1 : -1;
+        int step_y = (dy > 0.0f) ? 1 : -1;
+        float t_delta_x = (dx != 0.0f) ? fabs(cell_w / dx) : INFINITY;
+        float t_delta_y = (dy != 0.0f) ? fabs(cell_h / dy) : INFINITY;
+        float t_next_x = (dx > 0.0f) ? (cx + 1 - gx) * t_delta_x : (dx < 0.0f) ? (gx - cx) * t_delta_x : INFINITY;
+        float t_next_y = (dy > 0.0f) ? (cy + 1 - gy) * t_delta_y : (dy < 0.0f) ? (gy - cy) * t_delta_y : INFINITY;
+        float t = 0.0f;
+        while(t <= max_t)
         {
-            SDL_Rect src, dest;
-            SDL_Point p;
-            SDL_RendererFlip flip = SDL_FLIP_NONE;
-            p.x = pivotx;
-            p.y = pivoty;
-            src.x = offsetx; src.y = offsety;
-            if(w == 0 || h == 0)
+            if(!visit(cx, cy, t))
+                return;
+            if(t_next_x < t_next_y)
             {
-                src.w = this->width - offsetx; src.h = this->height - offsety;
+                t = t_next_x;
+                t_next_x += t_delta_x;
+                cx += step_x;
             }
             else
             {
-                src.w = w; src.h = h;
+                t = t_next_y;
+                t_next_y += t_delta_y;
+                cy += step_y;
             }
-
-            dest.x = x; dest.y = y; dest.w = src.w * scale; dest.h = src.h * scale;
-            
-
-            if(h_flip)
-                flip = (SDL_RendererFlip)((int)flip | SDL_FLIP_HORIZONTAL);
-            if(v_flip)
-                flip = (SDL_RendererFlip)((int)flip | SDL_FLIP_VERTICAL);
-
-            SDL_RenderCopyEx(window_renderer, this->data, &src, &dest, angle, &p, flip);
         }
+    }
 
-        void GetPixel(int x, int y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+    // Uniform grid hashed into a power of two number of buckets. Objects are addressed by
+    // small dense ids (usually their index in the application's own arrays) and get one
+    // entry in every cell their box touches. Entries are kept sorted by bucket in a single
+    // array, with a copy of the box, so queries and pair searches read memory linearly.
+    // Moves that stay inside the same cells patch the entries in place; anything else
+    // marks the hash dirty and the next query re-sorts it in one pass, so a frame full of
+    // moves costs the same as a Rebuild. Cells should be around the size of a typical object.
+    class SpatialHash
+    {
+        public:
+        float cell_size;
+
+        SpatialHash(float cell_size, unsigned int bucket_count = 4096)
         {
-            int bpp = image->format->BytesPerPixel;
-            uint8_t *p = (Uint8 *)image->pixels + y * image->pitch + x * bpp;
-            if(bpp != 3 && bpp != 4)
-            {
-                ERROR_OUT("Unable to get pixel! Non-RGB or Non-RGBA surfaces not supported.\n");
-            }
-            if(bpp == 3)
-            {
-                *r = p[0];
-                *g = p[1];
-                *b = p[2];
-                *a = 255;
-            }
-            else
-            {
-                *r = p[0];
-                *g = p[1];
-                *b = p[2];
-                *a = p[3];
-            }
+            this->cell_size = cell_size;
+            this->inv_cell_size = 1.0f / cell_size;
+            _ResizeBuckets(bucket_count);
         }
 
-        void Colourise(uint8_t r, uint8_t g, uint8_t b)
+        void Clear()
         {
-            SDL_SetTextureColorMod(this->data, r, g, b);
+            objects.clear();
+            entries.clear();
+            fill(bucket_start.begin(), bucket_start.end(), 0);
+            dirty = false;
         }
 
-        void TransparentColour(bool enable, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        void Insert(uint32_t id, const BoundingBox& box)
         {
-            if(enable)
-            {
-                SDL_SetColorKey(this->image, SDL_TRUE, (uint32_t)((r << 24) + (g << 16) + (b << 8) + (a)));
-            }
-            else
-            {
-                SDL_SetColorKey(this->image, SDL_FALSE, 0);
-            }
-            SDL_DestroyTexture(this->data);
-            this->data = SDL_CreateTextureFromSurface(window_renderer, this->image);
+            if(id >= objects.size())
+                objects.resize(id + 1);
+            objects[id].box = box;
+            objects[id].radius = 0.0f;
+            objects[id].active = true;
+            dirty = true;
         }
 
-
-        ~Image()
+        void InsertCircle(uint32_t id, float x, float y, float radius)
         {
-            SDL_FreeSurface(this->image);
-            SDL_DestroyTexture(this->data);
+            Insert(id, BoundingBox::FromCircle(x, y, radius));
+            objects[id].radius = radius;
         }
-    };
-
-    class Sprite
-    {
-        public:
-        Image* im;
-        int sheet_width, sheet_height;
-        int sprite_width, sprite_height;
-        int total_frames;
-        float current_frame = 0.0f;
 
-        Sprite(string filename, int vert_lines, int horiz_lines)
+        void Move(uint32_t id, const BoundingBox& box)
         {
-            CreateSprite(new Image(filename), vert_lines, horiz_lines);
+            _Move(id, box, 0.0f);
         }
 
-        Sprite(Image* im, int vert_lines, int horiz_lines)
+        void MoveCircle(uint32_t id, float x, float y, float radius)
         {
-            CreateSprite(im, vert_lines, horiz_lines);
+            _Move(id, BoundingBox::FromCircle(x, y, radius), radius);
         }
 
-        void CreateSprite(Image* img, int vert_lines, int horiz_lines)
+        void Remove(uint32_t id)
         {
-            this->im = img;
-            this->sheet_width = img->width;
-            this->sheet_height = img->height;
-            this->sprite_width = img->width / vert_lines;
-            this->sprite_height = img->height / horiz_lines;
-            this->total_frames = img->width * img->height / (this->sprite_width * this->sprite_height);
+            if(id >= objects.size() || !objects[id].active)
+                return;
+            objects[id].active = false;
+            dirty = true;
         }
 
-        void IncrementFrame(float increment)
+        // Replaces every object with boxes[0..count), ids being the array indices.
+        void Rebuild(const BoundingBox* boxes, uint32_t count)
         {
-            this->current_frame += increment;
-            if(this->current_frame >= this->total_frames)
-                this->current_frame = 0;
+            objects.resize(count);
+            for(uint32_t i = 0; i < count; i++)
+            {
+                objects[i].box = boxes[i];
+                objects[i].radius = 0.0f;
+                objects[i].active = true;
+            }
+            _Sort();
         }
 
-        void DrawSprite(int frame, int x, int y, float angle = 0.0f, int pivotx = 0, int pivoty = 0, float scale = 1.0f, bool h_flip = false, bool v_flip = false)
+        void RebuildCircles(const float* x, const float* y, const float* radius, uint32_t count)
         {
-            if(frame == -1)
+            objects.resize(count);
+            for(uint32_t i = 0; i < count; i++)
             {
-                frame = this->current_frame;
+                objects[i].box = BoundingBox::FromCircle(x[i], y[i], radius[i]);
+                objects[i].radius = radius[i];
+                objects[i].active = true;
             }
-            int sx = sprite_width * (frame % (sheet_width / (int)sprite_width));
-            int sy = sprite_height * (int)(frame / (int) (sheet_width / (int)sprite_width));
-            this->im->DrawImage(x, y, sx, sy, sprite_width, sprite_height, angle, pivotx, pivoty, scale, h_flip, v_flip);
+            _Sort();
         }
 
-        void GetPixel(int frame, int x, int y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+        void QueryRegion(const BoundingBox& region, vector<uint32_t>& out)
         {
-            int sx = sprite_width * (frame % (sheet_width / (int)sprite_width));
-            int sy = sprite_height * (int)(frame / (int) (sheet_width / (int)sprite_width));
-            this->im->GetPixel(sx + x, sy + y, r, g, b, a);
+            out.clear();
+            _Query(region, [&](const _internal_hash_entry_t& e) { return _BroadPhaseOverlapRegion(e.box, e.radius, region); }, out);
         }
-    };
 
-    class BitmapFont
-    {
-        public:
-        Image* im;
-        int character_width, character_height;
-        int fontsheet_width, fontsheet_height;
-        int characters_per_line;
+        void QueryRadius(float x, float y, float radius, vector<uint32_t>& out)
+        {
+            out.clear();
+            _Query(BoundingBox::FromCircle(x, y, radius), [&](const _internal_hash_entry_t& e) { return _BroadPhaseOverlapCircle(e.box, e.radius, x, y, radius); }, out);
+        }
+
+        // Nearest object hit by the ray within max_distance.
+        bool Raycast(Vector2 origin, Vector2 direction, float max_distance, uint32_t* hit_id, float* hit_distance = NULL)
+        {
+            direction.Normalise();
+            if(direction.x == 0.0f && direction.y == 0.0f)
+                return false;
+            if(dirty)
+                _Sort();
+            // Only the stretch of the ray crossing occupied cells is walked, so rays that miss
+            // everything stop there even with an infinite max_distance.
+            float t_in = 0.0f, t_out = max_distance;
+            if(entries.empty() || !_BroadPhaseRayClip(occupied, origin.x, origin.y, direction.x, direction.y, &t_in, &t_out))
+                return false;
+            float best = max_distance;
+            uint32_t best_id = _BROADPHASE_NIL;
+            float sx = origin.x + direction.x * t_in;
+            float sy = origin.y + direction.y * t_in;
+            _TraverseGrid(sx, sy, direction.x, direction.y, t_out - t_in, cell_size, cell_size, 0.0f, 0.0f, [&](int cx, int cy, float t_enter)
+            {
+                if(t_in + t_enter > best)
+                    return false;
+                uint32_t h = _Hash(cx, cy);
+                for(uint32_t i = bucket_start[h]; i < bucket_start[h + 1]; i++)
+                {
+                    const _internal_hash_entry_t& e = entries[i];
+                    if(e.cx != cx || e.cy != cy)
+                        continue;
+                    float t = _BroadPhaseRayHit(e.box, e.radius, origin.x, origin.y, direction.x, direction.y, best);
+                    if(t >= 0.0f && (t < best || best_id == _BROADPHASE_NIL))
+                    {
+                        best = t;
+                        best_id = e.id;
+                    }
+                }
+                return true;
+            });
+            if(best_id == _BROADPHASE_NIL)
+                return false;
+            *hit_id = best_id;
+            if(hit_distance != NULL)
+                *hit_distance = best;
+            return true;
+        }
+
+        // Every overlapping pair exactly once, with a < b. A pair is only reported from the
+        // cell holding the top left corner of the two boxes' intersection.
+        void FindPairs(vector<BroadPhasePair>& out)
+        {
+            out.clear();
+            if(dirty)
+                _Sort();
+            for(unsigned int h = 0; h + 1 < bucket_start.size(); h++)
+            {
+                uint32_t end = bucket_start[h + 1];
+                for(uint32_t i = bucket_start[h]; i < end; i++)
+                {
+                    const _internal_hash_entry_t& a = entries[i];
+                    for(uint32_t j = i + 1; j < end; j++)
+                    {
+                        const _internal_hash_entry_t& b = entries[j];
+                        // Single branch on the common reject; buckets mix cells after hashing.
+                        bool candidate = (a.cx == b.cx) & (a.cy == b.cy) & (a.box.min_x <= b.box.max_x) & (b.box.min_x <= a.box.max_x) & (a.box.min_y <= b.box.max_y) & (b.box.min_y <= a.box.max_y);
+                        if(!candidate || !_BroadPhaseOverlap(a.box, a.radius, b.box, b.radius))
+                            continue;
+                        if(_Cell(max(a.box.min_x, b.box.min_x)) != a.cx || _Cell(max(a.box.min_y, b.box.min_y)) != a.cy)
+                            continue;
+                        BroadPhasePair p;
+                        p.a = min(a.id, b.id);
+                        p.b = max(a.id, b.id);
+                        out.push_back(p);
+                    }
+                }
+            }
+        }
+
+        private:
+        typedef struct
+        {
+            BoundingBox box;
+            float radius = 0.0f;
+            bool active = false;
+        } _internal_hash_object_t;
+
+        typedef struct
+        {
+            BoundingBox box;
+            float radius;
+            uint32_t id;
+            int32_t cx, cy;
+        } _internal_hash_entry_t;
+
+        float inv_cell_size;
+        bool dirty = false;
+        // Union of the cells holding entries, as of the last sort.
+        BoundingBox occupied;
+        vector<_internal_hash_object_t> objects;
+        vector<_internal_hash_entry_t> entries;
+        vector<uint32_t> bucket_start;
+        vector<uint32_t> bucket_fill;
+        vector<uint32_t> stamps;
+        uint32_t stamp_counter = 0;
+
+        void _ResizeBuckets(unsigned int count)
+        {
+            unsigned int n = 1;
+            while(n < count)
+                n <<= 1;
+            bucket_start.assign(n + 1, 0);
+            dirty = true;
+        }
+
+        int _Cell(float v)
+        {
+            return _FloorToInt(v * inv_cell_size);
+        }
+
+        uint32_t _Hash(int cx, int cy)
+        {
+            return (((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u)) & (uint32_t)(bucket_start.size() - 2);
+        }
+
+        void _CellRange(const BoundingBox& box, int* x0, int* y0, int* x1, int* y1)
+        {
+            *x0 = _Cell(box.min_x); *y0 = _Cell(box.min_y);
+            *x1 = _Cell(box.max_x); *y1 = _Cell(box.max_y);
+        }
+
+        void _Move(uint32_t id, const BoundingBox& box, float radius)
+        {
+            if(id >= objects.size() || !objects[id].active || dirty)
+            {
+                Insert(id, box);
+                objects[id].radius = radius;
+                return;
+            }
+            int ox0, oy0, ox1, oy1, nx0, ny0, nx1, ny1;
+            _CellRange(objects[id].box, &ox0, &oy0, &ox1, &oy1);
+            _CellRange(box, &nx0, &ny0, &nx1, &ny1);
+            objects[id].box = box;
+            objects[id].radius = radius;
+            if(ox0 != nx0 || oy0 != ny0 || ox1 != nx1 || oy1 != ny1)
+            {
+                dirty = true;
+                return;
+            }
+            for(int cy = ny0; cy <= ny1; cy++)
+            {
+                for(int cx = nx0; cx <= nx1; cx++)
+                {
+                    uint32_t h = _Hash(cx, cy);
+                    for(uint32_t i = bucket_start[h]; i < bucket_start[h + 1]; i++)
+                    {
+                        if(entries[i].id == id && entries[i].cx == cx && entries[i].cy == cy)
+                        {
+                            entries[i].box = box;
+                            entries[i].radius = radius;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Counting sort of every (object, cell) entry by bucket.
+        void _Sort()
+        {
+            unsigned int buckets = bucket_start.size() - 1;
+            if(buckets < objects.size())
+            {
+                unsigned int n = buckets;
+                while(n < objects.size())
+                    n <<= 1;
+                bucket_start.assign(n + 1, 0);
+                buckets = n;
+            }
+            fill(bucket_start.begin(), bucket_start.end(), 0);
+
+            uint32_t total = 0;
+            int min_cx = INT_MAX, min_cy = INT_MAX, max_cx = INT_MIN, max_cy = INT_MIN;
+            for(uint32_t id = 0; id < objects.size(); id++)
+            {
+                if(!objects[id].active)
+                    continue;
+                int x0, y0, x1, y1;
+                _CellRange(objects[id].box, &x0, &y0, &x1, &y1);
+                min_cx = min(min_cx, x0);
+                min_cy = min(min_cy, y0);
+                max_cx = max(max_cx, x1);
+                max_cy = max(max_cy, y1);
+                for(int cy = y0; cy <= y1; cy++)
+                    for(int cx = x0; cx <= x1; cx++, total++)
+                        bucket_start[_Hash(cx, cy) + 1]++;
+            }
+            for(unsigned int h = 0; h < buckets; h++)
+                bucket_start[h + 1] += bucket_start[h];
+
+            entries.resize(total);
+            if(total > 0)
+                occupied = BoundingBox(min_cx * cell_size, min_cy * cell_size, (max_cx + 1) * cell_size, (max_cy + 1) * cell_size);
+            bucket_fill.assign(bucket_start.begin(), bucket_start.end() - 1);
+            for(uint32_t id = 0; id < objects.size(); id++)
+            {
+                const _internal_hash_object_t& o = objects[id];
+                if(!o.active)
+                    continue;
+                int x0, y0, x1, y1;
+                _CellRange(o.box, &x0, &y0, &x1, &y1);
+                for(int cy = y0; cy <= y1; cy++)
+                {
+                    for(int cx = x0; cx <= x1; cx++)
+                    {
+                        _internal_hash_entry_t& e = entries[bucket_fill[_Hash(cx, cy)]++];
+                        e.box = o.box;
+                        e.radius = o.radius;
+                        e.id = id;
+                        e.cx = cx;
+                        e.cy = cy;
+                    }
+                }
+            }
+            dirty = false;
+        }
+
+        uint32_t _NextStamp()
+        {
+            if(stamps.size() < objects.size())
+                stamps.resize(objects.size(), 0);
+            if(++stamp_counter == 0)
+            {
+                fill(stamps.begin(), stamps.end(), 0);
+                stamp_counter = 1;
+            }
+            return stamp_counter;
+        }
+
+        template<typename F>
+        void _Query(const BoundingBox& region, F test, vector<uint32_t>& out)
+        {
+            if(dirty)
+                _Sort();
+            uint32_t stamp = _NextStamp();
+            int x0, y0, x1, y1;
+            _CellRange(region, &x0, &y0, &x1, &y1);
+            // Regions covering more cells than there are buckets are cheaper as a linear scan.
+            if((int64_t)(x1 - x0 + 1) * (y1 - y0 + 1) > (int64_t)(bucket_start.size() - 1))
+            {
+                for(uint32_t i = 0; i < entries.size(); i++)
+                {
+                    const _internal_hash_entry_t& e = entries[i];
+                    if(e.cx < x0 || e.cx > x1 || e.cy < y0 || e.cy > y1 || stamps[e.id] == stamp)
+                        continue;
+                    stamps[e.id] = stamp;
+                    if(test(e))
+                        out.push_back(e.id);
+                }
+                return;
+            }
+            for(int cy = y0; cy <= y1; cy++)
+            {
+                for(int cx = x0; cx <= x1; cx++)
+                {
+                    uint32_t h = _Hash(cx, cy);
+                    for(uint32_t i = bucket_start[h]; i < bucket_start[h + 1]; i++)
+                    {
+                        const _internal_hash_entry_t& e = entries[i];
+                        if(e.cx != cx || e.cy != cy || stamps[e.id] == stamp)
+                            continue;
+                        stamps[e.id] = stamp;
+                        if(test(e))
+                            out.push_back(e.id);
+                    }
+                }
+            }
+        }
+    };
+
+    // Loose quadtree stored as one grid per level. An object lives in exactly one cell: the
+    // deepest level whose cells are at least as big as the object, at the cell holding its
+    // centre. Cells are "loose" by half a cell on every side, so queries widen accordingly.
+    // Cells hold doubly linked lists, so Insert, Move and Remove are all constant time.
+    // Objects outside the world bounds are clamped into the edge cells.
+    class LooseQuadtree
+    {
+        public:
+        BoundingBox world;
+        int depth;
+
+        LooseQuadtree(const BoundingBox& world, int depth = 8)
+        {
+            this->world = world;
+            this->depth = max(1, min(depth, 12));
+            uint32_t offset = 0;
+            for(int l = 0; l < this->depth; l++)
+            {
+                level_offset[l] = offset;
+                level_count[l] = 0;
+                offset += (1u << l) * (1u << l);
+            }
+            level_offset[this->depth] = offset;
+            heads.assign(offset, _BROADPHASE_NIL);
+        }
+
+        void Clear()
+        {
+            fill(heads.begin(), heads.end(), _BROADPHASE_NIL);
+            fill(level_count, level_count + depth, 0);
+            outside_count = 0;
+            objects.clear();
+        }
+
+        void Insert(uint32_t id, const BoundingBox& box)
+        {
+            if(id >= objects.size())
+                objects.resize(id + 1);
+            if(objects[id].active)
+                _Unlink(id);
+            objects[id].box = box;
+            objects[id].radius = 0.0f;
+            objects[id].active = true;
+            _Link(id, _CellFor(box));
+        }
+
+        void InsertCircle(uint32_t id, float x, float y, float radius)
+        {
+            Insert(id, BoundingBox::FromCircle(x, y, radius));
+            objects[id].radius = radius;
+        }
+
+        void Move(uint32_t id, const BoundingBox& box)
+        {
+            _Move(id, box, 0.0f);
+        }
+
+        void MoveCircle(uint32_t id, float x, float y, float radius)
+        {
+            _Move(id, BoundingBox::FromCircle(x, y, radius), radius);
+        }
+
+        void Remove(uint32_t id)
+        {
+            if(id >= objects.size() || !objects[id].active)
+                return;
+            _Unlink(id);
+            objects[id].active = false;
+        }
+
+        void Rebuild(const BoundingBox* boxes, uint32_t count)
+        {
+            Clear();
+            objects.resize(count);
+            for(uint32_t i = 0; i < count; i++)
+            {
+                objects[i].box = boxes[i];
+                objects[i].active = true;
+                _Link(i, _CellFor(boxes[i]));
+            }
+        }
+
+        void RebuildCircles(const float* x, const float* y, const float* radius, uint32_t count)
+        {
+            Clear();
+            objects.resize(count);
+            for(uint32_t i = 0; i < count; i++)
+            {
+                objects[i].box = BoundingBox::FromCircle(x[i], y[i], radius[i]);
+                objects[i].radius = radius[i];
+                objects[i].active = true;
+                _Link(i, _CellFor(objects[i].box));
+            }
+        }
+
+        void QueryRegion(const BoundingBox& region, vector<uint32_t>& out)
+        {
+            out.clear();
+            _ForEachCandidate(region, depth - 1, [&](uint32_t id, int)
+            {
+                const _internal_quadtree_object_t& o = objects[id];
+                if(_BroadPhaseOverlapRegion(o.box, o.radius, region))
+                    out.push_back(id);
+            });
+        }
+
+        void QueryRadius(float x, float y, float radius, vector<uint32_t>& out)
+        {
+            out.clear();
+            _ForEachCandidate(BoundingBox::FromCircle(x, y, radius), depth - 1, [&](uint32_t id, int)
+            {
+                if(_BroadPhaseOverlapCircle(objects[id].box, objects[id].radius, x, y, radius))
+                    out.push_back(id);
+            });
+        }
+
+        bool Raycast(Vector2 origin, Vector2 direction, float max_distance, uint32_t* hit_id, float* hit_distance = NULL)
+        {
+            direction.Normalise();
+            if(direction.x == 0.0f && direction.y == 0.0f)
+                return false;
+            uint32_t stamp = _NextStamp();
+            float best = max_distance;
+            uint32_t best_id = _BROADPHASE_NIL;
+            auto test = [&](uint32_t id)
+            {
+                if(stamps[id] == stamp)
+                    return;
+                stamps[id] = stamp;
+                float t = _BroadPhaseRayHit(objects[id].box, objects[id].radius, origin.x, origin.y, direction.x, direction.y, best);
+                if(t >= 0.0f && (t < best || best_id == _BROADPHASE_NIL))
+                {
+                    best = t;
+                    best_id = id;
+                }
+            };
+            // Objects clamped in from outside the world can be hit where the grid walk does
+            // not reach, so the edge cells are checked in full while there are any.
+            if(outside_count > 0)
+            {
+                for(int l = 0; l < depth; l++)
+                {
+                    int side = 1 << l;
+                    for(int c = 0; c < side * side; c++)
+                    {
+                        int cx = c % side, cy = c / side;
+                        if(cx != 0 && cy != 0 && cx != side - 1 && cy != side - 1)
+                            continue;
+                        for(uint32_t id = heads[level_offset[l] + c]; id != _BROADPHASE_NIL; id = objects[id].next)
+                        {
+                            if(objects[id].outside)
+                                test(id);
+                        }
+                    }
+                }
+            }
+            for(int l = 0; l < depth; l++)
+            {
+                if(level_count[l] == 0)
+                    continue;
+                int side = 1 << l;
+                float cw = (world.max_x - world.min_x) / side;
+                float ch = (world.max_y - world.min_y) / side;
+                // Clip the ray to the world grown by the looseness of this level; objects
+                // whose centre is inside the world cannot reach any further.
+                BoundingBox level_bounds(world.min_x - cw * 0.5f, world.min_y - ch * 0.5f, world.max_x + cw * 0.5f, world.max_y + ch * 0.5f);
+                float t_in = _BroadPhaseRayHit(level_bounds, 0.0f, origin.x, origin.y, direction.x, direction.y, best);
+                if(t_in < 0.0f)
+                    continue;
+                float sx = origin.x + direction.x * t_in;
+                float sy = origin.y + direction.y * t_in;
+                _TraverseGrid(sx, sy, direction.x, direction.y, max_distance - t_in, cw, ch, world.min_x, world.min_y, [&](int cx, int cy, float t_enter)
+                {
+                    if(t_in + t_enter > best || cx < -1 || cy < -1 || cx > side || cy > side)
+                        return false;
+                    // Loose cells reach half a cell into their neighbours.
+                    for(int ny = max(cy - 1, 0); ny <= min(cy + 1, side - 1); ny++)
+                    {
+                        for(int nx = max(cx - 1, 0); nx <= min(cx + 1, side - 1); nx++)
+                        {
+                            for(uint32_t id = heads[level_offset[l] + ny * side + nx]; id != _BROADPHASE_NIL; id = objects[id].next)
+                                test(id);
+                        }
+                    }
+                    return true;
+                });
+            }
+            if(best_id == _BROADPHASE_NIL)
+                return false;
+            *hit_id = best_id;
+            if(hit_distance != NULL)
+                *hit_distance = best;
+            return true;
+        }
+
+        // Each object is tested against its own level and the coarser ones only, so every
+        // pair is seen once. Pairs are reported with a < b. The objects are first copied
+        // into cell order so neighbouring cells are also neighbours in memory.
+        void FindPairs(vector<BroadPhasePair>& out)
+        {
+            out.clear();
+            _SortByCell();
+            float world_w = world.max_x - world.min_x;
+            float world_h = world.max_y - world.min_y;
+            for(uint32_t i = 0; i < sorted.size(); i++)
+            {
+                const _internal_quadtree_sorted_t& a = sorted[i];
+                for(int l = 0; l <= a.level; l++)
+                {
+                    if(level_count[l] == 0)
+                        continue;
+                    int side = 1 << l;
+                    float sx = side / world_w;
+                    float sy = side / world_h;
+                    int x0 = max(0, min(_FloorToInt((a.box.min_x - world.min_x) * sx - 0.5f), side - 1));
+                    int x1 = max(0, min(_FloorToInt((a.box.max_x - world.min_x) * sx + 0.5f), side - 1));
+                    int y0 = max(0, min(_FloorToInt((a.box.min_y - world.min_y) * sy - 0.5f), side - 1));
+                    int y1 = max(0, min(_FloorToInt((a.box.max_y - world.min_y) * sy + 0.5f), side - 1));
+                    for(int cy = y0; cy <= y1; cy++)
+                    {
+                        uint32_t row = level_offset[l] + cy * side;
+                        // Cells of one row are contiguous in the sorted copy.
+                        uint32_t begin = cell_start[row + x0];
+                        uint32_t end = cell_start[row + x1 + 1];
+                        if(l == a.level && begin <= i)
+                            begin = i + 1;
+                        for(uint32_t j = begin; j < end; j++)
+                        {
+                            const _internal_quadtree_sorted_t& b = sorted[j];
+                            if(!_BroadPhaseOverlap(a.box, a.radius, b.box, b.radius))
+                                continue;
+                            BroadPhasePair p;
+                            p.a = min(a.id, b.id);
+                            p.b = max(a.id, b.id);
+                            out.push_back(p);
+                        }
+                    }
+                }
+            }
+        }
+
+        private:
+        typedef struct
+        {
+            BoundingBox box;
+            float radius = 0.0f;
+            uint32_t cell, prev, next;
+            int level;
+            bool active = false;
+            bool outside;
+        } _internal_quadtree_object_t;
+
+        typedef struct
+        {
+            BoundingBox box;
+            float radius;
+            uint32_t id;
+            int level;
+        } _internal_quadtree_sorted_t;
+
+        uint32_t level_offset[13];
+        uint32_t level_count[12];
+        uint32_t outside_count = 0;
+        vector<uint32_t> heads;
+        vector<_internal_quadtree_object_t> objects;
+        vector<_internal_quadtree_sorted_t> sorted;
+        vector<uint32_t> cell_start;
+        vector<uint32_t> cell_fill;
+        vector<uint32_t> stamps;
+        uint32_t stamp_counter = 0;
+
+        void _Move(uint32_t id, const BoundingBox& box, float radius)
+        {
+            if(id >= objects.size() || !objects[id].active)
+            {
+                Insert(id, box);
+                objects[id].radius = radius;
+                return;
+            }
+            uint32_t cell = _CellFor(box);
+            objects[id].box = box;
+            objects[id].radius = radius;
+            if(cell != objects[id].cell)
+            {
+                _Unlink(id);
+                _Link(id, cell);
+            }
+        }
+
+        int _LevelFor(const BoundingBox& box)
+        {
+            float w = box.max_x - box.min_x;
+            float h = box.max_y - box.min_y;
+            int l = depth - 1;
+            while(l > 0 && (w > (world.max_x - world.min_x) / (1 << l) || h > (world.max_y - world.min_y) / (1 << l)))
+                l--;
+            return l;
+        }
+
+        uint32_t _CellFor(const BoundingBox& box)
+        {
+            int l = _LevelFor(box);
+            int side = 1 << l;
+            int cx = _FloorToInt(((box.min_x + box.max_x) * 0.5f - world.min_x) / (world.max_x - world.min_x) * side);
+            int cy = _FloorToInt(((box.min_y + box.max_y) * 0.5f - world.min_y) / (world.max_y - world.min_y) * side);
+            cx = max(0, min(cx, side - 1));
+            cy = max(0, min(cy, side - 1));
+            return level_offset[l] + cy * side + cx;
+        }
+
+        void _Link(uint32_t id, uint32_t cell)
+        {
+            _internal_quadtree_object_t& o = objects[id];
+            int l = depth - 1;
+            while(l > 0 && cell < level_offset[l])
+                l--;
+            o.cell = cell;
+            o.level = l;
+            o.outside = !world.Contains((o.box.min_x + o.box.max_x) * 0.5f, (o.box.min_y + o.box.max_y) * 0.5f);
+            outside_count += o.outside;
+            o.prev = _BROADPHASE_NIL;
+            o.next = heads[cell];
+            if(heads[cell] != _BROADPHASE_NIL)
+                objects[heads[cell]].prev = id;
+            heads[cell] = id;
+            level_count[l]++;
+        }
+
+        void _Unlink(uint32_t id)
+        {
+            _internal_quadtree_object_t& o = objects[id];
+            if(o.prev != _BROADPHASE_NIL)
+                objects[o.prev].next = o.next;
+            else
+                heads[o.cell] = o.next;
+            if(o.next != _BROADPHASE_NIL)
+                objects[o.next].prev = o.prev;
+            level_count[o.level]--;
+            outside_count -= o.outside;
+        }
+
+        // Counting sort of the live objects by cell index into sorted/cell_start.
+        void _SortByCell()
+        {
+            uint32_t cells = level_offset[depth];
+            cell_start.assign(cells + 1, 0);
+            uint32_t total = 0;
+            for(uint32_t id = 0; id < objects.size(); id++)
+            {
+                if(objects[id].active)
+                {
+                    cell_start[objects[id].cell + 1]++;
+                    total++;
+                }
+            }
+            for(uint32_t c = 0; c < cells; c++)
+                cell_start[c + 1] += cell_start[c];
+            sorted.resize(total);
+            cell_fill.assign(cell_start.begin(), cell_start.end() - 1);
+            for(uint32_t id = 0; id < objects.size(); id++)
+            {
+                const _internal_quadtree_object_t& o = objects[id];
+                if(!o.active)
+                    continue;
+                _internal_quadtree_sorted_t& s = sorted[cell_fill[o.cell]++];
+                s.box = o.box;
+                s.radius = o.radius;
+                s.id = id;
+                s.level = o.level;
+            }
+        }
+
+        uint32_t _NextStamp()
+        {
+            if(stamps.size() < objects.size())
+                stamps.resize(objects.size(), 0);
+            if(++stamp_counter == 0)
+            {
+                fill(stamps.begin(), stamps.end(), 0);
+                stamp_counter = 1;
+            }
+            return stamp_counter;
+        }
+
+        // Calls visit(id, level) for every object on levels 0..max_level whose loose cell
+        // overlaps the region.
+        template<typename F>
+        void _ForEachCandidate(const BoundingBox& region, int max_level, F visit)
+        {
+            float world_w = world.max_x - world.min_x;
+            float world_h = world.max_y - world.min_y;
+            for(int l = 0; l <= max_level; l++)
+            {
+                if(level_count[l] == 0)
+                    continue;
+                int side = 1 << l;
+                float sx = side / world_w;
+                float sy = side / world_h;
+                int x0 = max(0, min(_FloorToInt((region.min_x - world.min_x) * sx - 0.5f), side - 1));
+                int x1 = max(0, min(_FloorToInt((region.max_x - world.min_x) * sx + 0.5f), side - 1));
+                int y0 = max(0, min(_FloorToInt((region.min_y - world.min_y) * sy - 0.5f), side - 1));
+                int y1 = max(0, min(_FloorToInt((region.max_y - world.min_y) * sy + 0.5f), side - 1));
+                for(int cy = y0; cy <= y1; cy++)
+                {
+                    const uint32_t* row = &heads[level_offset[l] + cy * side];
+                    for(int cx = x0; cx <= x1; cx++)
+                    {
+                        for(uint32_t id = row[cx]; id != _BROADPHASE_NIL; id = objects[id].next)
+                            visit(id, l);
+                    }
+                }
+            }
+        }
+    };
+
+    class Application
+    {
+        public:
+        string app_name = "engine2D Application";
+
+        virtual void Create(void)
+        {
+
+        }
+        virtual void Update(float elapsed)
+        {
+
+        }
+
+        virtual void Draw(float elapsed)
+        {
+            
+        }
+
+        virtual void OnKeyPress(float elapsed, Button key)
+        {
+
+        }
+
+        virtual void OnKeyPressed(float elapsed, Button key)
+        {
+
+        }
+
+        virtual void OnMouseMove(float elapsed, int x, int y, int dx, int dy)
+        {
+
+        }
+
+        virtual void OnKeyRelease(float elapsed, Button key)
+        {
+
+        }
+
+        virtual void OnTextInput(float elapsed, unsigned char key)
+        {
+            
+        }
+
+        virtual void OnTimerTick(float elapsed, Timer timer_id)
+        {
+
+        }
+
+        virtual void OnDestroy(void)
+        {
+
+        }
+
+        
+
+        Application()
+        {
+
+        }
+    };
+
+    SDL_Window* application_window = NULL;
+    SDL_Renderer* window_renderer = NULL;
+    SDL_Texture* screen_texture = NULL;
+    
+    Application* app = NULL;
+
+    // Polygon under construction, per thread so pipelined and parallel drawing can build them.
+    static thread_local vector<uint16_t> shape_array_x;
+    static thread_local vector<uint16_t> shape_array_y;
+    static _internal_timer_t timers[256];
+
+    static thread_local int shape_x, shape_y;
+    static thread_local bool shape_free = true;
+    static thread_local bool shape_fill;
+    static thread_local uint8_t shape_r, shape_g, shape_b, shape_a;
+
+    bool key_array[static_cast<int>(Button::TOTAL_BUTTONS)];
+
+
+    unsigned int screen_width = 0;
+    unsigned int screen_height = 0;
+    unsigned int window_width = 0;
+    unsigned int window_height = 0;
+    unsigned int window_scale = 0;
+
+    // Timeline capture. Each thread writes into its own ring buffer, so recording takes no
+    // locks; when the buffer is full the oldest events are overwritten. While tracing is off
+    // a zone costs one flag test. Names must be string literals or otherwise outlive the
+    // capture. SaveTrace() writes Chrome trace-event JSON for chrome://tracing or Perfetto.
+    typedef struct
+    {
+        const char* name;
+        uint64_t start;
+        uint64_t duration;      // Counter events keep their value here instead.
+        bool counter;
+    } _internal_trace_event_t;
+
+    typedef struct
+    {
+        vector<_internal_trace_event_t> events;
+        SDL_atomic_t head;
+        int thread;
+        const char* thread_name;
+    } _internal_trace_buffer_t;
+
+    bool trace_enabled = false;
+    int trace_capacity = 1 << 16;
+    vector<_internal_trace_buffer_t*> trace_buffers;
+    SDL_SpinLock trace_buffers_lock = 0;
+    static thread_local _internal_trace_buffer_t* trace_buffer = NULL;
+    static thread_local const char* trace_thread_name = NULL;
+
+    _internal_trace_buffer_t* _TraceBuffer()
+    {
+        if(trace_buffer == NULL)
+        {
+            // Buffers outlive their threads so a capture can still be saved after they exit.
+            trace_buffer = new _internal_trace_buffer_t();
+            trace_buffer->events.resize(trace_capacity);
+            SDL_AtomicSet(&trace_buffer->head, 0);
+            trace_buffer->thread_name = trace_thread_name;
+            SDL_AtomicLock(&trace_buffers_lock);
+            trace_buffer->thread = (int)trace_buffers.size() + 1;
+            trace_buffers.push_back(trace_buffer);
+            SDL_AtomicUnlock(&trace_buffers_lock);
+        }
+        return trace_buffer;
+    }
+
+    void _TraceWrite(const char* name, uint64_t start, uint64_t duration, bool counter)
+    {
+        _internal_trace_buffer_t* buffer = _TraceBuffer();
+        int head = SDL_AtomicGet(&buffer->head);
+        _internal_trace_event_t& e = buffer->events[head & (buffer->events.size() - 1)];
+        e.name = name;
+        e.start = start;
+        e.duration = duration;
+        e.counter = counter;
+        SDL_AtomicSet(&buffer->head, head + 1);
+    }
+
+    // events_per_thread is rounded up to a power of two. Buffers made by an earlier capture
+    // keep their size.
+    void StartTrace(int events_per_thread = 1 << 16)
+    {
+        int capacity = 1;
+        while(capacity < events_per_thread)
+            capacity *= 2;
+        trace_capacity = capacity;
+        SDL_AtomicLock(&trace_buffers_lock);
+        for(size_t i = 0; i < trace_buffers.size(); i++)
+            SDL_AtomicSet(&trace_buffers[i]->head, 0);
+        SDL_AtomicUnlock(&trace_buffers_lock);
+        trace_enabled = true;
+    }
+
+    void StopTrace() { trace_enabled = false; }
+    bool IsTracing() { return trace_enabled; }
+
+    // Label for the calling thread in saved traces.
+    void SetTraceThreadName(const char* name)
+    {
+        trace_thread_name = name;
+        if(trace_buffer != NULL)
+            trace_buffer->thread_name = name;
+    }
+
+    void TraceCounter(const char* name, double value);
+
+    // Hardware counters per zone, from perf_event_open on Linux. Every TRACE_ZONE adds what
+    // its thread's counters moved by between entering and leaving it to a per-name total,
+    // whether or not a trace is being captured. Each thread opens its own counters the first
+    // time one of its zones runs. Where counters cannot be opened (other systems, VMs without
+    // a PMU, perf_event_paranoid too strict) StartPerfCounters() says why and zones cost one
+    // flag test, as before.
+    enum class PerfCounter
+    {
+        CYCLES = 0,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        BRANCH_MISSES,
+        TOTAL_PERF_COUNTERS
+    };
+
+    const int _PERF_COUNTERS = (int)PerfCounter::TOTAL_PERF_COUNTERS;
+
+    typedef struct
+    {
+        const char* name;
+        uint64_t calls;
+        uint64_t values[(int)PerfCounter::TOTAL_PERF_COUNTERS];
+        uint64_t last[(int)PerfCounter::TOTAL_PERF_COUNTERS];     // The most recent call.
+    } PerfZoneStats;
+
+    typedef struct
+    {
+        uint64_t enabled, running;
+        uint64_t values[(int)PerfCounter::TOTAL_PERF_COUNTERS];
+    } _internal_perf_sample_t;
+
+    typedef struct
+    {
+        int generation;
+        int leader;
+        // Position of each counter in the group read, -1 when it could not be opened.
+        int slot[(int)PerfCounter::TOTAL_PERF_COUNTERS];
+        int count;
+    } _internal_perf_group_t;
+
+    bool perf_enabled = false;
+    int perf_generation = 0;
+    // Counters that opened on the thread that called StartPerfCounters().
+    bool perf_available[(int)PerfCounter::TOTAL_PERF_COUNTERS] = {};
+    uint64_t perf_frames = 0;
+    vector<PerfZoneStats> perf_zones;
+    vector<int> perf_files;
+    SDL_SpinLock perf_lock = 0;
+    static thread_local _internal_perf_group_t perf_group = {-1, -1, {-1, -1, -1, -1, -1}, 0};
+
+    // Opens this thread's counters as one group, so a single read returns all of them.
+    bool _PerfOpen()
+    {
+        perf_group.generation = perf_generation;
+        perf_group.leader = -1;
+        perf_group.count = 0;
+        #ifdef ENGINE2D_PERF_EVENTS
+        const uint32_t types[] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+        const uint64_t configs[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for(int i = 0; i < _PERF_COUNTERS; i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, perf_group.leader, 0);
+            perf_group.slot[i] = -1;
+            if(fd < 0)
+                continue;
+            if(perf_group.leader < 0)
+                perf_group.leader = fd;
+            perf_group.slot[i] = perf_group.count++;
+            SDL_AtomicLock(&perf_lock);
+            perf_files.push_back(fd);
+            SDL_AtomicUnlock(&perf_lock);
+        }
+        #endif
+        return perf_group.leader >= 0;
+    }
+
+    bool _PerfSample(_internal_perf_sample_t* sample)
+    {
+        if(perf_group.generation != perf_generation)
+            _PerfOpen();
+        if(perf_group.leader < 0)
+            return false;
+        #ifdef ENGINE2D_PERF_EVENTS
+        uint64_t data[3 + (int)PerfCounter::TOTAL_PERF_COUNTERS];
+        ssize_t size = (ssize_t)((3 + perf_group.count) * sizeof(uint64_t));
+        if(read(perf_group.leader, data, size) != size)
+            return false;
+        sample->enabled = data[1];
+        sample->running = data[2];
+        for(int i = 0; i < _PERF_COUNTERS; i++)
+            sample->values[i] = (perf_group.slot[i] >= 0) ? data[3 + perf_group.slot[i]] : 0;
+        return true;
+        #else
+        return false;
+        #endif
+    }
+
+    void _PerfAccumulate(const char* name, const _internal_perf_sample_t& start, const _internal_perf_sample_t& end)
+    {
+        // Scale up when the kernel had to share the hardware counters with other groups.
+        uint64_t enabled = end.enabled - start.enabled, running = end.running - start.running;
+        double scale = (running > 0 && running < enabled) ? (double)enabled / running : 1.0;
+        SDL_AtomicLock(&perf_lock);
+        size_t i = 0;
+        while(i < perf_zones.size() && strcmp(perf_zones[i].name, name) != 0)
+            i++;
+        if(i == perf_zones.size())
+        {
+            PerfZoneStats zone;
+            memset(&zone, 0, sizeof(zone));
+            zone.name = name;
+            perf_zones.push_back(zone);
+        }
+        PerfZoneStats& zone = perf_zones[i];
+        zone.calls++;
+        for(int c = 0; c < _PERF_COUNTERS; c++)
+        {
+            zone.last[c] = (uint64_t)((end.values[c] - start.values[c]) * scale);
+            zone.values[c] += zone.last[c];
+        }
+        SDL_AtomicUnlock(&perf_lock);
+    }
+
+    // Starts counting, from zero. Returns false, after saying why, if no counter could be
+    // opened; counters that exist on this CPU are still used when others are missing.
+    bool StartPerfCounters()
+    {
+        #ifdef ENGINE2D_PERF_EVENTS
+        if(perf_enabled)
+            return true;
+        perf_generation++;
+        if(!_PerfOpen())
+        {
+            int error = errno;
+            if(error == EACCES || error == EPERM)
+                ERROR_OUT("Hardware counters not permitted (%s). Lower /proc/sys/kernel/perf_event_paranoid to 2 or less.\n", strerror(error));
+            else
+                ERROR_OUT("Hardware counters unavailable: %s\n", strerror(error));
+            return false;
+        }
+        for(int i = 0; i < _PERF_COUNTERS; i++)
+            perf_available[i] = (perf_group.slot[i] >= 0);
+        SDL_AtomicLock(&perf_lock);
+        perf_zones.clear();
+        perf_frames = 0;
+        SDL_AtomicUnlock(&perf_lock);
+        perf_enabled = true;
+        return true;
+        #else
+        ERROR_OUT("Hardware counters are only supported on Linux.\n");
+        return false;
+        #endif
+    }
+
+    // Closes every thread's counters. The totals stay until the next start. Call between
+    // frames, when no zones are running on other threads.
+    void StopPerfCounters()
+    {
+        perf_enabled = false;
+        perf_generation++;
+        SDL_AtomicLock(&perf_lock);
+        #ifdef ENGINE2D_PERF_EVENTS
+        for(size_t i = 0; i < perf_files.size(); i++)
+            close(perf_files[i]);
+        #endif
+        perf_files.clear();
+        SDL_AtomicUnlock(&perf_lock);
+    }
+
+    bool IsPerfCounting() { return perf_enabled; }
+    bool IsPerfCounterAvailable(PerfCounter counter) { return perf_available[(int)counter]; }
+    uint64_t GetPerfFrames() { return perf_frames; }
+
+    vector<PerfZoneStats> GetPerfZoneStats()
+    {
+        SDL_AtomicLock(&perf_lock);
+        vector<PerfZoneStats> zones = perf_zones;
+        SDL_AtomicUnlock(&perf_lock);
+        return zones;
+    }
+
+    // Per frame averages for every zone seen since StartPerfCounters(). Zones count
+    // everything inside them, nested zones included.
+    void PrintPerfCounters()
+    {
+        vector<PerfZoneStats> zones = GetPerfZoneStats();
+        double frames = (double)max(perf_frames, (uint64_t)1);
+        const char* headers[] = {"cycles", "instructions", "L1D misses", "LLC misses", "branch misses"};
+        MSG_OUT("per frame over %llu frames\n%-24s %8s", (unsigned long long)perf_frames, "zone", "calls");
+        for(int c = 0; c < _PERF_COUNTERS; c++)
+            MSG_OUT(" %14s", headers[c]);
+        MSG_OUT(" %6s\n", "IPC");
+        for(size_t i = 0; i < zones.size(); i++)
+        {
+            MSG_OUT("%-24s %8.2f", zones[i].name, zones[i].calls / frames);
+            for(int c = 0; c < _PERF_COUNTERS; c++)
+            {
+                if(perf_available[c])
+                    MSG_OUT(" %14.0f", zones[i].values[c] / frames);
+                else
+                    MSG_OUT(" %14s", "-");
+            }
+            uint64_t cycles = zones[i].values[(int)PerfCounter::CYCLES];
+            if(perf_available[(int)PerfCounter::CYCLES] && perf_available[(int)PerfCounter::INSTRUCTIONS] && cycles > 0)
+                MSG_OUT(" %6.2f\n", (double)zones[i].values[(int)PerfCounter::INSTRUCTIONS] / cycles);
+            else
+                MSG_OUT(" %6s\n", "-");
+        }
+    }
+
+    // Called by the main loop after each frame: counts it, and graphs the frame's own
+    // counters on the timeline when a trace is running too.
+    void _PerfEndFrame()
+    {
+        perf_frames++;
+        if(!trace_enabled)
+            return;
+        PerfZoneStats frame;
+        bool found = false;
+        SDL_AtomicLock(&perf_lock);
+        for(size_t i = 0; i < perf_zones.size() && !found; i++)
+        {
+            if(strcmp(perf_zones[i].name, "Frame") == 0)
+            {
+                frame = perf_zones[i];
+                found = true;
+            }
+        }
+        SDL_AtomicUnlock(&perf_lock);
+        if(!found)
+            return;
+        const char* names[] = {"Frame cycles", "Frame instructions", "Frame L1D misses", "Frame LLC misses", "Frame branch misses"};
+        for(int c = 0; c < _PERF_COUNTERS; c++)
+        {
+            if(perf_available[c])
+                TraceCounter(names[c], (double)frame.last[c]);
+        }
+    }
+
+    // Heap allocation tracking. Allocations made through SDL's allocator, which the engine's
+    // own buffers use too, are always counted while tracking is on; C++ new and delete are
+    // counted as well when ENGINE2D_TRACK_ALLOCATIONS is defined before including this header
+    // (in one source file only, since it replaces the global operators). Each allocation is
+    // charged to the innermost ALLOCATION_TAG or TRACE_ZONE of its thread. Plain malloc from
+    // other libraries is not seen.
+    typedef struct
+    {
+        uint64_t allocations;
+        uint64_t frees;
+        uint64_t bytes;             // Requested by the allocations.
+        uint64_t sdl_allocations;   // The part of allocations that went through SDL.
+    } AllocationStats;
+
+    typedef struct
+    {
+        const char* tag;            // NULL for allocations outside any tag.
+        uint64_t allocations;
+        uint64_t bytes;
+    } AllocationTagStats;
+
+    const int _ALLOCATION_TAGS = 128;
+    const int _ALLOCATION_SITES = 512;
+    const int _ALLOCATION_STACK_DEPTH = 12;
+
+    typedef struct
+    {
+        uint64_t hash;
+        void* frames[_ALLOCATION_STACK_DEPTH];
+        int depth;
+        uint64_t allocations;
+        uint64_t bytes;
+    } _internal_allocation_site_t;
+
+    // Plain arrays and flags only: the hooks run inside operator new, possibly before main().
+    bool allocation_tracking = false;
+    bool allocation_stacks = false;
+    bool allocation_free_frames = false;
+    AllocationStats allocation_frame = AllocationStats();
+    AllocationStats allocation_last_frame = AllocationStats();
+    AllocationStats allocation_totals = AllocationStats();
+    uint64_t allocation_frames = 0;
+    uint64_t allocating_frames = 0;
+    AllocationTagStats allocation_tags[_ALLOCATION_TAGS];
+    uint64_t allocation_tag_frame[_ALLOCATION_TAGS];
+    int allocation_tag_count = 0;
+    _internal_allocation_site_t allocation_sites[_ALLOCATION_SITES];
+    SDL_SpinLock allocation_lock = 0;
+    static thread_local const char* allocation_tag = NULL;
+    static thread_local bool in_allocation_hook = false;
+
+    void _TrackAllocation(size_t bytes, bool sdl)
+    {
+        if(!allocation_tracking || in_allocation_hook)
+            return;
+        in_allocation_hook = true;
+        #ifdef ENGINE2D_BACKTRACE
+        void* frames[_ALLOCATION_STACK_DEPTH + 2];
+        int depth = allocation_stacks ? backtrace(frames, _ALLOCATION_STACK_DEPTH + 2) : 0;
+        #endif
+        SDL_AtomicLock(&allocation_lock);
+        allocation_frame.allocations++;
+        allocation_frame.bytes += bytes;
+        if(sdl)
+            allocation_frame.sdl_allocations++;
+
+        const char* tag = allocation_tag;
+        int i = 0;
+        while(i < allocation_tag_count && allocation_tags[i].tag != tag && (tag == NULL || allocation_tags[i].tag == NULL || strcmp(allocation_tags[i].tag, tag) != 0))
+            i++;
+        if(i == allocation_tag_count && allocation_tag_count < _ALLOCATION_TAGS)
+        {
+            allocation_tags[i].tag = tag;
+            allocation_tags[i].allocations = 0;
+            allocation_tags[i].bytes = 0;
+            allocation_tag_frame[i] = 0;
+            allocation_tag_count++;
+        }
+        if(i < allocation_tag_count)
+        {
+            allocation_tags[i].allocations++;
+            allocation_tags[i].bytes += bytes;
+            allocation_tag_frame[i]++;
+        }
+
+        #ifdef ENGINE2D_BACKTRACE
+        // The first two frames are this function and the hook that called it.
+        if(depth > 2)
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for(int f = 2; f < depth; f++)
+                hash = (hash ^ (uint64_t)(uintptr_t)frames[f]) * 1099511628211ULL;
+            hash |= 1;
+            for(int probe = 0; probe < _ALLOCATION_SITES; probe++)
+            {
+                _internal_allocation_site_t& site = allocation_sites[(hash + probe) % _ALLOCATION_SITES];
+                if(site.hash == 0)
+                {
+                    site.hash = hash;
+                    site.depth = depth - 2;
+                    memcpy(site.frames, frames + 2, site.depth * sizeof(void*));
+                }
+                if(site.hash == hash)
+                {
+                    site.allocations++;
+                    site.bytes += bytes;
+                    break;
+                }
+            }
+        }
+        #endif
+        SDL_AtomicUnlock(&allocation_lock);
+        in_allocation_hook = false;
+    }
+
+    void _TrackFree()
+    {
+        if(!allocation_tracking || in_allocation_hook)
+            return;
+        SDL_AtomicLock(&allocation_lock);
+        allocation_frame.frees++;
+        SDL_AtomicUnlock(&allocation_lock);
+    }
+
+    // Charges allocations to name until the end of the enclosing scope.
+    class AllocationTag
+    {
+        public:
+        AllocationTag(const char* name)
+        {
+            this->active = allocation_tracking;
+            if(active)
+            {
+                this->previous = allocation_tag;
+                allocation_tag = name;
+            }
+        }
+
+        ~AllocationTag()
+        {
+            if(active)
+                allocation_tag = previous;
+        }
+
+        private:
+        const char* previous;
+        bool active;
+    };
+
+    #define ALLOCATION_TAG(name) engine2D::AllocationTag _TRACE_CONCAT(allocation_tag_, __LINE__)(name)
+
+    SDL_malloc_func sdl_malloc_original = NULL;
+    SDL_calloc_func sdl_calloc_original = NULL;
+    SDL_realloc_func sdl_realloc_original = NULL;
+    SDL_free_func sdl_free_original = NULL;
+
+    void* SDLCALL _SdlMalloc(size_t size)
+    {
+        _TrackAllocation(size, true);
+        return sdl_malloc_original(size);
+    }
+
+    void* SDLCALL _SdlCalloc(size_t count, size_t size)
+    {
+        _TrackAllocation(count * size, true);
+        return sdl_calloc_original(count, size);
+    }
+
+    // A grown block counts as a new allocation and the old one as freed.
+    void* SDLCALL _SdlRealloc(void* p, size_t size)
+    {
+        _TrackAllocation(size, true);
+        if(p != NULL)
+            _TrackFree();
+        return sdl_realloc_original(p, size);
+    }
+
+    void SDLCALL _SdlFree(void* p)
+    {
+        if(p != NULL)
+            _TrackFree();
+        sdl_free_original(p);
+    }
+
+    // Starts counting from zero. With capture_stacks every allocation also records its call
+    // stack, which is slow but lets the report name the code behind the busiest sites.
+    void StartAllocationTracking(bool capture_stacks = false)
+    {
+        if(allocation_tracking)
+            return;
+        #ifdef ENGINE2D_BACKTRACE
+        // The first backtrace() may load the unwinder, which allocates.
+        void* warm_up[1];
+        backtrace(warm_up, 1);
+        #else
+        if(capture_stacks)
+            ERROR_OUT("Allocation call stacks are not supported on this platform.\n");
+        #endif
+        SDL_AtomicLock(&allocation_lock);
+        allocation_frame = allocation_last_frame = allocation_totals = AllocationStats();
+        allocation_frames = allocating_frames = 0;
+        allocation_tag_count = 0;
+        memset(allocation_sites, 0, sizeof(allocation_sites));
+        SDL_AtomicUnlock(&allocation_lock);
+        if(sdl_malloc_original == NULL)
+        {
+            // The wrappers pass everything through, so memory from before stays valid.
+            SDL_GetMemoryFunctions(&sdl_malloc_original, &sdl_calloc_original, &sdl_realloc_original, &sdl_free_original);
+            SDL_SetMemoryFunctions(_SdlMalloc, _SdlCalloc, _SdlRealloc, _SdlFree);
+        }
+        allocation_stacks = capture_stacks;
+        allocation_tracking = true;
+    }
+
+    void StopAllocationTracking() { allocation_tracking = false; }
+    bool IsTrackingAllocations() { return allocation_tracking; }
+
+    // Reports every frame that allocates, naming the tags responsible, so steady state
+    // frames can be kept allocation free. Start it once loading and warm up are done.
+    void ExpectAllocationFreeFrames(bool enable) { allocation_free_frames = enable; }
+
+    AllocationStats GetFrameAllocations() { return allocation_last_frame; }
+    AllocationStats GetTotalAllocations() { return allocation_totals; }
+    uint64_t GetAllocatingFrames() { return allocating_frames; }
+
+    // Totals per tag since tracking started, busiest first.
+    vector<AllocationTagStats> GetAllocationTagStats()
+    {
+        // Copied out under the lock first: the vector's own allocation takes the lock too.
+        AllocationTagStats copy[_ALLOCATION_TAGS];
+        SDL_AtomicLock(&allocation_lock);
+        int count = allocation_tag_count;
+        memcpy(copy, allocation_tags, count * sizeof(AllocationTagStats));
+        SDL_AtomicUnlock(&allocation_lock);
+        vector<AllocationTagStats> tags(copy, copy + count);
+        sort(tags.begin(), tags.end(), [](const AllocationTagStats& a, const AllocationTagStats& b) { return a.allocations > b.allocations; });
+        return tags;
+    }
+
+    // Called by the main loop after each frame.
+    void _AllocationEndFrame()
+    {
+        // Filled in under the lock, printed after it, without allocating.
+        char culprits[256] = "";
+        SDL_AtomicLock(&allocation_lock);
+        AllocationStats frame = allocation_frame;
+        allocation_frame = AllocationStats();
+        allocation_totals.allocations += frame.allocations;
+        allocation_totals.frees += frame.frees;
+        allocation_totals.bytes += frame.bytes;
+        allocation_totals.sdl_allocations += frame.sdl_allocations;
+        size_t used = 0;
+        for(int i = 0; i < allocation_tag_count; i++)
+        {
+            if(allocation_tag_frame[i] == 0)
+                continue;
+            if(allocation_free_frames && used < sizeof(culprits))
+            {
+                int n = snprintf(culprits + used, sizeof(culprits) - used, "%s%s %llu", (used == 0) ? "" : ", ",
+                                 (allocation_tags[i].tag != NULL) ? allocation_tags[i].tag : "(untagged)", (unsigned long long)allocation_tag_frame[i]);
+                used += (n > 0) ? n : 0;
+            }
+            allocation_tag_frame[i] = 0;
+        }
+        SDL_AtomicUnlock(&allocation_lock);
+        allocation_last_frame = frame;
+        allocation_frames++;
+        if(frame.allocations == 0)
+            return;
+        allocating_frames++;
+        if(allocation_free_frames)
+        {
+            ERROR_OUT("Frame %llu made %llu allocations (%llu bytes, %llu through SDL): %s\n", (unsigned long long)allocation_frames,
+                      (unsigned long long)frame.allocations, (unsigned long long)frame.bytes, (unsigned long long)frame.sdl_allocations, culprits);
+        }
+    }
+
+    // Per frame averages, the busiest tags and, when stacks were captured, the call stacks
+    // of the busiest allocation sites.
+    void PrintAllocationReport(int top_sites = 5)
+    {
+        // The report's own allocations are left out, for this thread only.
+        bool was_in_hook = in_allocation_hook;
+        in_allocation_hook = true;
+        double frames = (double)max(allocation_frames, (uint64_t)1);
+        AllocationStats t = allocation_totals;
+        MSG_OUT("allocations over %llu frames: %.1f allocs, %.1f frees, %.0f bytes per frame; %llu frames allocated\n",
+                (unsigned long long)allocation_frames, t.allocations / frames, t.frees / frames, t.bytes / frames, (unsigned long long)allocating_frames);
+        vector<AllocationTagStats> tags = GetAllocationTagStats();
+        MSG_OUT("%-32s %14s %14s\n", "tag", "allocs/frame", "bytes/frame");
+        for(size_t i = 0; i < tags.size(); i++)
+            MSG_OUT("%-32s %14.2f %14.0f\n", (tags[i].tag != NULL) ? tags[i].tag : "(untagged)", tags[i].allocations / frames, tags[i].bytes / frames);
+        #ifdef ENGINE2D_BACKTRACE
+        if(allocation_stacks)
+        {
+            vector<_internal_allocation_site_t*> sites;
+            for(int i = 0; i < _ALLOCATION_SITES; i++)
+            {
+                if(allocation_sites[i].hash != 0)
+                    sites.push_back(&allocation_sites[i]);
+            }
+            sort(sites.begin(), sites.end(), [](const _internal_allocation_site_t* a, const _internal_allocation_site_t* b) { return a->allocations > b->allocations; });
+            for(int i = 0; i < min(top_sites, (int)sites.size()); i++)
+            {
+                MSG_OUT("site %d: %llu allocations, %llu bytes\n", i + 1, (unsigned long long)sites[i]->allocations, (unsigned long long)sites[i]->bytes);
+                fflush(stdout);
+                backtrace_symbols_fd(sites[i]->frames, sites[i]->depth, fileno(stdout));
+            }
+        }
+        #endif
+        in_allocation_hook = was_in_hook;
+    }
+
+    // Marks the time from construction to the end of the enclosing scope. Zones nest.
+    class TraceZone
+    {
+        public:
+        TraceZone(const char* name)
+        {
+            this->name = name;
+            this->active = trace_enabled;
+            if(active)
+                this->start = SDL_GetPerformanceCounter();
+            this->counting = perf_enabled && _PerfSample(&counters);
+            this->tagging = allocation_tracking;
+            if(tagging)
+            {
+                this->previous_tag = allocation_tag;
+                allocation_tag = name;
+            }
+        }
+
+        ~TraceZone()
+        {
+            if(tagging)
+                allocation_tag = previous_tag;
+            _internal_perf_sample_t end;
+            if(counting && perf_enabled && _PerfSample(&end))
+                _PerfAccumulate(name, counters, end);
+            if(active && trace_enabled)
+                _TraceWrite(name, start, SDL_GetPerformanceCounter() - start, false);
+        }
+
+        private:
+        const char* name;
+        uint64_t start;
+        bool active;
+        bool counting;
+        _internal_perf_sample_t counters;
+        bool tagging;
+        const char* previous_tag;
+    };
+
+    #define _TRACE_CONCAT2(a, b) a##b
+    #define _TRACE_CONCAT(a, b) _TRACE_CONCAT2(a, b)
+    #define TRACE_ZONE(name) engine2D::TraceZone _TRACE_CONCAT(trace_zone_, __LINE__)(name)
+
+    // Samples a value shown as a graph on the timeline.
+    void TraceCounter(const char* name, double value)
+    {
+        if(!trace_enabled)
+            return;
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        _TraceWrite(name, SDL_GetPerformanceCounter(), bits, true);
+    }
+
+    void _TraceWriteString(FILE* f, const char* s)
+    {
+        fputc('"', f);
+        for(; *s != '\0'; s++)
+        {
+            if(*s == '"' || *s == '\\')
+                fputc('\\', f);
+            if((unsigned char)*s >= ' ')
+                fputc(*s, f);
+        }
+        fputc('"', f);
+    }
+
+    // Best called after StopTrace(); threads still recording may overwrite events as they
+    // are written out.
+    bool SaveTrace(const char* filename)
+    {
+        FILE* f = fopen(filename, "w");
+        if(f == NULL)
+        {
+            ERROR_OUT("Could not write trace: %s\n", filename);
+            return false;
+        }
+        double us_per_tick = 1e6 / (double)SDL_GetPerformanceFrequency();
+        bool first = true;
+        fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+        SDL_AtomicLock(&trace_buffers_lock);
+        vector<_internal_trace_buffer_t*> buffers = trace_buffers;
+        SDL_AtomicUnlock(&trace_buffers_lock);
+        for(size_t b = 0; b < buffers.size(); b++)
+        {
+            _internal_trace_buffer_t* buffer = buffers[b];
+            if(buffer->thread_name != NULL)
+            {
+                fprintf(f, "%s\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"name\": \"thread_name\", \"args\": {\"name\": ", first ? "" : ",", buffer->thread);
+                _TraceWriteString(f, buffer->thread_name);
+                fprintf(f, "}}");
+                first = false;
+            }
+            int head = SDL_AtomicGet(&buffer->head);
+            int size = (int)buffer->events.size();
+            for(int i = max(head - size, 0); i < head; i++)
+            {
+                const _internal_trace_event_t& e = buffer->events[i & (size - 1)];
+                fprintf(f, "%s\n{\"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"name\": ", first ? "" : ",", buffer->thread, e.start * us_per_tick);
+                _TraceWriteString(f, e.name);
+                if(e.counter)
+                {
+                    double value;
+                    memcpy(&value, &e.duration, sizeof(value));
+                    fprintf(f, ", \"ph\": \"C\", \"args\": {\"value\": %.17g}}", value);
+                }
+                else
+                    fprintf(f, ", \"ph\": \"X\", \"dur\": %.3f}", e.duration * us_per_tick);
+                first = false;
+            }
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        return true;
+    }
+
+    // Worker threads for splitting loops across cores. Index 0 is the main thread and 1 the
+    // pipelined update thread; workers are numbered from 2 so per-thread scratch data can be
+    // indexed directly.
+    const int _UPDATE_THREAD_INDEX = 1;
+    static thread_local int worker_index = 0;
+    vector<SDL_Thread*> worker_threads;
+    SDL_sem* job_start = NULL;
+    SDL_sem* job_done = NULL;
+    SDL_atomic_t job_next;
+    int job_count = 0;
+    int job_chunk = 1;
+    SDL_atomic_t job_lock;
+    bool workers_quit = false;
+    const function<void(int, int)>* job_function = NULL;
+
+    int GetWorkerIndex() { return worker_index; }
+    // Threads that run ParallelFor() chunks: the workers and the calling thread.
+    int GetWorkerCount() { return (int)worker_threads.size() + 1; }
+    // Size for per-thread scratch indexed by GetWorkerIndex(), the update thread included.
+    int GetWorkerIndexCount() { return (int)worker_threads.size() + _UPDATE_THREAD_INDEX + 1; }
+
+    void _RunJobChunks()
+    {
+        while(true)
+        {
+            int begin = SDL_AtomicAdd(&job_next, job_chunk);
+            if(begin >= job_count)
+                return;
+            (*job_function)(begin, min(begin + job_chunk, job_count));
+        }
+    }
+
+    int _WorkerMain(void* data)
+    {
+        worker_index = (int)(intptr_t)data;
+        SetTraceThreadName("worker");
+        while(true)
+        {
+            SDL_SemWait(job_start);
+            if(workers_quit)
+                return 0;
+            _RunJobChunks();
+            SDL_SemPost(job_done);
+        }
+    }
+
+    // Starts threads - 1 workers, or one per extra core when threads is 0.
+    void StartWorkers(int threads = 0)
+    {
+        #ifndef ENGINE2D_EMSCRIPTEN_IMPLEMENTATION
+        if(!worker_threads.empty())
+            return;
+        if(threads <= 0)
+            threads = SDL_GetCPUCount();
+        job_start = SDL_CreateSemaphore(0);
+        job_done = SDL_CreateSemaphore(0);
+        workers_quit = false;
+        for(int i = 1; i < threads; i++)
+        {
+            SDL_Thread* t = SDL_CreateThread(_WorkerMain, "engine2D worker", (void*)(intptr_t)(_UPDATE_THREAD_INDEX + i));
+            if(t == NULL)
+            {
+                ERROR_OUT("Could not start worker thread!\nMessage: %s\n", SDL_GetError());
+                break;
+            }
+            worker_threads.push_back(t);
+        }
+        #endif
+    }
+
+    void StopWorkers()
+    {
+        if(worker_threads.empty())
+            return;
+        workers_quit = true;
+        for(unsigned int i = 0; i < worker_threads.size(); i++)
+            SDL_SemPost(job_start);
+        for(unsigned int i = 0; i < worker_threads.size(); i++)
+            SDL_WaitThread(worker_threads[i], NULL);
+        worker_threads.clear();
+        SDL_DestroySemaphore(job_start);
+        SDL_DestroySemaphore(job_done);
+    }
+
+    // Calls job(begin, end) over [0, count) in chunks of chunk_size, spread across the
+    // workers and the calling thread, and returns once every chunk has run. Nested calls,
+    // calls made while the workers are busy with another thread's job and calls made while
+    // no workers are running simply loop on the calling thread.
+    void ParallelFor(int count, int chunk_size, const function<void(int, int)>& job)
+    {
+        if(count <= 0)
+            return;
+        chunk_size = max(chunk_size, 1);
+        if(worker_threads.empty() || worker_index > _UPDATE_THREAD_INDEX || count <= chunk_size || !SDL_AtomicCAS(&job_lock, 0, 1))
+        {
+            job(0, count);
+            return;
+        }
+        job_function = &job;
+        job_count = count;
+        job_chunk = chunk_size;
+        SDL_AtomicSet(&job_next, 0);
+        for(unsigned int i = 0; i < worker_threads.size(); i++)
+            SDL_SemPost(job_start);
+        _RunJobChunks();
+        for(unsigned int i = 0; i < worker_threads.size(); i++)
+            SDL_SemWait(job_done);
+        SDL_AtomicSet(&job_lock, 0);
+    }
+
+    typedef struct
+    {
+        size_t used;            // Bytes handed out this frame.
+        size_t high_water;      // Most bytes handed out in any one frame.
+        size_t capacity;        // Size of the main block.
+        int overflow_blocks;    // Extra blocks taken this frame, folded into the main block by Reset().
+    } FrameArenaStats;
+
+    class FrameArena;
+    vector<FrameArena*> frame_arenas;
+    SDL_SpinLock frame_arenas_lock = 0;
+
+    // Bump allocator for data that only has to live until the end of the frame. Every thread
+    // gets its own from GetFrameArena() and MainLoop resets them all once per frame, so
+    // nothing allocated from one may be kept past the frame it was allocated in - in
+    // pipelined mode that includes anything captured by a recorded draw call. When a frame
+    // needs more than the main block holds, extra blocks are taken from the heap and the
+    // main block grows to the frame's total on the next Reset(), so steady frames allocate
+    // nothing.
+    class FrameArena
+    {
+        public:
+        FrameArena(size_t capacity = 64 * 1024)
+        {
+            this->capacity = max(capacity, (size_t)256);
+            this->block = (uint8_t*)SDL_malloc(this->capacity);
+            this->head = this->block;
+            this->head_size = this->capacity;
+            overflow.reserve(8);
+            SDL_AtomicLock(&frame_arenas_lock);
+            frame_arenas.push_back(this);
+            SDL_AtomicUnlock(&frame_arenas_lock);
+        }
+
+        // Never returns NULL; size 0 gives a valid, unique pointer.
+        void* Allocate(size_t size, size_t align = alignof(max_align_t))
+        {
+            size_t offset = _AlignedOffset(head, head_used, align);
+            if(offset + size > head_size)
+            {
+                head_size = max(size + align, capacity);
+                head = (uint8_t*)SDL_malloc(head_size);
+                if(head == NULL)
+                    ERROR_OUT("Frame arena could not grow by %u bytes!\n", (unsigned int)head_size);
+                overflow.push_back(head);
+                head_used = 0;
+                offset = _AlignedOffset(head, 0, align);
+            }
+            used += offset + size - head_used;
+            head_used = offset + size;
+            return head + offset;
+        }
+
+        template<typename T>
+        T* Allocate(int count)
+        {
+            return (T*)Allocate(sizeof(T) * max(count, 0), alignof(T));
+        }
+
+        const char* Format(const char* fmt, va_list args)
+        {
+            char* buffer = Allocate<char>(256);
+            va_list copy;
+            va_copy(copy, args);
+            int size = vsnprintf(buffer, 256, fmt, copy);
+            va_end(copy);
+            if(size < 0)
+                return "";
+            if(size >= 256)
+            {
+                buffer = Allocate<char>(size + 1);
+                vsnprintf(buffer, size + 1, fmt, args);
+            }
+            return buffer;
+        }
+
+        const char* Printf(const char* fmt, ...)
+        {
+            va_list args;
+            va_start(args, fmt);
+            const char* s = Format(fmt, args);
+            va_end(args);
+            return s;
+        }
+
+        // Frees everything allocated since the last Reset().
+        void Reset()
+        {
+            high_water = max(high_water, used);
+            if(!overflow.empty())
+            {
+                for(size_t i = 0; i < overflow.size(); i++)
+                    SDL_free(overflow[i]);
+                overflow.clear();
+                while(capacity < high_water)
+                    capacity *= 2;
+                SDL_free(block);
+                block = (uint8_t*)SDL_malloc(capacity);
+            }
+            head = block;
+            head_size = capacity;
+            head_used = 0;
+            used = 0;
+        }
+
+        FrameArenaStats GetStats()
+        {
+            FrameArenaStats stats;
+            stats.used = used;
+            stats.high_water = max(high_water, used);
+            stats.capacity = capacity;
+            stats.overflow_blocks = (int)overflow.size();
+            return stats;
+        }
+
+        ~FrameArena()
+        {
+            SDL_AtomicLock(&frame_arenas_lock);
+            frame_arenas.erase(std::find(frame_arenas.begin(), frame_arenas.end(), this));
+            SDL_AtomicUnlock(&frame_arenas_lock);
+            for(size_t i = 0; i < overflow.size(); i++)
+                SDL_free(overflow[i]);
+            SDL_free(block);
+        }
+
+        private:
+        static size_t _AlignedOffset(uint8_t* base, size_t offset, size_t align)
+        {
+            uintptr_t p = ((uintptr_t)base + offset + align - 1) & ~(uintptr_t)(align - 1);
+            return p - (uintptr_t)base;
+        }
+
+        uint8_t* block;
+        size_t capacity;
+        uint8_t* head;
+        size_t head_size;
+        size_t head_used = 0;
+        size_t used = 0;
+        size_t high_water = 0;
+        vector<uint8_t*> overflow;
+    };
+
+    // The calling thread's arena, made the first time the thread asks for it.
+    FrameArena& GetFrameArena()
+    {
+        static thread_local FrameArena arena;
+        return arena;
+    }
+
+    template<typename T>
+    T* FrameAllocate(int count)
+    {
+        return GetFrameArena().Allocate<T>(count);
+    }
+
+    // Totals over every thread's arena.
+    FrameArenaStats GetFrameArenaStats()
+    {
+        FrameArenaStats total = FrameArenaStats();
+        SDL_AtomicLock(&frame_arenas_lock);
+        for(size_t i = 0; i < frame_arenas.size(); i++)
+        {
+            FrameArenaStats s = frame_arenas[i]->GetStats();
+            total.used += s.used;
+            total.high_water += s.high_water;
+            total.capacity += s.capacity;
+            total.overflow_blocks += s.overflow_blocks;
+        }
+        SDL_AtomicUnlock(&frame_arenas_lock);
+        return total;
+    }
+
+    // Called by MainLoop between frames, while the workers and the update thread are idle.
+    void _ResetFrameArenas()
+    {
+        SDL_AtomicLock(&frame_arenas_lock);
+        for(size_t i = 0; i < frame_arenas.size(); i++)
+            frame_arenas[i]->Reset();
+        SDL_AtomicUnlock(&frame_arenas_lock);
+    }
+
+    // World view used by the draw functions while set with SetCamera(). The point (x, y)
+    // appears at the centre of the screen, zoomed by zoom and turned by rotation radians.
+    class Camera
+    {
+        public:
+        float x, y;
+        float zoom;
+        float rotation;
+
+        Camera(float x = 0.0f, float y = 0.0f, float zoom = 1.0f, float rotation = 0.0f)
+        {
+            this->x = x;
+            this->y = y;
+            this->zoom = zoom;
+            this->rotation = rotation;
+        }
+
+        // World to screen transform. Cached until one of the camera fields changes.
+        const Transform2D& GetTransform()
+        {
+            if(x != key[0] || y != key[1] || zoom != key[2] || rotation != key[3] || screen_width != key_w || screen_height != key_h)
+            {
+                key[0] = x; key[1] = y; key[2] = zoom; key[3] = rotation;
+                key_w = screen_width; key_h = screen_height;
+                transform = Transform2D::Translation(screen_width * 0.5f, screen_height * 0.5f) * Transform2D::Rotation(-rotation)
+                          * Transform2D::Scale(zoom, zoom) * Transform2D::Translation(-x, -y);
+                inverse = transform.Inverse();
+            }
+            return transform;
+        }
+
+        Vector2 WorldToScreen(Vector2 const &p)
+        {
+            return GetTransform().Apply(p);
+        }
+
+        Vector2 ScreenToWorld(Vector2 const &p)
+        {
+            GetTransform();
+            return inverse.Apply(p);
+        }
+
+        // Smallest world space box holding everything on screen.
+        BoundingBox GetVisibleArea()
+        {
+            GetTransform();
+            Vector2 c[4] = {inverse.Apply(Vector2(0.0f, 0.0f)), inverse.Apply(Vector2((float)screen_width, 0.0f)),
+                            inverse.Apply(Vector2(0.0f, (float)screen_height)), inverse.Apply(Vector2((float)screen_width, (float)screen_height))};
+            BoundingBox box(c[0].x, c[0].y, c[0].x, c[0].y);
+            for(int i = 1; i < 4; i++)
+            {
+                box.min_x = min(box.min_x, c[i].x); box.max_x = max(box.max_x, c[i].x);
+                box.min_y = min(box.min_y, c[i].y); box.max_y = max(box.max_y, c[i].y);
+            }
+            return box;
+        }
+
+        private:
+        float key[4] = {NAN, NAN, NAN, NAN};
+        unsigned int key_w = 0, key_h = 0;
+        Transform2D transform, inverse;
+    };
+
+    // Retained mode keeps screen_texture between frames. Draw() only runs on frames with
+    // invalidated regions, once per dirty rectangle and clipped to it; frames with nothing
+    // invalidated skip drawing and presenting entirely.
+    bool retained_mode = false;
+    bool needs_present = false;
+    // Regions are merged only when the merged box is not much bigger than the two apart, so
+    // small updates far from each other stay separate.
+    const int _MAX_DIRTY_RECTS = 8;
+    SDL_Rect dirty_rects[_MAX_DIRTY_RECTS];
+    int dirty_count = 0;
+    // Clip rectangle the engine keeps for the current frame, restored after anything that
+    // switches render targets or clips on its own.
+    SDL_Rect frame_clip = {0, 0, 0, 0};
+    bool frame_clip_enabled = false;
+
+    SDL_Rect _UnionRect(const SDL_Rect& a, const SDL_Rect& b)
+    {
+        int x0 = min(a.x, b.x), y0 = min(a.y, b.y);
+        int x1 = max(a.x + a.w, b.x + b.w), y1 = max(a.y + a.h, b.y + b.h);
+        SDL_Rect r = {x0, y0, x1 - x0, y1 - y0};
+        return r;
+    }
+
+    // Extra area merging a and b would redraw that neither of them needs.
+    int64_t _MergeWaste(const SDL_Rect& a, const SDL_Rect& b)
+    {
+        SDL_Rect u = _UnionRect(a, b);
+        return (int64_t)u.w * u.h - (int64_t)a.w * a.h - (int64_t)b.w * b.h;
+    }
+
+    void InvalidateRegion(int x, int y, int w, int h)
+    {
+        int x0 = max(x, 0), y0 = max(y, 0);
+        int x1 = min(x + w, (int)screen_width), y1 = min(y + h, (int)screen_height);
+        if(x1 <= x0 || y1 <= y0)
+            return;
+        SDL_Rect r = {x0, y0, x1 - x0, y1 - y0};
+        // Fold r into any rect it is cheap to merge with, then retry with the grown rect.
+        bool merged = true;
+        while(merged)
+        {
+            merged = false;
+            for(int i = 0; i < dirty_count; i++)
+            {
+                if(_MergeWaste(r, dirty_rects[i]) * 4 <= (int64_t)r.w * r.h + (int64_t)dirty_rects[i].w * dirty_rects[i].h)
+                {
+                    r = _UnionRect(r, dirty_rects[i]);
+                    dirty_rects[i] = dirty_rects[--dirty_count];
+                    merged = true;
+                    break;
+                }
+            }
+        }
+        if(dirty_count < _MAX_DIRTY_RECTS)
+        {
+            dirty_rects[dirty_count++] = r;
+            return;
+        }
+        // Full: merge with whichever rect wastes the least.
+        int best = 0;
+        for(int i = 1; i < dirty_count; i++)
+        {
+            if(_MergeWaste(r, dirty_rects[i]) < _MergeWaste(r, dirty_rects[best]))
+                best = i;
+        }
+        dirty_rects[best] = _UnionRect(r, dirty_rects[best]);
+    }
+
+    void InvalidateScreen()
+    {
+        InvalidateRegion(0, 0, screen_width, screen_height);
+    }
+
+    void SetRetainedMode(bool enable)
+    {
+        retained_mode = enable;
+        InvalidateScreen();
+    }
+
+    bool IsRetainedMode() { return retained_mode; }
+    // Region being redrawn this frame while in retained mode, the whole screen otherwise.
+    SDL_Rect GetRedrawRect() { return frame_clip_enabled ? frame_clip : SDL_Rect{0, 0, (int)screen_width, (int)screen_height}; }
+
+    // Clips to rect within the frame clip, or back to just the frame clip when rect is NULL.
+    void _SetClip(const SDL_Rect* rect)
+    {
+        if(rect == NULL)
+        {
+            SDL_RenderSetClipRect(window_renderer, frame_clip_enabled ? &frame_clip : NULL);
+            return;
+        }
+        SDL_Rect clip = *rect;
+        if(frame_clip_enabled && !SDL_IntersectRect(rect, &frame_clip, &clip))
+            clip.w = clip.h = 0;
+        SDL_RenderSetClipRect(window_renderer, &clip);
+    }
+
+    typedef struct
+    {
+        uint32_t drawn;
+        uint32_t culled;
+    } DrawStats;
+
+    Camera* active_camera = NULL;
+    DrawStats draw_stats = DrawStats();
+    DrawStats last_draw_stats = DrawStats();
+
+    // Pass NULL to go back to drawing in plain screen coordinates.
+    void SetCamera(Camera* camera) { active_camera = camera; }
+    Camera* GetCamera() { return active_camera; }
+    // Draw calls sent to SDL and draw calls skipped as off screen during the last frame.
+    DrawStats GetDrawStats() { return last_draw_stats; }
+
+    // Replayed command buffers and canvases swap in their own camera on the thread doing the
+    // drawing, without touching the one the app set.
+    static thread_local bool camera_overridden = false;
+    static thread_local Camera* camera_override = NULL;
+
+    Camera* _ActiveCamera()
+    {
+        return camera_overridden ? camera_override : active_camera;
+    }
+
+    enum class _DrawOp : uint8_t
+    {
+        CAMERA = 0,
+        CLEAR,
+        PIXEL,
+        LINE,
+        BLOCK,
+        TRIANGLE,
+        ELLIPSE,
+        POLYGON,
+        TEXTURE,
+        IMAGE,
+        TEXT,
+        CALL,
+    };
+
+    const uint32_t _NO_COMMAND_DATA = 0xFFFFFFFF;
+
+    typedef struct
+    {
+        _DrawOp op;
+        bool fill;
+        uint8_t r, g, b, a;
+        int v[6];
+        float f[4];
+        void* object;
+        // Start of this command's extra data: polygon points and texture source rects in
+        // ints, strings in text, callbacks in calls.
+        uint32_t data;
+    } _internal_draw_command_t;
+
+    // Draw calls recorded instead of executed, for replaying later on the thread that owns
+    // the renderer. Calls keep the arguments they were made with, including the camera.
+    class CommandBuffer
+    {
+        public:
+        void Clear()
+        {
+            commands.clear();
+            ints.clear();
+            text.clear();
+            calls.clear();
+            has_snapshot = false;
+        }
+
+        int GetSize() { return (int)commands.size(); }
+
+        // Adds other's commands after this buffer's own.
+        void Append(const CommandBuffer& other)
+        {
+            uint32_t ints_base = ints.size(), text_base = text.size(), calls_base = calls.size();
+            ints.insert(ints.end(), other.ints.begin(), other.ints.end());
+            text.insert(text.end(), other.text.begin(), other.text.end());
+            calls.insert(calls.end(), other.calls.begin(), other.calls.end());
+            commands.reserve(commands.size() + other.commands.size());
+            for(size_t i = 0; i < other.commands.size(); i++)
+            {
+                _internal_draw_command_t c = other.commands[i];
+                if(c.op == _DrawOp::CAMERA)
+                {
+                    // Camera changes that restate the current camera are dropped.
+                    if(has_snapshot && c.fill == snapshot_camera && (!c.fill ||
+                       (c.f[0] == snapshot[0] && c.f[1] == snapshot[1] && c.f[2] == snapshot[2] && c.f[3] == snapshot[3])))
+                        continue;
+                    has_snapshot = true;
+                    snapshot_camera = c.fill;
+                    for(int k = 0; k < 4; k++)
+                        snapshot[k] = c.f[k];
+                }
+                else if(c.data != _NO_COMMAND_DATA)
+                {
+                    if(c.op == _DrawOp::TEXT)
+                        c.data += text_base;
+                    else if(c.op == _DrawOp::CALL)
+                        c.data += calls_base;
+                    else
+                        c.data += ints_base;
+                }
+                commands.push_back(c);
+            }
+        }
+
+        // Executes the commands in order. Must run on the thread that owns the renderer.
+        void Replay();
+
+        // Starts a command, putting a camera change in front of it when needed.
+        _internal_draw_command_t& _Add(_DrawOp op, uint8_t r = 0, uint8_t g = 0, uint8_t b = 0, uint8_t a = 0)
+        {
+            Camera* camera = _ActiveCamera();
+            if(!has_snapshot || (camera != NULL) != snapshot_camera || (camera != NULL &&
+               (camera->x != snapshot[0] || camera->y != snapshot[1] || camera->zoom != snapshot[2] || camera->rotation != snapshot[3])))
+            {
+                has_snapshot = true;
+                snapshot_camera = (camera != NULL);
+                _internal_draw_command_t c = _internal_draw_command_t();
+                c.op = _DrawOp::CAMERA;
+                c.fill = snapshot_camera;
+                c.data = _NO_COMMAND_DATA;
+                if(camera != NULL)
+                {
+                    snapshot[0] = c.f[0] = camera->x;
+                    snapshot[1] = c.f[1] = camera->y;
+                    snapshot[2] = c.f[2] = camera->zoom;
+                    snapshot[3] = c.f[3] = camera->rotation;
+                }
+                commands.push_back(c);
+            }
+            _internal_draw_command_t c = _internal_draw_command_t();
+            c.op = op;
+            c.r = r; c.g = g; c.b = b; c.a = a;
+            c.data = _NO_COMMAND_DATA;
+            commands.push_back(c);
+            return commands.back();
+        }
+
+        void _AddCall(const function<void()>& call)
+        {
+            _Add(_DrawOp::CALL).data = calls.size();
+            calls.push_back(call);
+        }
+
+        vector<_internal_draw_command_t> commands;
+        vector<int> ints;
+        vector<char> text;
+        vector<function<void()>> calls;
+
+        private:
+        bool has_snapshot = false;
+        bool snapshot_camera = false;
+        float snapshot[4] = {0, 0, 0, 0};
+        Camera replay_camera;
+    };
+
+    // Buffer the calling thread records into, NULL when draw calls go straight to SDL.
+    static thread_local CommandBuffer* recording_buffer = NULL;
+    // Advanced as each frame starts being drawn or recorded; by the update thread when
+    // pipelined. Objects that hand data to recorded calls keep it until two frames later.
+    uint32_t frame_serial = 0;
+
+    // Draw calls made on this thread are recorded into buffer until EndRecording().
+    void BeginRecording(CommandBuffer* buffer) { recording_buffer = buffer; }
+    void EndRecording() { recording_buffer = NULL; }
+    bool IsRecording() { return recording_buffer != NULL; }
+
+    // Two copies of some state for pipelined mode: Update() writes one while the previous
+    // frame, replayed on the main thread, may still read the other. Swap() once per frame.
+    template<typename T>
+    class DoubleBuffered
+    {
+        public:
+        T& Write() { return copies[current]; }
+        T& Read() { return copies[current ^ 1]; }
+        void Swap() { current ^= 1; }
+
+        private:
+        T copies[2];
+        int current = 0;
+    };
+
+    // Counts the draw and returns true when the screen space box misses the screen entirely.
+    bool _CullScreenBox(float x0, float y0, float x1, float y1)
+    {
+        if(frame_clip_enabled)
+        {
+            // Retained mode: only the region being redrawn counts as on screen.
+            if(x1 < frame_clip.x || y1 < frame_clip.y || x0 >= frame_clip.x + frame_clip.w || y0 >= frame_clip.y + frame_clip.h)
+            {
+                draw_stats.culled++;
+                return true;
+            }
+            draw_stats.drawn++;
+            return false;
+        }
+        if(x1 < 0.0f || y1 < 0.0f || x0 >= (float)screen_width || y0 >= (float)screen_height)
+        {
+            draw_stats.culled++;
+            return true;
+        }
+        draw_stats.drawn++;
+        return false;
+    }
+
+    Vector2 _ToScreen(float x, float y)
+    {
+        Camera* camera = _ActiveCamera();
+        if(camera == NULL)
+            return Vector2(x, y);
+        return camera->GetTransform().Apply(Vector2(x, y));
+    }
+
+    float _ScreenScale()
+    {
+        Camera* camera = _ActiveCamera();
+        return (camera == NULL) ? 1.0f : camera->zoom;
+    }
+
+    typedef struct
+    {
+        SDL_FRect dest;
+        SDL_FPoint pivot;
+        double angle;
+    } _internal_screen_quad_t;
+
+    // Works out where a texture drawn at (x, y) with size w x h lands on screen. The pivot is
+    // relative to the top left corner, as with SDL_RenderCopyEx. Returns false when culled.
+    bool _PlaceTexture(int x, int y, int w, int h, double angle, int pivotx, int pivoty, _internal_screen_quad_t* out)
+    {
+        float zoom = _ScreenScale();
+        Vector2 pivot = _ToScreen(x + pivotx, y + pivoty);
+        out->dest.x = pivot.x - pivotx * zoom;
+        out->dest.y = pivot.y - pivoty * zoom;
+        out->dest.w = w * zoom;
+        out->dest.h = h * zoom;
+        out->pivot.x = pivotx * zoom;
+        out->pivot.y = pivoty * zoom;
+        out->angle = angle;
+        if(_ActiveCamera() != NULL)
+            out->angle -= _ActiveCamera()->rotation * (180.0 / _PI);
+
+        if(out->angle == 0.0)
+            return !_CullScreenBox(out->dest.x, out->dest.y, out->dest.x + out->dest.w, out->dest.y + out->dest.h);
+        // Rotated, so test the circle the quad sweeps around its pivot.
+        float rx = max(out->pivot.x, out->dest.w - out->pivot.x), ry = max(out->pivot.y, out->dest.h - out->pivot.y);
+        float r = sqrt(rx * rx + ry * ry);
+        return !_CullScreenBox(pivot.x - r, pivot.y - r, pivot.x + r, pivot.y + r);
+    }
+
+    class Image;
+
+    // Draws from image are recorded against the image, whose texture may be evicted and
+    // uploaded again by the time they are replayed.
+    void _DrawTexture(SDL_Texture* texture, const SDL_Rect* src, int x, int y, int w, int h, double angle, int pivotx, int pivoty, SDL_RendererFlip flip, Image* image = NULL)
+    {
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add((image != NULL) ? _DrawOp::IMAGE : _DrawOp::TEXTURE, flip);
+            c.object = (image != NULL) ? (void*)image : (void*)texture;
+            c.v[0] = x; c.v[1] = y; c.v[2] = w; c.v[3] = h; c.v[4] = pivotx; c.v[5] = pivoty;
+            c.f[0] = angle;
+            if(src != NULL)
+            {
+                c.data = recording_buffer->ints.size();
+                recording_buffer->ints.insert(recording_buffer->ints.end(), {src->x, src->y, src->w, src->h});
+            }
+            return;
+        }
+        _internal_screen_quad_t q;
+        if(_PlaceTexture(x, y, w, h, angle, pivotx, pivoty, &q))
+            SDL_RenderCopyExF(window_renderer, texture, src, &q.dest, q.angle, &q.pivot, flip);
+    }
+
+    // Index buffer for SDL_RenderGeometry meshes made of quads, four vertices each, drawn as
+    // two triangles. Shared by everything that batches quads; grown on demand, never shrunk.
+    vector<int> quad_indices;
+
+    const int* _QuadIndices(int quads)
+    {
+        int have = (int)quad_indices.size() / 6;
+        if(have < quads)
+        {
+            quad_indices.resize((size_t)quads * 6);
+            for(int i = have; i < quads; i++)
+            {
+                int* idx = &quad_indices[(size_t)i * 6];
+                int v = i * 4;
+                idx[0] = v; idx[1] = v + 1; idx[2] = v + 2;
+                idx[3] = v + 2; idx[4] = v + 3; idx[5] = v;
+            }
+        }
+        return quad_indices.data();
+    }
+
+    // One bit per pixel, 64 pixels per word, bit (x & 63) of word (x >> 6) is pixel x.
+    // Rows are also kept mirrored so horizontally flipped draws test without rebuilding.
+    class CollisionMask
+    {
+        public:
+        int width, height;
+        int words_per_row;
+        // Bounding box of the set bits, inclusive. Empty masks have bound_x1 < bound_x0.
+        int bound_x0, bound_y0, bound_x1, bound_y1;
+        vector<uint64_t> rows;
+        vector<uint64_t> rows_flipped;
+
+        CollisionMask(SDL_Surface* surf, int sx, int sy, int w, int h, uint8_t alpha_threshold = 1)
+        {
+            this->width = w;
+            this->height = h;
+            this->words_per_row = (w + 63) / 64;
+            this->rows.assign(words_per_row * h, 0);
+            this->rows_flipped.assign(words_per_row * h, 0);
+            this->bound_x0 = w; this->bound_y0 = h;
+            this->bound_x1 = -1; this->bound_y1 = -1;
+
+            int bpp = surf->format->BytesPerPixel;
+            if(bpp != 3 && bpp != 4)
+            {
+                ERROR_OUT("Unable to build collision mask! Non-RGB or Non-RGBA surfaces not supported.\n");
+                return;
+            }
+            uint32_t key;
+            bool has_key = (SDL_GetColorKey(surf, &key) == 0);
+
+            for(int y = 0; y < h; y++)
+            {
+                uint8_t* p = (uint8_t*)surf->pixels + (sy + y) * surf->pitch + sx * bpp;
+                uint64_t* row = &rows[y * words_per_row];
+                uint64_t* row_flipped = &rows_flipped[y * words_per_row];
+                for(int x = 0; x < w; x++, p += bpp)
+                {
+                    uint32_t raw = 0;
+                    memcpy(&raw, p, bpp);
+                    uint8_t r, g, b, a;
+                    SDL_GetRGBA(raw, surf->format, &r, &g, &b, &a);
+                    if(a < alpha_threshold || (has_key && raw == key))
+                        continue;
+
+                    int fx = w - 1 - x;
+                    row[x >> 6] |= (uint64_t)1 << (x & 63);
+                    row_flipped[fx >> 6] |= (uint64_t)1 << (fx & 63);
+                    if(x < bound_x0) bound_x0 = x;
+                    if(x > bound_x1) bound_x1 = x;
+                    if(y < bound_y0) bound_y0 = y;
+                    bound_y1 = y;
+                }
+            }
+        }
+
+        bool IsEmpty()
+        {
+            return bound_x1 < bound_x0;
+        }
+
+        bool TestPixel(int x, int y, bool h_flip = false, bool v_flip = false)
+        {
+            if(x < 0 || y < 0 || x >= width || y >= height)
+                return false;
+            if(h_flip)
+                x = width - 1 - x;
+            if(v_flip)
+                y = height - 1 - y;
+            return (rows[y * words_per_row + (x >> 6)] >> (x & 63)) & 1;
+        }
+
+        // Tests mask a drawn at (ax, ay) against mask b drawn at (bx, by), in screen pixels.
+        // Only the rows and words inside both bounding boxes are visited.
+        static bool Overlaps(CollisionMask* a, int ax, int ay, CollisionMask* b, int bx, int by, bool a_h_flip = false, bool a_v_flip = false, bool b_h_flip = false, bool b_v_flip = false)
+        {
+            if(a->IsEmpty() || b->IsEmpty())
+                return false;
+
+            int a_x0, a_x1, a_y0, a_y1, b_x0, b_x1, b_y0, b_y1;
+            a->_FlippedBounds(a_h_flip, a_v_flip, &a_x0, &a_y0, &a_x1, &a_y1);
+            b->_FlippedBounds(b_h_flip, b_v_flip, &b_x0, &b_y0, &b_x1, &b_y1);
+
+            // Overlap of the two bounding boxes, in a's local space
+            int dx = bx - ax;
+            int dy = by - ay;
+            int x0 = max(a_x0, b_x0 + dx);
+            int x1 = min(a_x1, b_x1 + dx);
+            int y0 = max(a_y0, b_y0 + dy);
+            int y1 = min(a_y1, b_y1 + dy);
+            if(x0 > x1 || y0 > y1)
+                return false;
+
+            const vector<uint64_t>& a_rows = a_h_flip ? a->rows_flipped : a->rows;
+            const vector<uint64_t>& b_rows = b_h_flip ? b->rows_flipped : b->rows;
+            int word0 = x0 >> 6;
+            int word1 = x1 >> 6;
+            uint64_t first_mask = ~(uint64_t)0 << (x0 & 63);
+            uint64_t last_mask = ~(uint64_t)0 >> (63 - (x1 & 63));
+
+            for(int y = y0; y <= y1; y++)
+            {
+                int ya = a_v_flip ? a->height - 1 - y : y;
+                int yb = b_v_flip ? b->height - 1 - (y - dy) : (y - dy);
+                const uint64_t* row_a = &a_rows[ya * a->words_per_row];
+                const uint64_t* row_b = &b_rows[yb * b->words_per_row];
+                for(int k = word0; k <= word1; k++)
+                {
+                    uint64_t bits = row_a[k] & _FetchBits(row_b, b->words_per_row, (k << 6) - dx);
+                    if(k == word0)
+                        bits &= first_mask;
+                    if(k == word1)
+                        bits &= last_mask;
+                    if(bits)
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        private:
+        void _FlippedBounds(bool h_flip, bool v_flip, int* x0, int* y0, int* x1, int* y1)
+        {
+            *x0 = h_flip ? width - 1 - bound_x1 : bound_x0;
+            *x1 = h_flip ? width - 1 - bound_x0 : bound_x1;
+            *y0 = v_flip ? height - 1 - bound_y1 : bound_y0;
+            *y1 = v_flip ? height - 1 - bound_y0 : bound_y1;
+        }
+
+        // 64 bits of a row starting at an arbitrary (possibly negative) bit offset.
+        static uint64_t _FetchBits(const uint64_t* row, int words, int offset)
+        {
+            int i = offset >> 6;
+            int s = offset & 63;
+            uint64_t lo = (i >= 0 && i < words) ? row[i] : 0;
+            if(s == 0)
+                return lo;
+            uint64_t hi = (i + 1 >= 0 && i + 1 < words) ? row[i + 1] : 0;
+            return (lo >> s) | (hi << (64 - s));
+        }
+    };
+
+    // Per byte (a + b + 1) / 2 of two packed pixels, the same rounding as _mm_avg_epu8.
+    inline uint32_t _AveragePixels(uint32_t a, uint32_t b)
+    {
+        return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+    }
+
+    // Halves a 32 bit image with a 2x2 box filter: rows first, then columns. A last odd row
+    // or column is averaged with itself. Pitches are in pixels.
+    void _Downsample(const uint32_t* src, int src_w, int src_h, int src_pitch, uint32_t* dst, int dst_pitch)
+    {
+        int dst_w = max(src_w / 2, 1), dst_h = max(src_h / 2, 1);
+        for(int y = 0; y < dst_h; y++)
+        {
+            const uint32_t* r0 = src + (size_t)min(2 * y, src_h - 1) * src_pitch;
+            const uint32_t* r1 = src + (size_t)min(2 * y + 1, src_h - 1) * src_pitch;
+            uint32_t* out = dst + (size_t)y * dst_pitch;
+            int x = 0;
+            #ifdef ENGINE2D_SIMD
+            for(; 2 * x + 8 <= src_w; x += 4)
+            {
+                __m128i v0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2 * x)), _mm_loadu_si128((const __m128i*)(r1 + 2 * x)));
+                __m128i v1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2 * x + 4)), _mm_loadu_si128((const __m128i*)(r1 + 2 * x + 4)));
+                __m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(v0), _mm_castsi128_ps(v1), _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(v0), _mm_castsi128_ps(v1), _MM_SHUFFLE(3, 1, 3, 1)));
+                _mm_storeu_si128((__m128i*)(out + x), _mm_avg_epu8(even, odd));
+            }
+            #endif
+            for(; x < dst_w; x++)
+            {
+                int x0 = min(2 * x, src_w - 1), x1 = min(2 * x + 1, src_w - 1);
+                out[x] = _AveragePixels(_AveragePixels(r0[x0], r1[x0]), _AveragePixels(r0[x1], r1[x1]));
+            }
+        }
+    }
+
+    // Converts RGBA32 pixels to and from premultiplied alpha, so filtering does not bleed the
+    // colour of transparent pixels into their neighbours.
+    void _Premultiply(uint32_t* pixels, size_t count)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            uint8_t* p = (uint8_t*)&pixels[i];
+            p[0] = (p[0] * p[3] + 127) / 255;
+            p[1] = (p[1] * p[3] + 127) / 255;
+            p[2] = (p[2] * p[3] + 127) / 255;
+        }
+    }
+
+    void _Unpremultiply(const uint32_t* src, uint32_t* dst, size_t count)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            const uint8_t* s = (const uint8_t*)&src[i];
+            uint8_t* d = (uint8_t*)&dst[i];
+            int a = s[3];
+            for(int c = 0; c < 3; c++)
+                d[c] = (a == 0) ? 0 : min((s[c] * 255 + a / 2) / a, 255);
+            d[3] = a;
+        }
+    }
+
+    bool mipmaps_on_load = false;
+
+    // Images made after this build their mipmaps straight away, see Image::BuildMipmaps().
+    void SetMipmapsOnLoad(bool enable) { mipmaps_on_load = enable; }
+    bool GetMipmapsOnLoad() { return mipmaps_on_load; }
+
+    // Bytes held by images, pixel blocks and render targets.
+    typedef struct
+    {
+        size_t surface_bytes;       // Decoded image pixels kept on the CPU.
+        size_t texture_bytes;       // Image textures, the part the texture budget applies to.
+        size_t pixel_block_bytes;   // PixelBlock pixel arrays and their textures.
+        size_t target_bytes;        // Screen, Canvas and TileMap render targets.
+        int images;
+        int textures_evicted;       // Totals since start.
+        int textures_reloaded;
+        int tiles_over_budget;      // TiledImage tiles kept past max_tiles because they were on screen.
+        int images_over_budget;     // Uploads left over the texture budget because every other image was on screen.
+    } MemoryStats;
+
+    MemoryStats memory_stats = MemoryStats();
+    size_t texture_budget = 0;
+    bool release_surfaces = false;
+    uint64_t texture_clock = 0;
+    // Frames presented so far, on the thread that owns the renderer.
+    uint32_t presented_frames = 0;
+    // texture_clock as the last frame was presented; anything used after it is on screen now.
+    uint64_t presented_texture_clock = 0;
+    vector<Image*> live_images;
+
+    MemoryStats GetMemoryStats() { return memory_stats; }
+
+    // Images loaded from files after this drop their CPU copy once the texture is made. The
+    // copy comes back from the file when GetPixel(), colour keys or collision masks need it,
+    // and is kept from then on.
+    void SetReleaseSurfaces(bool enable) { release_surfaces = enable; }
+    bool GetReleaseSurfaces() { return release_surfaces; }
+
+    void SetTextureBudget(size_t bytes);
+    size_t GetTextureBudget() { return texture_budget; }
+
+    class Image
+    {
+        public:
+        int width, height;
+        // NULL while evicted; use GetTexture() to have it brought back.
+        SDL_Texture* data;
+        // NULL once released; use GetSurface() to have it brought back.
+        SDL_Surface* image;
+        CollisionMask* mask = NULL;
+
+        Image(string filename)
+        {
+            TRACE_ZONE("Image load");
+            this->filename = filename;
+            this->image = NULL;
+            this->data = NULL;
+            this->width = this->height = 0;
+            live_images.push_back(this);
+            memory_stats.images++;
+            SDL_Surface* im = IMG_Load(filename.c_str());
+            if(im == NULL)
+            {
+                ERROR_OUT("Could not load image: %s\nMessage: %s\n", filename.c_str(), SDL_GetError());
+                this->filename.clear();
+            }
+            else
+            {
+                this->width = im->w;
+                this->height = im->h;
+                if(mipmaps_on_load)
+                    mip_request = 0;
+                _SetSurface(im);
+                _Upload();
+                if(release_surfaces)
+                    ReleaseSurface();
+            }
+        }
+
+        // The image shares im's pixels, so im has to stay alive. Its surface is never released
+        // since there is no file to bring it back from.
+        Image(SDL_Surface* im)
+        {
+            TRACE_ZONE("Image upload");
+            this->image = NULL;
+            this->data = NULL;
+            live_images.push_back(this);
+            memory_stats.images++;
+            _SetSurface(SDL_CreateRGBSurfaceFrom(im->pixels, im->w, im->h, im->format->BitsPerPixel, im->pitch, im->format->Rmask, im->format->Gmask, im->format->Bmask, im->format->Amask));
+            this->width = im->w;
+            this->height = im->h;
+            if(mipmaps_on_load)
+                mip_request = 0;
+            _Upload();
+        }
+
+        void DrawImage(int x, int y, int offsetx=0, int offsety=0, int w=0, int h=0, float angle=0.0f, int pivotx=0, int pivoty=0, float scale = 1.0, bool h_flip=false, bool v_flip=false)
+        {
+            ALLOCATION_TAG("Image::DrawImage");
+            SDL_Rect src;
+            SDL_RendererFlip flip = SDL_FLIP_NONE;
+            src.x = offsetx; src.y = offsety;
+            if(w == 0 || h == 0)
+            {
+                src.w = this->width - offsetx; src.h = this->height - offsety;
+            }
+            else
+            {
+                src.w = w; src.h = h;
+            }
+
+            if(h_flip)
+                flip = (SDL_RendererFlip)((int)flip | SDL_FLIP_HORIZONTAL);
+            if(v_flip)
+                flip = (SDL_RendererFlip)((int)flip | SDL_FLIP_VERTICAL);
+
+            // Recorded draws fetch the texture, and pick the mipmap, when they are replayed.
+            if(recording_buffer != NULL)
+                _DrawTexture(NULL, &src, x, y, src.w * scale, src.h * scale, angle, pivotx, pivoty, flip, this);
+            else
+                _DrawImageRect(src, x, y, src.w * scale, src.h * scale, angle, pivotx, pivoty, flip);
+        }
+
+        // Draws src stretched to w x h, from the smallest mipmap that is still at least as
+        // large as it ends up on screen. A level is only used when src falls on whole texels
+        // of it, so sprite sheet frames never pick up their neighbours' edges.
+        void _DrawImageRect(const SDL_Rect& src, int x, int y, int w, int h, double angle, int pivotx, int pivoty, SDL_RendererFlip flip)
+        {
+            SDL_Texture* texture = GetTexture();
+            SDL_Rect level_src = src;
+            if(!mip_textures.empty() && src.w > 0 && src.h > 0)
+            {
+                int level = _MipLevelForScale(min(abs(w) / (float)src.w, abs(h) / (float)src.h) * _ScreenScale());
+                bool whole = (src.x == 0 && src.y == 0 && src.w == this->width && src.h == this->height);
+                while(level > 0 && !whole && ((src.x | src.y | src.w | src.h) & ((1 << level) - 1)) != 0)
+                    level--;
+                if(level > 0)
+                {
+                    texture = mip_textures[level - 1];
+                    if(whole)
+                    {
+                        level_src.x = level_src.y = 0;
+                        SDL_QueryTexture(texture, NULL, NULL, &level_src.w, &level_src.h);
+                    }
+                    else
+                    {
+                        level_src.x = src.x >> level; level_src.y = src.y >> level;
+                        level_src.w = src.w >> level; level_src.h = src.h >> level;
+                    }
+                }
+            }
+            _DrawTexture(texture, &level_src, x, y, w, h, angle, pivotx, pivoty, flip);
+        }
+
+        // Keeps half size copies of the image, each made from the one before with a 2x2 box
+        // filter, down to max_levels of them or until a side would drop below one pixel (0).
+        // Draws scaled below one half use the closest copy instead of sampling the full image.
+        // They are rebuilt whenever the texture is uploaded again, and count as texture bytes.
+        void BuildMipmaps(int max_levels = 0)
+        {
+            mip_request = max(max_levels, 0);
+            if(this->data != NULL)
+            {
+                TRACE_ZONE("Image upload");
+                _DestroyTexture();
+                _Upload();
+            }
+        }
+
+        void ReleaseMipmaps()
+        {
+            mip_request = -1;
+            _DestroyMipmaps();
+        }
+
+        int GetMipmapLevels() { return (int)mip_textures.size(); }
+
+        // Smallest level still at least scale times the image's size; 0 is the image itself.
+        int _MipLevelForScale(float scale)
+        {
+            int level = 0;
+            while(level < (int)mip_textures.size() && scale <= 0.5f)
+            {
+                scale *= 2.0f;
+                level++;
+            }
+            return level;
+        }
+
+        // The texture for a level from _MipLevelForScale(), uploading the image if needed.
+        SDL_Texture* _GetMipTexture(int level)
+        {
+            SDL_Texture* texture = GetTexture();
+            return (level > 0 && level <= (int)mip_textures.size()) ? mip_textures[level - 1] : texture;
+        }
+
+        void GetPixel(int x, int y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+        {
+            SDL_Surface* image = GetSurface();
+            int bpp = image->format->BytesPerPixel;
+            uint8_t *p = (Uint8 *)image->pixels + y * image->pitch + x * bpp;
+            if(bpp != 3 && bpp != 4)
+            {
+                ERROR_OUT("Unable to get pixel! Non-RGB or Non-RGBA surfaces not supported.\n");
+            }
+            if(bpp == 3)
+            {
+                *r = p[0];
+                *g = p[1];
+                *b = p[2];
+                *a = 255;
+            }
+            else
+            {
+                *r = p[0];
+                *g = p[1];
+                *b = p[2];
+                *a = p[3];
+            }
+        }
+
+        void Colourise(uint8_t r, uint8_t g, uint8_t b)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, r, g, b]() { Colourise(r, g, b); });
+                return;
+            }
+            colour_mod.r = r;
+            colour_mod.g = g;
+            colour_mod.b = b;
+            if(this->data != NULL)
+                SDL_SetTextureColorMod(this->data, r, g, b);
+            for(size_t i = 0; i < mip_textures.size(); i++)
+                SDL_SetTextureColorMod(mip_textures[i], r, g, b);
+        }
+
+        void TransparentColour(bool enable, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            SDL_Surface* image = GetSurface();
+            if(enable)
+            {
+                SDL_SetColorKey(image, SDL_TRUE, (uint32_t)((r << 24) + (g << 16) + (b << 8) + (a)));
+            }
+            else
+            {
+                SDL_SetColorKey(image, SDL_FALSE, 0);
+            }
+            TRACE_ZONE("Image upload");
+            _DestroyTexture();
+            _Upload();
+            if(this->mask != NULL)
+                BuildCollisionMask();
+        }
+
+        void BuildCollisionMask(uint8_t alpha_threshold = 1)
+        {
+            delete this->mask;
+            this->mask = new CollisionMask(GetSurface(), 0, 0, this->width, this->height, alpha_threshold);
+        }
+
+        // Pixel perfect test of this image drawn at (x, y) against other drawn at (ox, oy).
+        // Both images need BuildCollisionMask() first. Rotation and scale are not accounted for.
+        bool Collides(int x, int y, Image* other, int ox, int oy, bool h_flip = false, bool v_flip = false, bool other_h_flip = false, bool other_v_flip = false)
+        {
+            if(this->mask == NULL || other->mask == NULL)
+            {
+                ERROR_OUT("Collides() called on an image without a collision mask!\n");
+                return false;
+            }
+            return CollisionMask::Overlaps(this->mask, x, y, other->mask, ox, oy, h_flip, v_flip, other_h_flip, other_v_flip);
+        }
+
+        // The texture, uploaded again first if it was evicted. Marks the image as used.
+        SDL_Texture* GetTexture()
+        {
+            last_used = ++texture_clock;
+            if(this->data == NULL && (this->image != NULL || !filename.empty()))
+            {
+                TRACE_ZONE("Image reload");
+                _Upload();
+                memory_stats.textures_reloaded++;
+            }
+            return this->data;
+        }
+
+        // The CPU copy, decoded from the file again if it was released. Asking for it means
+        // the image needs it, so it is not released again.
+        SDL_Surface* GetSurface()
+        {
+            keep_surface = true;
+            if(this->image == NULL && !filename.empty())
+            {
+                TRACE_ZONE("Image load");
+                _SetSurface(IMG_Load(filename.c_str()));
+                if(this->image == NULL)
+                    ERROR_OUT("Could not reload image: %s\nMessage: %s\n", filename.c_str(), SDL_GetError());
+            }
+            return this->image;
+        }
+
+        // Frees the CPU copy unless something needed it. Returns whether it is gone.
+        bool ReleaseSurface()
+        {
+            if(keep_surface || filename.empty() || this->image == NULL)
+                return this->image == NULL;
+            _SetSurface(NULL);
+            return true;
+        }
+
+        bool IsResident() { return this->data != NULL; }
+        const string& GetFilename() { return filename; }
+        size_t GetSurfaceBytes() { return surface_bytes; }
+        size_t GetTextureBytes() { return (this->data != NULL) ? (size_t)width * height * 4 + mip_bytes : 0; }
+
+        // Evicts the least recently drawn textures until image textures fit in the budget.
+        // keep is never evicted.
+        static void _EnforceTextureBudget(Image* keep)
+        {
+            while(texture_budget != 0 && memory_stats.texture_bytes > texture_budget)
+            {
+                Image* oldest = NULL;
+                for(size_t i = 0; i < live_images.size(); i++)
+                {
+                    Image* im = live_images[i];
+                    if(im != keep && im->data != NULL && (im->image != NULL || !im->filename.empty()) && im->last_used <= presented_texture_clock &&
+                       (oldest == NULL || im->last_used < oldest->last_used))
+                        oldest = im;
+                }
+                if(oldest == NULL)
+                {
+                    // Images drawn this frame are kept even over budget, rather than reloaded every frame.
+                    if(keep != NULL)
+                        memory_stats.images_over_budget++;
+                    return;
+                }
+                oldest->_DestroyTexture();
+                memory_stats.textures_evicted++;
+            }
+        }
+
+        ~Image()
+        {
+            live_images.erase(find(live_images.begin(), live_images.end(), this));
+            memory_stats.images--;
+            delete this->mask;
+            _SetSurface(NULL);
+            _DestroyTexture();
+        }
+
+        private:
+        string filename;
+        bool keep_surface = false;
+        size_t surface_bytes = 0;
+        SDL_Color colour_mod = {255, 255, 255, 255};
+        uint64_t last_used = 0;
+        // Levels asked for by BuildMipmaps(), 0 for all of them, -1 for none.
+        int mip_request = -1;
+        vector<SDL_Texture*> mip_textures;
+        size_t mip_bytes = 0;
+
+        void _SetSurface(SDL_Surface* surface)
+        {
+            if(this->image != NULL)
+                SDL_FreeSurface(this->image);
+            memory_stats.surface_bytes -= surface_bytes;
+            this->image = surface;
+            surface_bytes = (surface != NULL) ? (size_t)surface->h * surface->pitch : 0;
+            memory_stats.surface_bytes += surface_bytes;
+        }
+
+        void _Upload()
+        {
+            bool had_surface = (this->image != NULL);
+            bool keep = keep_surface;
+            SDL_Surface* surface = GetSurface();
+            keep_surface = keep;
+            if(surface == NULL)
+                return;
+            this->data = SDL_CreateTextureFromSurface(window_renderer, surface);
+            if(this->data == NULL)
+                return;
+            SDL_SetTextureColorMod(this->data, colour_mod.r, colour_mod.g, colour_mod.b);
+            memory_stats.texture_bytes += (size_t)width * height * 4;
+            if(mip_request >= 0)
+                _BuildMipmaps(surface);
+            last_used = ++texture_clock;
+            if(!had_surface)
+                ReleaseSurface();
+            _EnforceTextureBudget(this);
+        }
+
+        void _DestroyTexture()
+        {
+            if(this->data == NULL)
+                return;
+            SDL_DestroyTexture(this->data);
+            this->data = NULL;
+            memory_stats.texture_bytes -= (size_t)width * height * 4;
+            _DestroyMipmaps();
+        }
+
+        void _BuildMipmaps(SDL_Surface* surface)
+        {
+            _DestroyMipmaps();
+            // Converting also turns a colour key into alpha.
+            SDL_Surface* rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+            if(rgba == NULL)
+            {
+                ERROR_OUT("Could not build mipmaps: %s\n", SDL_GetError());
+                return;
+            }
+            int w = rgba->w, h = rgba->h;
+            vector<uint32_t> current((size_t)w * h), next, upload;
+            for(int y = 0; y < h; y++)
+                memcpy(&current[(size_t)y * w], (uint8_t*)rgba->pixels + (size_t)y * rgba->pitch, (size_t)w * 4);
+            SDL_FreeSurface(rgba);
+            _Premultiply(current.data(), current.size());
+
+            while((mip_request == 0 || (int)mip_textures.size() < mip_request) && w > 1 && h > 1)
+            {
+                int nw = w / 2, nh = h / 2;
+                next.resize((size_t)nw * nh);
+                _Downsample(current.data(), w, h, w, next.data(), nw);
+                upload.resize(next.size());
+                _Unpremultiply(next.data(), upload.data(), next.size());
+                SDL_Texture* texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, nw, nh);
+                if(texture == NULL)
+                    break;
+                SDL_UpdateTexture(texture, NULL, upload.data(), nw * 4);
+                SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+                SDL_SetTextureColorMod(texture, colour_mod.r, colour_mod.g, colour_mod.b);
+                mip_textures.push_back(texture);
+                mip_bytes += (size_t)nw * nh * 4;
+                current.swap(next);
+                w = nw;
+                h = nh;
+            }
+            memory_stats.texture_bytes += mip_bytes;
+        }
+
+        void _DestroyMipmaps()
+        {
+            for(size_t i = 0; i < mip_textures.size(); i++)
+                SDL_DestroyTexture(mip_textures[i]);
+            mip_textures.clear();
+            memory_stats.texture_bytes -= mip_bytes;
+            mip_bytes = 0;
+        }
+    };
+
+    // 0 turns the budget off. Evicted images are uploaded again from their surface, or their
+    // file, the next time they are drawn. Images drawn in the current frame are never
+    // evicted, so a frame that needs more than the budget goes over it until it is presented.
+    void SetTextureBudget(size_t bytes)
+    {
+        texture_budget = bytes;
+        Image::_EnforceTextureBudget(NULL);
+    }
+
+    // Lists every image and what it holds, then the totals.
+    void PrintMemoryReport()
+    {
+        MSG_OUT("%-40s %9s %12s %12s\n", "image", "size", "surface KB", "texture KB");
+        for(size_t i = 0; i < live_images.size(); i++)
+        {
+            Image* im = live_images[i];
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d", im->width, im->height);
+            MSG_OUT("%-40s %9s %12.1f %12.1f\n", im->GetFilename().empty() ? "(surface)" : im->GetFilename().c_str(), size,
+                    im->GetSurfaceBytes() / 1024.0, im->GetTextureBytes() / 1024.0);
+        }
+        MemoryStats s = memory_stats;
+        MSG_OUT("images %d: surfaces %.1f KB, textures %.1f KB (budget %.1f KB, %d evicted, %d reloaded, %d images and %d tiles over budget)\n", s.images,
+                s.surface_bytes / 1024.0, s.texture_bytes / 1024.0, texture_budget / 1024.0, s.textures_evicted, s.textures_reloaded,
+                s.images_over_budget, s.tiles_over_budget);
+        MSG_OUT("pixel blocks %.1f KB, render targets %.1f KB\n", s.pixel_block_bytes / 1024.0, s.target_bytes / 1024.0);
+    }
+
+    typedef struct
+    {
+        SDL_Texture* texture;
+        uint64_t last_used;
+        uint32_t drawn_frame;
+    } _internal_image_tile_t;
+
+    // An image cut into square textures of tile_size pixels, for pictures larger than the
+    // renderer's maximum texture size or too large to keep on the GPU whole. Tiles are uploaded
+    // the first time a draw needs them on screen, and the least recently drawn are destroyed
+    // once more than max_tiles are resident. Tiles already drawn this frame are never the ones
+    // destroyed; when the view needs more than max_tiles they all stay until it moves on. The
+    // pixels stay on the CPU as RGBA32.
+    class TiledImage
+    {
+        public:
+        int width, height;
+        int tile_size;
+        int max_tiles;
+
+        TiledImage(string filename, int tile_size = 512, int max_tiles = 16)
+        {
+            TRACE_ZONE("Image load");
+            _Init(tile_size, max_tiles);
+            SDL_Surface* im = IMG_Load(filename.c_str());
+            if(im == NULL)
+            {
+                ERROR_OUT("Could not load image: %s\nMessage: %s\n", filename.c_str(), SDL_GetError());
+                return;
+            }
+            _SetSurface(im);
+            SDL_FreeSurface(im);
+        }
+
+        // Copies im, so it does not have to stay alive.
+        TiledImage(SDL_Surface* im, int tile_size = 512, int max_tiles = 16)
+        {
+            _Init(tile_size, max_tiles);
+            _SetSurface(im);
+        }
+
+        // Same arguments as Image::DrawImage(). The source rectangle may span any number of
+        // tiles; only those that end up on screen are drawn, or uploaded.
+        void DrawImage(int x, int y, int offsetx=0, int offsety=0, int w=0, int h=0, float angle=0.0f, int pivotx=0, int pivoty=0, float scale = 1.0, bool h_flip=false, bool v_flip=false)
+        {
+            if(recording_buffer != NULL)
+            {
+                // Tiles may be evicted before replay, so the call is recorded rather than them.
+                recording_buffer->_AddCall([=]() { DrawImage(x, y, offsetx, offsety, w, h, angle, pivotx, pivoty, scale, h_flip, v_flip); });
+                return;
+            }
+            if(this->image == NULL)
+                return;
+            SDL_Rect src;
+            src.x = offsetx; src.y = offsety;
+            src.w = (w == 0 || h == 0) ? this->width - offsetx : w;
+            src.h = (w == 0 || h == 0) ? this->height - offsety : h;
+            SDL_RendererFlip flip = SDL_FLIP_NONE;
+            if(h_flip)
+                flip = (SDL_RendererFlip)((int)flip | SDL_FLIP_HORIZONTAL);
+            if(v_flip)
+                flip = (SDL_RendererFlip)((int)flip | SDL_FLIP_VERTICAL);
+
+            int tx0 = max(src.x, 0) / tile_size, ty0 = max(src.y, 0) / tile_size;
+            int tx1 = (min(src.x + src.w, this->width) - 1) / tile_size, ty1 = (min(src.y + src.h, this->height) - 1) / tile_size;
+            for(int ty = ty0; ty <= ty1; ty++)
+            {
+                for(int tx = tx0; tx <= tx1; tx++)
+                {
+                    // The part of src inside this tile, in image and then tile coordinates.
+                    int px0 = max(src.x, tx * tile_size), px1 = min(src.x + src.w, min((tx + 1) * tile_size, this->width));
+                    int py0 = max(src.y, ty * tile_size), py1 = min(src.y + src.h, min((ty + 1) * tile_size, this->height));
+                    if(px0 >= px1 || py0 >= py1)
+                        continue;
+                    SDL_Rect part = {px0 - tx * tile_size, py0 - ty * tile_size, px1 - px0, py1 - py0};
+                    // Where the part sits within the drawn rectangle, mirrored when flipped.
+                    int lx0 = h_flip ? src.x + src.w - px1 : px0 - src.x, lx1 = lx0 + part.w;
+                    int ly0 = v_flip ? src.y + src.h - py1 : py0 - src.y, ly1 = ly0 + part.h;
+                    int dx0 = (int)roundf(lx0 * scale), dx1 = (int)roundf(lx1 * scale);
+                    int dy0 = (int)roundf(ly0 * scale), dy1 = (int)roundf(ly1 * scale);
+                    _internal_screen_quad_t q;
+                    if(!_PlaceTexture(x + dx0, y + dy0, dx1 - dx0, dy1 - dy0, angle, pivotx - dx0, pivoty - dy0, &q))
+                        continue;
+                    SDL_Texture* texture = _GetTile(tx, ty);
+                    if(texture != NULL)
+                        SDL_RenderCopyExF(window_renderer, texture, &part, &q.dest, q.angle, &q.pivot, flip);
+                }
+            }
+        }
+
+        void Colourise(uint8_t r, uint8_t g, uint8_t b)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, r, g, b]() { Colourise(r, g, b); });
+                return;
+            }
+            colour_mod.r = r;
+            colour_mod.g = g;
+            colour_mod.b = b;
+            for(size_t i = 0; i < tiles.size(); i++)
+            {
+                if(tiles[i].texture != NULL)
+                    SDL_SetTextureColorMod(tiles[i].texture, r, g, b);
+            }
+        }
+
+        int GetResidentTiles() { return resident; }
+
+        // Destroys every tile texture; they are uploaded again as they are drawn.
+        void EvictTiles()
+        {
+            for(size_t i = 0; i < tiles.size(); i++)
+                _DestroyTile(i);
+        }
+
+        ~TiledImage()
+        {
+            EvictTiles();
+            if(this->image != NULL)
+            {
+                memory_stats.surface_bytes -= (size_t)this->image->h * this->image->pitch;
+                SDL_FreeSurface(this->image);
+            }
+        }
+
+        private:
+        SDL_Surface* image = NULL;
+        int tiles_x = 0, tiles_y = 0;
+        vector<_internal_image_tile_t> tiles;
+        int resident = 0;
+        SDL_Color colour_mod = {255, 255, 255, 255};
+
+        void _Init(int tile_size, int max_tiles)
+        {
+            this->width = this->height = 0;
+            this->max_tiles = max(max_tiles, 1);
+            SDL_RendererInfo info;
+            if(SDL_GetRendererInfo(window_renderer, &info) == 0 && info.max_texture_width > 0 && info.max_texture_height > 0)
+                tile_size = min(tile_size, min(info.max_texture_width, info.max_texture_height));
+            this->tile_size = max(tile_size, 1);
+        }
+
+        void _SetSurface(SDL_Surface* im)
+        {
+            // One known format lets tiles be uploaded straight from the pixels, with any colour
+            // key already turned into alpha.
+            this->image = SDL_ConvertSurfaceFormat(im, SDL_PIXELFORMAT_RGBA32, 0);
+            if(this->image == NULL)
+            {
+                ERROR_OUT("Could not convert image: %s\n", SDL_GetError());
+                return;
+            }
+            memory_stats.surface_bytes += (size_t)this->image->h * this->image->pitch;
+            this->width = this->image->w;
+            this->height = this->image->h;
+            tiles_x = (this->width + tile_size - 1) / tile_size;
+            tiles_y = (this->height + tile_size - 1) / tile_size;
+            _internal_image_tile_t empty = {NULL, 0, 0};
+            tiles.assign((size_t)tiles_x * tiles_y, empty);
+        }
+
+        SDL_Texture* _GetTile(int tx, int ty)
+        {
+            _internal_image_tile_t& tile = tiles[(size_t)ty * tiles_x + tx];
+            tile.last_used = ++texture_clock;
+            tile.drawn_frame = presented_frames;
+            if(tile.texture != NULL)
+                return tile.texture;
+
+            TRACE_ZONE("Tile upload");
+            while(resident >= max_tiles)
+            {
+                size_t oldest = tiles.size();
+                for(size_t i = 0; i < tiles.size(); i++)
+                {
+                    if(tiles[i].texture != NULL && tiles[i].drawn_frame != presented_frames &&
+                       (oldest == tiles.size() || tiles[i].last_used < tiles[oldest].last_used))
+                        oldest = i;
+                }
+                if(oldest == tiles.size())
+                {
+                    // Everything resident is on screen this frame, so going over beats thrashing.
+                    memory_stats.tiles_over_budget++;
+                    break;
+                }
+                _DestroyTile(oldest);
+                memory_stats.textures_evicted++;
+            }
+            int w = _TileWidth(tx), h = _TileHeight(ty);
+            tile.texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, w, h);
+            if(tile.texture == NULL)
+            {
+                ERROR_OUT("Could not create tile texture: %s\n", SDL_GetError());
+                return NULL;
+            }
+            const uint8_t* pixels = (const uint8_t*)this->image->pixels + (size_t)ty * tile_size * this->image->pitch + (size_t)tx * tile_size * 4;
+            SDL_UpdateTexture(tile.texture, NULL, pixels, this->image->pitch);
+            SDL_SetTextureBlendMode(tile.texture, SDL_BLENDMODE_BLEND);
+            SDL_SetTextureColorMod(tile.texture, colour_mod.r, colour_mod.g, colour_mod.b);
+            memory_stats.texture_bytes += (size_t)w * h * 4;
+            resident++;
+            return tile.texture;
+        }
+
+        int _TileWidth(int tx) { return min(tile_size, this->width - tx * tile_size); }
+        int _TileHeight(int ty) { return min(tile_size, this->height - ty * tile_size); }
+
+        void _DestroyTile(size_t i)
+        {
+            if(tiles[i].texture == NULL)
+                return;
+            SDL_DestroyTexture(tiles[i].texture);
+            tiles[i].texture = NULL;
+            memory_stats.texture_bytes -= (size_t)_TileWidth(i % tiles_x) * _TileHeight(i / tiles_x) * 4;
+            resident--;
+        }
+    };
+
+    // Playback position of one animated instance. Kept apart from the Sprite so thousands of
+    // units can share a sheet and its clips; step them all with Sprite::AdvanceAll().
+    typedef struct
+    {
+        int clip = -1;
+        int step = 0;
+        float time = 0.0f;
+        float speed = 1.0f;
+        int frame = 0;
+        bool finished = false;
+    } AnimationState;
+
+    typedef struct
+    {
+        string name;
+        int first;
+        int length;
+        bool loop;
+    } _internal_clip_t;
+
+    class Sprite
+    {
+        public:
+        Image* im;
+        int sheet_width, sheet_height;
+        int sprite_width, sprite_height;
+        int total_frames;
+        float current_frame = 0.0f;
+        vector<CollisionMask*> masks;
+        // Source rectangle of every frame on the sheet.
+        vector<SDL_Rect> frame_rects;
+
+        Sprite(string filename, int vert_lines, int horiz_lines)
+        {
+            CreateSprite(new Image(filename), vert_lines, horiz_lines);
+        }
+
+        Sprite(Image* im, int vert_lines, int horiz_lines)
+        {
+            CreateSprite(im, vert_lines, horiz_lines);
+        }
+
+        void CreateSprite(Image* img, int vert_lines, int horiz_lines)
+        {
+            this->im = img;
+            this->sheet_width = img->width;
+            this->sheet_height = img->height;
+            this->sprite_width = img->width / vert_lines;
+            this->sprite_height = img->height / horiz_lines;
+            this->total_frames = img->width * img->height / (this->sprite_width * this->sprite_height);
+
+            int columns = sheet_width / sprite_width;
+            frame_rects.resize(total_frames);
+            for(int frame = 0; frame < total_frames; frame++)
+            {
+                frame_rects[frame].x = sprite_width * (frame % columns);
+                frame_rects[frame].y = sprite_height * (frame / columns);
+                frame_rects[frame].w = sprite_width;
+                frame_rects[frame].h = sprite_height;
+            }
+        }
+
+        // Adds a clip playing frames[i] for durations[i] seconds each and returns its index.
+        int AddClip(const string& name, const vector<int>& frames, const vector<float>& durations, bool loop = true)
+        {
+            if(frames.empty() || frames.size() != durations.size())
+            {
+                ERROR_OUT("AddClip() needs one duration per frame!\n");
+                return -1;
+            }
+            for(unsigned int i = 0; i < frames.size(); i++)
+            {
+                if(frames[i] < 0 || frames[i] >= total_frames)
+                {
+                    ERROR_OUT("AddClip() given frame %d of a %d frame sprite!\n", frames[i], total_frames);
+                    return -1;
+                }
+            }
+            _internal_clip_t clip = {name, (int)clip_frames.size(), (int)frames.size(), loop};
+            for(unsigned int i = 0; i < frames.size(); i++)
+            {
+                clip_frames.push_back(frames[i]);
+                clip_durations.push_back(max(durations[i], 0.0001f));
+            }
+            clips.push_back(clip);
+            return (int)clips.size() - 1;
+        }
+
+        // Clip of count consecutive frames from first, each shown for frame_duration seconds.
+        int AddClip(const string& name, int first, int count, float frame_duration, bool loop = true)
+        {
+            vector<int> frames;
+            for(int i = 0; i < count; i++)
+                frames.push_back(first + i);
+            return AddClip(name, frames, vector<float>(frames.size(), frame_duration), loop);
+        }
+
+        int GetClip(const string& name)
+        {
+            for(unsigned int i = 0; i < clips.size(); i++)
+                if(clips[i].name == name)
+                    return i;
+            return -1;
+        }
+
+        // Starts clip on state. Playing the clip already running carries on unless restart is set.
+        void Play(AnimationState& state, int clip, bool restart = false, float speed = 1.0f)
+        {
+            state.speed = speed;
+            if(clip < 0 || clip >= (int)clips.size())
+            {
+                ERROR_OUT("Play() called with an unknown clip!\n");
+                return;
+            }
+            if(!restart && state.clip == clip)
+                return;
+            state.clip = clip;
+            state.step = 0;
+            state.time = 0.0f;
+            state.finished = false;
+            state.frame = clip_frames[clips[clip].first];
+        }
+
+        void Play(AnimationState& state, const string& name, bool restart = false, float speed = 1.0f)
+        {
+            Play(state, GetClip(name), restart, speed);
+        }
+
+        // Steps every state by elapsed seconds (times each state's speed) in one pass.
+        void AdvanceAll(AnimationState* states, int count, float elapsed)
+        {
+            const _internal_clip_t* clip_data = clips.data();
+            const int* frames = clip_frames.data();
+            const float* durations = clip_durations.data();
+            int clip_count = (int)clips.size();
+            for(int i = 0; i < count; i++)
+            {
+                AnimationState& s = states[i];
+                if(s.finished || s.clip < 0 || s.clip >= clip_count)
+                    continue;
+                const _internal_clip_t& clip = clip_data[s.clip];
+                const float* d = durations + clip.first;
+                s.time += elapsed * s.speed;
+                while(s.time >= d[s.step])
+                {
+                    s.time -= d[s.step];
+                    if(++s.step == clip.length)
+                    {
+                        if(!clip.loop)
+                        {
+                            s.step = clip.length - 1;
+                            s.time = 0.0f;
+                            s.finished = true;
+                            break;
+                        }
+                        s.step = 0;
+                    }
+                }
+                s.frame = frames[clip.first + s.step];
+            }
+        }
+
+        void AdvanceAll(vector<AnimationState>& states, float elapsed)
+        {
+            AdvanceAll(states.data(), (int)states.size(), elapsed);
+        }
+
+        void DrawSprite(const AnimationState& state, int x, int y, float angle = 0.0f, int pivotx = 0, int pivoty = 0, float scale = 1.0f, bool h_flip = false, bool v_flip = false)
+        {
+            DrawSprite(state.frame, x, y, angle, pivotx, pivoty, scale, h_flip, v_flip);
+        }
+
+        void IncrementFrame(float increment)
+        {
+            this->current_frame += increment;
+            if(this->current_frame >= this->total_frames)
+                this->current_frame = 0;
+        }
+
+        void DrawSprite(int frame, int x, int y, float angle = 0.0f, int pivotx = 0, int pivoty = 0, float scale = 1.0f, bool h_flip = false, bool v_flip = false)
+        {
+            if(frame == -1)
+            {
+                frame = this->current_frame;
+            }
+            if(frame < 0 || frame >= total_frames)
+            {
+                ERROR_OUT("DrawSprite() called with frame %d of a %d frame sprite!\n", frame, total_frames);
+                return;
+            }
+            const SDL_Rect& src = frame_rects[frame];
+            this->im->DrawImage(x, y, src.x, src.y, sprite_width, sprite_height, angle, pivotx, pivoty, scale, h_flip, v_flip);
+        }
+
+        void GetPixel(int frame, int x, int y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+        {
+            if(frame < 0 || frame >= total_frames)
+            {
+                ERROR_OUT("GetPixel() called with frame %d of a %d frame sprite!\n", frame, total_frames);
+                return;
+            }
+            const SDL_Rect& src = frame_rects[frame];
+            this->im->GetPixel(src.x + x, src.y + y, r, g, b, a);
+        }
+
+        // One mask per frame, cut from the sheet. Rebuild after changing the sheet's transparent colour.
+        void BuildCollisionMasks(uint8_t alpha_threshold = 1)
+        {
+            ClearCollisionMasks();
+            for(int frame = 0; frame < total_frames; frame++)
+            {
+                const SDL_Rect& src = frame_rects[frame];
+                masks.push_back(new CollisionMask(this->im->GetSurface(), src.x, src.y, sprite_width, sprite_height, alpha_threshold));
+            }
+        }
+
+        bool Collides(int frame, int x, int y, Sprite* other, int other_frame, int ox, int oy, bool h_flip = false, bool v_flip = false, bool other_h_flip = false, bool other_v_flip = false)
+        {
+            if(frame == -1)
+                frame = this->current_frame;
+            if(other_frame == -1)
+                other_frame = other->current_frame;
+            if(frame < 0 || frame >= (int)this->masks.size() || other_frame < 0 || other_frame >= (int)other->masks.size())
+            {
+                ERROR_OUT("Collides() called on a sprite frame without a collision mask!\n");
+                return false;
+            }
+            return CollisionMask::Overlaps(this->masks[frame], x, y, other->masks[other_frame], ox, oy, h_flip, v_flip, other_h_flip, other_v_flip);
+        }
+
+        void ClearCollisionMasks()
+        {
+            for(unsigned int i = 0; i < masks.size(); i++)
+                delete masks[i];
+            masks.clear();
+        }
+
+        ~Sprite()
+        {
+            ClearCollisionMasks();
+        }
+
+        private:
+        // Clips index into the flat frame and duration arrays so AdvanceAll() stays linear.
+        vector<_internal_clip_t> clips;
+        vector<int> clip_frames;
+        vector<float> clip_durations;
+    };
+
+    class BitmapFont
+    {
+        public:
+        Image* im;
+        int character_width, character_height;
+        int fontsheet_width, fontsheet_height;
+        int characters_per_line;
+
+        private:
+        bool is_own_image = false;
+        // Top left texture coordinate of every character, plus the glyph size at the end.
+        SDL_FPoint glyph_uv[257];
+        SDL_Color colour = {255, 255, 255, 255};
+        vector<SDL_Vertex> mesh;
+        vector<SDL_Vertex> screen_mesh;
+
+        public:
+        BitmapFont(string s, int ch_w, int ch_h, uint8_t r = 0, uint8_t g = 0, uint8_t b = 0, uint8_t a = 0)
+        {
+            Image* im = new Image(s);
+            is_own_image = true;
+            CreateBitmapFont(im, ch_w, ch_h, r, g, b, a);
+        }
+
+        BitmapFont(Image* im, int ch_w, int ch_h, uint8_t r = 0, uint8_t g = 0, uint8_t b = 0, uint8_t a = 0)
+        {
+            CreateBitmapFont(im, ch_w, ch_h, r, g, b, a);
+        }
+
+        void CreateBitmapFont(Image* im, int ch_w, int ch_h, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            character_width = ch_w;
+            character_height = ch_h;
+            fontsheet_width = im->width;
+            fontsheet_height = im->height;
+            characters_per_line = fontsheet_width / character_width;
+            this->im = im;
+            this->im->TransparentColour(true, r, g, b, a);
+
+            float iw = 1.0f / fontsheet_width, ih = 1.0f / fontsheet_height;
+            for(int c = 0; c < 256; c++)
+            {
+                glyph_uv[c].x = character_width * (c % characters_per_line) * iw;
+                glyph_uv[c].y = character_height * (c / characters_per_line) * ih;
+            }
+            glyph_uv[256].x = character_width * iw;
+            glyph_uv[256].y = character_height * ih;
+        }
+
+        void DrawChar(unsigned char s, int x, int y, float scale = 1)
+        {
+            int fx = character_width * (s % characters_per_line);
+            int fy = character_height * (s / characters_per_line);
+
+            this->im->DrawImage(x, y, fx, fy, character_width, character_height, 0, 0, 0, scale, false, false);
+        }
+
+        void Colourise(uint8_t r, uint8_t g, uint8_t b)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, r, g, b]() { Colourise(r, g, b); });
+                return;
+            }
+            this->im->Colourise(r, g, b);
+            colour.r = r;
+            colour.g = g;
+            colour.b = b;
+        }
+
+        SDL_Color GetColour() { return colour; }
+
+        // The whole string goes to SDL as one textured mesh.
+        void DrawString(const char* s, int x, int y, int scale = 1)
+        {
+            ALLOCATION_TAG("BitmapFont::DrawString");
+            DrawText(s, x, y, scale);
+        }
+
+        void DrawText(const char* s, int x, int y, float scale)
+        {
+            if(recording_buffer != NULL)
+            {
+                _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::TEXT);
+                c.object = this;
+                c.v[0] = x; c.v[1] = y;
+                c.f[0] = scale;
+                c.data = recording_buffer->text.size();
+                recording_buffer->text.insert(recording_buffer->text.end(), s, s + strlen(s) + 1);
+                return;
+            }
+            int w, h;
+            LayoutString(s, scale, mesh, &w, &h);
+            DrawMesh(mesh, x, y, w, h, screen_mesh);
+        }
+
+        void printf(int x, int y, int scale, const char* fmt, ...)
+        {
+            ALLOCATION_TAG("BitmapFont::printf");
+            va_list args;
+            va_start(args, fmt);
+            const char* text = _Format(fmt, args);
+            va_end(args);
+            DrawString(text, x, y, scale);
+        }
+
+        // Builds the quads for s with its top left corner at (0, 0) and reports the size of
+        // the laid out text. Newlines, carriage returns and tabs act as in a terminal.
+        void LayoutString(const char* s, float scale, vector<SDL_Vertex>& out, int* width, int* height)
+        {
+            out.clear();
+            float cw = character_width * scale, ch = character_height * scale;
+            float x_now = 0.0f, y_now = 0.0f, right = 0.0f;
+            bool any = false;
+            for(const char* p = s; *p != '\0'; p++)
+            {
+                unsigned char c = (unsigned char)*p;
+                if(c == '\n')
+                {
+                    x_now = 0.0f;
+                    y_now += ch;
+                }
+                else if(c == '\r')
+                {
+                    x_now = 0.0f;
+                }
+                else if(c == '\t')
+                {
+                    x_now += 4 * cw;
+                }
+                else
+                {
+                    SDL_FPoint uv = glyph_uv[c], size = glyph_uv[256];
+                    size_t v = out.size();
+                    out.resize(v + 4);
+                    SDL_Vertex* q = &out[v];
+                    q[0].position.x = x_now; q[0].position.y = y_now;
+                    q[1].position.x = x_now + cw; q[1].position.y = y_now;
+                    q[2].position.x = x_now + cw; q[2].position.y = y_now + ch;
+                    q[3].position.x = x_now; q[3].position.y = y_now + ch;
+                    q[0].tex_coord.x = uv.x; q[0].tex_coord.y = uv.y;
+                    q[1].tex_coord.x = uv.x + size.x; q[1].tex_coord.y = uv.y;
+                    q[2].tex_coord.x = uv.x + size.x; q[2].tex_coord.y = uv.y + size.y;
+                    q[3].tex_coord.x = uv.x; q[3].tex_coord.y = uv.y + size.y;
+                    q[0].color = colour; q[1].color = colour; q[2].color = colour; q[3].color = colour;
+                    x_now += cw;
+                    right = max(right, x_now);
+                    any = true;
+                }
+            }
+            *width = (int)ceil(right);
+            *height = any ? (int)ceil(y_now + ch) : 0;
+        }
+
+        // Draws a mesh from LayoutString() with its top left corner at (x, y), after culling
+        // the w x h box it covers. The camera-transformed copy is written to screen.
+        void DrawMesh(const vector<SDL_Vertex>& local, int x, int y, int w, int h, vector<SDL_Vertex>& screen)
+        {
+            if(local.empty())
+                return;
+            Transform2D t = Transform2D::Translation(x, y);
+            if(_ActiveCamera() != NULL)
+                t = _ActiveCamera()->GetTransform() * t;
+            Vector2 c[4] = {t.Apply(Vector2(0.0f, 0.0f)), t.Apply(Vector2(w, 0.0f)), t.Apply(Vector2(0.0f, h)), t.Apply(Vector2(w, h))};
+            float x0 = c[0].x, y0 = c[0].y, x1 = c[0].x, y1 = c[0].y;
+            for(int i = 1; i < 4; i++)
+            {
+                x0 = min(x0, c[i].x); x1 = max(x1, c[i].x);
+                y0 = min(y0, c[i].y); y1 = max(y1, c[i].y);
+            }
+            if(_CullScreenBox(x0, y0, x1, y1))
+                return;
+
+            screen.resize(local.size());
+            for(size_t i = 0; i < local.size(); i++)
+            {
+                screen[i] = local[i];
+                screen[i].position.x = t.a * local[i].position.x + t.c * local[i].position.y + t.tx;
+                screen[i].position.y = t.b * local[i].position.x + t.d * local[i].position.y + t.ty;
+            }
+            // Texture coordinates are fractions of the sheet, so a mip level can stand in for it
+            // unchanged as long as every glyph cell falls on whole texels of that level.
+            float scale = (local[1].position.x - local[0].position.x) / character_width * _ScreenScale();
+            int level = this->im->_MipLevelForScale(scale);
+            while(level > 0 && ((character_width | character_height | fontsheet_width | fontsheet_height) & ((1 << level) - 1)) != 0)
+                level--;
+            int quads = (int)local.size() / 4;
+            SDL_RenderGeometry(window_renderer, this->im->_GetMipTexture(level), screen.data(), quads * 4, _QuadIndices(quads), quads * 6);
+        }
+
+        // Formats into the calling thread's frame arena.
+        const char* _Format(const char* fmt, va_list args)
+        {
+            return GetFrameArena().Format(fmt, args);
+        }
+
+        ~BitmapFont()
+        {
+            if(is_own_image)
+                delete this->im;
+        }
+    };
+
+    // Live allocation figures for the last frame, drawn with font at (x, y).
+    void DrawAllocationOverlay(BitmapFont* font, int x, int y, int scale = 1)
+    {
+        ALLOCATION_TAG("DrawAllocationOverlay");
+        if(!allocation_tracking)
+        {
+            font->printf(x, y, scale, "allocation tracking off");
+            return;
+        }
+        AllocationStats f = allocation_last_frame;
+        font->printf(x, y, scale, "allocs %llu (%llu SDL)  frees %llu  bytes %llu\nframes allocating %llu of %llu",
+                     (unsigned long long)f.allocations, (unsigned long long)f.sdl_allocations, (unsigned long long)f.frees,
+                     (unsigned long long)f.bytes, (unsigned long long)allocating_frames, (unsigned long long)allocation_frames);
+    }
+
+    // Text that keeps its glyph mesh between frames and lays it out again only when the
+    // text, scale or font colour changes. The screen copy is reused while it stays put.
+    class TextLabel
+    {
+        public:
+        TextLabel(BitmapFont* font, string text = "", float scale = 1.0f)
+        {
+            this->font = font;
+            this->text = text;
+            this->scale = scale;
+        }
+
+        void SetText(const string& text)
+        {
+            if(text == this->text)
+                return;
+            this->text = text;
+            dirty = true;
+        }
+
+        const string& GetText() { return text; }
+
+        void printf(const char* fmt, ...)
+        {
+            va_list args;
+            va_start(args, fmt);
+            const char* formatted = font->_Format(fmt, args);
+            va_end(args);
+            if(text.compare(formatted) != 0)
+            {
+                text.assign(formatted);
+                dirty = true;
+            }
+        }
+
+        void SetScale(float scale)
+        {
+            if(scale == this->scale)
+                return;
+            this->scale = scale;
+            dirty = true;
+        }
+
+        int GetWidth() { _Layout(); return width; }
+        int GetHeight() { _Layout(); return height; }
+
+        void Draw(int x, int y)
+        {
+            if(recording_buffer != NULL)
+            {
+                // The cached mesh belongs to the thread that lays it out, so record plain text.
+                font->DrawText(text.c_str(), x, y, scale);
+                return;
+            }
+            _Layout();
+            if(mesh.empty())
+                return;
+            // Unmoved and uncamera'd since the last draw: the previous screen mesh still holds.
+            if(!screen_mesh.empty() && _ActiveCamera() == NULL && x == last_x && y == last_y && !moved_by_camera)
+            {
+                if(_CullScreenBox(x, y, x + width, y + height))
+                    return;
+                int quads = (int)screen_mesh.size() / 4;
+                SDL_RenderGeometry(window_renderer, font->im->GetTexture(), screen_mesh.data(), quads * 4, _QuadIndices(quads), quads * 6);
+                return;
+            }
+            screen_mesh.clear();
+            font->DrawMesh(mesh, x, y, width, height, screen_mesh);
+            last_x = x;
+            last_y = y;
+            moved_by_camera = (_ActiveCamera() != NULL);
+        }
+
+        private:
+        BitmapFont* font;
+        string text;
+        float scale;
+        bool dirty = true;
+        SDL_Color built_colour = {0, 0, 0, 0};
+        int width = 0, height = 0;
+        int last_x = 0, last_y = 0;
+        bool moved_by_camera = false;
+        vector<SDL_Vertex> mesh;
+        vector<SDL_Vertex> screen_mesh;
+
+        void _Layout()
+        {
+            SDL_Color c = font->GetColour();
+            if(!dirty && c.r == built_colour.r && c.g == built_colour.g && c.b == built_colour.b)
+                return;
+            font->LayoutString(text.c_str(), scale, mesh, &width, &height);
+            built_colour = c;
+            dirty = false;
+            screen_mesh.clear();
+        }
+    };
+
+    class PixelBlock
+    {
+        public:
+        uint8_t* pixels;
+        int width, height;
+        bool blend;
+        int pixel_array_size;
+
+        PixelBlock(int w, int h)
+        {
+            this->pixels = (uint8_t*)SDL_calloc(w * h * sizeof(uint32_t), sizeof(uint8_t));
+            this->width = w;
+            this->height = h;
+            this->pixel_array_size = w * h * sizeof(uint32_t);
+            memory_stats.pixel_block_bytes += pixel_array_size;
+        }
+
+        ~PixelBlock()
+        {
+            if(this->texture != NULL)
+            {
+                SDL_DestroyTexture(this->texture);
+                memory_stats.pixel_block_bytes -= pixel_array_size;
+            }
+            memory_stats.pixel_block_bytes -= pixel_array_size;
+            SDL_free(this->pixels);
+        }
+
+        void DrawPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            int pos = (y * sizeof(uint32_t) * width) + x * sizeof(uint32_t);
+            if(pos < pixel_array_size-3 && pos > 0)
+            {
+                pixels[pos] = r;
+                pixels[pos+1] = g;
+                pixels[pos+2] = b;
+                pixels[pos+3] = a;
+            }
+        }
+
+        void GetPixel(int x, int y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+        {
+            int pos = (y * 4 * width) + x * 4;
+            if(pos < pixel_array_size)
+            {
+                *r = pixels[pos];
+                *g = pixels[pos+1];
+                *b = pixels[pos+2];
+                *a = pixels[pos+3];
+            }
+        }
+
+        // While recording, the read happens when the buffer is replayed.
+        void Read(int x, int y)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, x, y]() { Read(x, y); });
+                return;
+            }
+            SDL_Rect rect;
+            rect.x = x;
+            rect.y = y;
+            rect.w = this->width;
+            rect.h = this->height;
+            SDL_RenderReadPixels(window_renderer, &rect, SDL_PIXELFORMAT_RGBA32, (void*)this->pixels, this->width * sizeof(uint32_t));
+        }
+
+        void Write(int x, int y, float scale=1.0f)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, x, y, scale]() { Write(x, y, scale); });
+                return;
+            }
+            TRACE_ZONE("PixelBlock::Write");
+            _internal_screen_quad_t q;
+            if(!_PlaceTexture(x, y, this->width * scale, this->height * scale, 0.0, 0, 0, &q))
+                return;
+            // One streaming texture per block, refilled from the pixels on every write.
+            if(this->texture == NULL)
+            {
+                this->texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, this->width, this->height);
+                if(this->texture == NULL)
+                {
+                    ERROR_OUT("Unable to create pixel block texture!\nMessage: %s\n", SDL_GetError());
+                    return;
+                }
+                memory_stats.pixel_block_bytes += pixel_array_size;
+                SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND);
+            }
+            SDL_UpdateTexture(this->texture, NULL, this->pixels, this->width * sizeof(uint32_t));
+            if(blend)
+                SDL_SetRenderDrawBlendMode(window_renderer, SDL_BLENDMODE_BLEND);
+            SDL_RenderCopyExF(window_renderer, this->texture, NULL, &q.dest, q.angle, &q.pivot, SDL_FLIP_NONE);
+        }
+
+        private:
+        SDL_Texture* texture = NULL;
+    };
+
+    typedef struct
+    {
+        char magic[8];
+        int64_t width, height;
+        int32_t tile_size;
+        uint32_t fill;
+    } _internal_sparse_header_t;
+
+    // A PixelBlock for canvases far larger than memory, such as a whole world's fog of war.
+    // Pixels live in tiles of TILE_SIZE x TILE_SIZE that are only allocated on their first
+    // write; the rest read as the fill colour, so memory follows the painted area. Read() and
+    // Write() move a view_width x view_height window of it to and from the screen.
+    //
+    // With a backing file the tiles are mapped from it instead of allocated, and are there
+    // again when the same file is opened with the same size and fill. The file is sparse where
+    // nothing was painted. Without mmap support the file is ignored.
+    class SparsePixelBlock
+    {
+        public:
+        static const int TILE_SIZE = 256;
+        int64_t width, height;
+        int view_width, view_height;
+        bool blend;
+
+        SparsePixelBlock(int64_t w, int64_t h, int view_w, int view_h, uint8_t r = 0, uint8_t g = 0, uint8_t b = 0, uint8_t a = 0, string backing_file = "")
+        {
+            this->width = max(w, (int64_t)0);
+            this->height = max(h, (int64_t)0);
+            this->view_width = view_w;
+            this->view_height = view_h;
+            uint8_t c[4] = {r, g, b, a};
+            memcpy(&fill, c, sizeof(fill));
+            tiles_x = (this->width + TILE_SIZE - 1) / TILE_SIZE;
+            tiles_y = (this->height + TILE_SIZE - 1) / TILE_SIZE;
+            tiles.assign((size_t)(tiles_x * tiles_y), NULL);
+            view.assign((size_t)view_w * view_h, 0);
+            memory_stats.pixel_block_bytes += view.size() * sizeof(uint32_t) + tiles.size() * sizeof(uint32_t*);
+            if(!backing_file.empty())
+                _Map(backing_file);
+        }
+
+        ~SparsePixelBlock()
+        {
+            if(this->texture != NULL)
+            {
+                SDL_DestroyTexture(this->texture);
+                memory_stats.pixel_block_bytes -= view.size() * sizeof(uint32_t);
+            }
+            memory_stats.pixel_block_bytes -= view.size() * sizeof(uint32_t) + tiles.size() * sizeof(uint32_t*) + allocated * TILE_BYTES;
+            #ifdef ENGINE2D_MMAP
+            if(mapping != NULL)
+            {
+                munmap(mapping, mapping_size);
+                close(file);
+                return;
+            }
+            #endif
+            for(size_t i = 0; i < tiles.size(); i++)
+                SDL_free(tiles[i]);
+        }
+
+        void DrawPixel(int64_t x, int64_t y, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            if(x < 0 || y < 0 || x >= width || y >= height)
+                return;
+            uint8_t c[4] = {r, g, b, a};
+            uint32_t colour;
+            memcpy(&colour, c, sizeof(colour));
+            int64_t index = (y / TILE_SIZE) * tiles_x + x / TILE_SIZE;
+            // Painting the fill colour over an untouched tile changes nothing.
+            if(tiles[index] == NULL && colour == fill)
+                return;
+            _Tile(index)[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE] = colour;
+        }
+
+        void GetPixel(int64_t x, int64_t y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+        {
+            uint32_t colour = fill;
+            if(x >= 0 && y >= 0 && x < width && y < height)
+            {
+                const uint32_t* tile = tiles[(y / TILE_SIZE) * tiles_x + x / TILE_SIZE];
+                if(tile != NULL)
+                    colour = tile[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE];
+            }
+            const uint8_t* c = (const uint8_t*)&colour;
+            *r = c[0];
+            *g = c[1];
+            *b = c[2];
+            *a = c[3];
+        }
+
+        // Copies the screen rectangle at (x, y) into the view whose top left corner is at
+        // (view_x, view_y) in the block. While recording, the read happens on replay.
+        void Read(int64_t view_x, int64_t view_y, int x, int y)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, view_x, view_y, x, y]() { Read(view_x, view_y, x, y); });
+                return;
+            }
+            SDL_Rect rect = {x, y, view_width, view_height};
+            SDL_RenderReadPixels(window_renderer, &rect, SDL_PIXELFORMAT_RGBA32, (void*)view.data(), view_width * sizeof(uint32_t));
+            _CopyView(view_x, view_y, true);
+        }
+
+        // Draws the view whose top left corner is at (view_x, view_y) in the block at (x, y).
+        // Parts of the view outside the block are transparent.
+        void Write(int64_t view_x, int64_t view_y, int x, int y, float scale=1.0f)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, view_x, view_y, x, y, scale]() { Write(view_x, view_y, x, y, scale); });
+                return;
+            }
+            TRACE_ZONE("SparsePixelBlock::Write");
+            _internal_screen_quad_t q;
+            if(!_PlaceTexture(x, y, view_width * scale, view_height * scale, 0.0, 0, 0, &q))
+                return;
+            if(this->texture == NULL)
+            {
+                this->texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, view_width, view_height);
+                if(this->texture == NULL)
+                {
+                    ERROR_OUT("Unable to create pixel block texture!\nMessage: %s\n", SDL_GetError());
+                    return;
+                }
+                memory_stats.pixel_block_bytes += view.size() * sizeof(uint32_t);
+                SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND);
+            }
+            _CopyView(view_x, view_y, false);
+            SDL_UpdateTexture(this->texture, NULL, view.data(), view_width * sizeof(uint32_t));
+            if(blend)
+                SDL_SetRenderDrawBlendMode(window_renderer, SDL_BLENDMODE_BLEND);
+            SDL_RenderCopyExF(window_renderer, this->texture, NULL, &q.dest, q.angle, &q.pivot, SDL_FLIP_NONE);
+        }
+
+        int64_t GetAllocatedTiles() { return allocated; }
+        size_t GetAllocatedBytes() { return (size_t)allocated * TILE_BYTES; }
+
+        // Writes mapped tiles back to the backing file.
+        void Flush()
+        {
+            #ifdef ENGINE2D_MMAP
+            if(mapping != NULL)
+                msync(mapping, mapping_size, MS_SYNC);
+            #endif
+        }
+
+        private:
+        static const size_t TILE_BYTES = (size_t)TILE_SIZE * TILE_SIZE * sizeof(uint32_t);
+        uint32_t fill;
+        int64_t tiles_x, tiles_y;
+        vector<uint32_t*> tiles;
+        int64_t allocated = 0;
+        vector<uint32_t> view;
+        SDL_Texture* texture = NULL;
+        // Backing file: the header, one byte per tile telling whether it was written, then
+        // the tiles, page aligned.
+        uint8_t* mapping = NULL;
+        size_t mapping_size = 0;
+        size_t tile_data_offset = 0;
+        int file = -1;
+
+        uint32_t* _Tile(int64_t index)
+        {
+            if(tiles[index] != NULL)
+                return tiles[index];
+            uint32_t* tile;
+            if(mapping != NULL)
+            {
+                tile = (uint32_t*)(mapping + tile_data_offset + (size_t)index * TILE_BYTES);
+                mapping[sizeof(_internal_sparse_header_t) + index] = 1;
+            }
+            else
+            {
+                tile = (uint32_t*)SDL_malloc(TILE_BYTES);
+                if(tile == NULL)
+                {
+                    ERROR_OUT("Out of memory for a pixel block tile!\n");
+                    abort();
+                }
+            }
+            fill_n(tile, (size_t)TILE_SIZE * TILE_SIZE, fill);
+            tiles[index] = tile;
+            allocated++;
+            memory_stats.pixel_block_bytes += TILE_BYTES;
+            return tile;
+        }
+
+        // Moves the view at (view_x, view_y) into the tiles (store) or out of them. Stored
+        // rows that are all fill colour do not allocate their tile.
+        void _CopyView(int64_t view_x, int64_t view_y, bool store)
+        {
+            for(int y = 0; y < view_height; y++)
+            {
+                uint32_t* row = &view[(size_t)y * view_width];
+                int64_t by = view_y + y;
+                if(by < 0 || by >= height)
+                {
+                    if(!store)
+                        fill_n(row, view_width, 0u);
+                    continue;
+                }
+                int x = 0;
+                while(x < view_width)
+                {
+                    int64_t bx = view_x + x;
+                    if(bx < 0 || bx >= width)
+                    {
+                        // Outside the block up to its left edge, or to the end of the row.
+                        int n = (bx < 0) ? (int)min((int64_t)(view_width - x), -bx) : view_width - x;
+                        if(!store)
+                            fill_n(row + x, n, 0u);
+                        x += n;
+                        continue;
+                    }
+                    int64_t index = (by / TILE_SIZE) * tiles_x + bx / TILE_SIZE;
+                    int n = (int)min((int64_t)(view_width - x), min((int64_t)TILE_SIZE - bx % TILE_SIZE, width - bx));
+                    size_t offset = (size_t)(by % TILE_SIZE) * TILE_SIZE + bx % TILE_SIZE;
+                    if(store)
+                    {
+                        if(tiles[index] != NULL || find_if(row + x, row + x + n, [this](uint32_t c) { return c != fill; }) != row + x + n)
+                            memcpy(_Tile(index) + offset, row + x, n * sizeof(uint32_t));
+                    }
+                    else if(tiles[index] != NULL)
+                        memcpy(row + x, tiles[index] + offset, n * sizeof(uint32_t));
+                    else
+                        fill_n(row + x, n, fill);
+                    x += n;
+                }
+            }
+        }
+
+        void _Map(const string& filename)
+        {
+            #ifdef ENGINE2D_MMAP
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            tile_data_offset = (sizeof(_internal_sparse_header_t) + tiles.size() + page - 1) / page * page;
+            uint64_t size = tile_data_offset + (uint64_t)tiles.size() * TILE_BYTES;
+            if(size > (uint64_t)SIZE_MAX)
+            {
+                ERROR_OUT("Pixel block too large to map on this system: %s\n", filename.c_str());
+                return;
+            }
+            file = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+            if(file < 0)
+            {
+                ERROR_OUT("Could not open pixel block file: %s\n", filename.c_str());
+                return;
+            }
+            _internal_sparse_header_t header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "E2DPIXB", 8);
+            header.width = width;
+            header.height = height;
+            header.tile_size = TILE_SIZE;
+            header.fill = fill;
+
+            // Anything but a file written for this exact block starts over, empty.
+            _internal_sparse_header_t existing;
+            struct stat info;
+            bool reuse = fstat(file, &info) == 0 && (uint64_t)info.st_size == size && pread(file, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) && memcmp(&existing, &header, sizeof(header)) == 0;
+            if(!reuse && (ftruncate(file, 0) != 0 || ftruncate(file, (off_t)size) != 0))
+            {
+                ERROR_OUT("Could not size pixel block file: %s\n", filename.c_str());
+                close(file);
+                file = -1;
+                return;
+            }
+            void* p = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            if(p == MAP_FAILED)
+            {
+                ERROR_OUT("Could not map pixel block file: %s\n", filename.c_str());
+                close(file);
+                file = -1;
+                return;
+            }
+            mapping = (uint8_t*)p;
+            mapping_size = (size_t)size;
+            memcpy(mapping, &header, sizeof(header));
+            const uint8_t* written = mapping + sizeof(_internal_sparse_header_t);
+            for(size_t i = 0; i < tiles.size(); i++)
+            {
+                if(written[i] != 0)
+                {
+                    tiles[i] = (uint32_t*)(mapping + tile_data_offset + i * TILE_BYTES);
+                    allocated++;
+                    memory_stats.pixel_block_bytes += TILE_BYTES;
+                }
+            }
+            #else
+            ERROR_OUT("Pixel block files are not supported on this platform: %s\n", filename.c_str());
+            #endif
+        }
+    };
+
+    // The frames of a sprite sheet as packed RGBA32 texels, each frame stored column by
+    // column so a wall or billboard stripe is one contiguous run.
+    typedef struct
+    {
+        vector<uint32_t> texels;
+        int frame_width, frame_height;
+        int frames;
+    } _internal_texel_sheet_t;
+
+    typedef struct
+    {
+        Sprite* sheet;
+        int frame;
+        float x, y;
+        // Filled in by Render(): distance along the view and screen placement.
+        float depth;
+        int screen_x, size;
+    } RaycastBillboard;
+
+    // Wolfenstein style renderer for a grid map, drawn into a PixelBlock on the CPU. Cell
+    // values above 0 are walls showing that frame - 1 of the wall sheet. Floors and ceilings
+    // come from the flat sheet, or are plain colours without one. Billboards are drawn
+    // behind walls using the depth of each column. Columns are split across the workers
+    // started with StartWorkers().
+    class Raycaster
+    {
+        public:
+        int map_width, map_height;
+        float camera_x = 1.5f, camera_y = 1.5f, camera_angle = 0.0f;
+        float fov = 66.0f;
+        int floor_frame = -1, ceiling_frame = -1;
+        // Packed like the PixelBlock pixels: r, g, b, a bytes.
+        uint32_t floor_colour, ceiling_colour;
+        vector<RaycastBillboard> billboards;
+
+        Raycaster(int map_w, int map_h, Sprite* walls, Sprite* flats = NULL)
+        {
+            this->map_width = map_w;
+            this->map_height = map_h;
+            cells.assign((size_t)map_w * map_h, 0);
+            _LoadSheet(walls, &wall_texels);
+            if(flats != NULL)
+                _LoadSheet(flats, &flat_texels);
+            uint8_t opaque[4] = {0, 0, 0, 255};
+            memcpy(&alpha_mask, opaque, sizeof(alpha_mask));
+            floor_colour = _Pack(64, 64, 64, 255);
+            ceiling_colour = _Pack(32, 32, 48, 255);
+        }
+
+        void SetCell(int x, int y, int wall)
+        {
+            if(x >= 0 && y >= 0 && x < map_width && y < map_height)
+                cells[(size_t)y * map_width + x] = wall;
+        }
+
+        int GetCell(int x, int y)
+        {
+            if(x < 0 || y < 0 || x >= map_width || y >= map_height)
+                return 1;
+            return cells[(size_t)y * map_width + x];
+        }
+
+        // True inside a wall or outside the map, for movement checks.
+        bool IsSolid(float x, float y) { return GetCell((int)floorf(x), (int)floorf(y)) != 0; }
+
+        // Degrees, 0 looking along +x, increasing towards +y.
+        void SetCamera(float x, float y, float angle)
+        {
+            camera_x = x;
+            camera_y = y;
+            camera_angle = angle;
+        }
+
+        void SetFlatColours(uint8_t floor_r, uint8_t floor_g, uint8_t floor_b, uint8_t ceiling_r, uint8_t ceiling_g, uint8_t ceiling_b)
+        {
+            floor_colour = _Pack(floor_r, floor_g, floor_b, 255);
+            ceiling_colour = _Pack(ceiling_r, ceiling_g, ceiling_b, 255);
+        }
+
+        // Billboards are only read from the sheet's image when added, like the walls.
+        int AddBillboard(Sprite* sheet, int frame, float x, float y)
+        {
+            size_t i = 0;
+            while(i < billboard_sheets.size() && billboard_sheets[i] != sheet)
+                i++;
+            if(i == billboard_sheets.size())
+            {
+                billboard_sheets.push_back(sheet);
+                billboard_texels.push_back(_internal_texel_sheet_t());
+                _LoadSheet(sheet, &billboard_texels.back());
+            }
+            RaycastBillboard b = {sheet, frame, x, y, 0.0f, 0, 0};
+            billboards.push_back(b);
+            return (int)billboards.size() - 1;
+        }
+
+        // Distance from (x, y) to the first wall along angle, or -1 past max_distance.
+        float CastRay(float x, float y, float angle, float max_distance = 64.0f, int* cell_x = NULL, int* cell_y = NULL)
+        {
+            float rad = angle * (_PI / 180.0f);
+            _internal_ray_hit_t hit = _Cast(x, y, cosf(rad), sinf(rad), (int)ceilf(max_distance) * 2 + 2);
+            if(hit.wall == 0 || hit.distance > max_distance)
+                return -1.0f;
+            if(cell_x != NULL)
+                *cell_x = hit.cell_x;
+            if(cell_y != NULL)
+                *cell_y = hit.cell_y;
+            return hit.distance;
+        }
+
+        void Render(PixelBlock* target, int columns_per_job = 16)
+        {
+            TRACE_ZONE("Raycaster::Render");
+            int w = target->width, h = target->height;
+            uint32_t* pixels = (uint32_t*)target->pixels;
+            depth.resize(w);
+            float rad = camera_angle * (_PI / 180.0f);
+            float plane_length = tanf(fov * (_PI / 360.0f));
+            dir_x = cosf(rad);
+            dir_y = sinf(rad);
+            plane_x = -dir_y * plane_length;
+            plane_y = dir_x * plane_length;
+
+            ParallelFor(w, columns_per_job, [this, pixels, w, h](int begin, int end)
+            {
+                for(int x = begin; x < end; x++)
+                    _RenderColumn(pixels, w, h, x);
+            });
+            _PlaceBillboards(w, h);
+            if(!sorted.empty())
+            {
+                ParallelFor(w, columns_per_job, [this, pixels, w, h](int begin, int end)
+                {
+                    for(int x = begin; x < end; x++)
+                        _RenderBillboardColumn(pixels, w, h, x);
+                });
+            }
+        }
+
+        private:
+        typedef struct
+        {
+            int wall;
+            int cell_x, cell_y;
+            bool y_side;
+            float distance;
+            float wall_u;     // Where along the wall face the ray hit, 0 to 1.
+        } _internal_ray_hit_t;
+
+        vector<int> cells;
+        _internal_texel_sheet_t wall_texels, flat_texels;
+        vector<Sprite*> billboard_sheets;
+        vector<_internal_texel_sheet_t> billboard_texels;
+        vector<float> depth;
+        vector<int> sorted;
+        vector<const _internal_texel_sheet_t*> sorted_texels;
+        uint32_t alpha_mask;
+        float dir_x, dir_y, plane_x, plane_y;
+
+        static uint32_t _Pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        {
+            uint8_t c[4] = {r, g, b, a};
+            uint32_t packed;
+            memcpy(&packed, c, sizeof(packed));
+            return packed;
+        }
+
+        void _LoadSheet(Sprite* sheet, _internal_texel_sheet_t* out)
+        {
+            out->frame_width = sheet->sprite_width;
+            out->frame_height = sheet->sprite_height;
+            out->frames = sheet->total_frames;
+            out->texels.assign((size_t)out->frame_width * out->frame_height * out->frames, 0);
+            SDL_Surface* surface = sheet->im->GetSurface();
+            SDL_Surface* rgba = (surface != NULL) ? SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0) : NULL;
+            if(rgba == NULL)
+            {
+                ERROR_OUT("Could not read sprite sheet texels!\nMessage: %s\n", SDL_GetError());
+                return;
+            }
+            for(int f = 0; f < out->frames; f++)
+            {
+                const SDL_Rect& r = sheet->frame_rects[f];
+                uint32_t* frame = &out->texels[(size_t)f * out->frame_width * out->frame_height];
+                for(int y = 0; y < r.h; y++)
+                {
+                    const uint32_t* row = (const uint32_t*)((const uint8_t*)rgba->pixels + (size_t)(r.y + y) * rgba->pitch) + r.x;
+                    for(int x = 0; x < r.w; x++)
+                        frame[(size_t)x * r.h + y] = row[x];
+                }
+            }
+            SDL_FreeSurface(rgba);
+        }
+
+        // Grid traversal (DDA) from (x, y) along (ray_x, ray_y), one cell boundary at a time.
+        _internal_ray_hit_t _Cast(float x, float y, float ray_x, float ray_y, int max_steps)
+        {
+            _internal_ray_hit_t hit = {0, (int)floorf(x), (int)floorf(y), false, 0.0f, 0.0f};
+            float delta_x = (ray_x == 0.0f) ? 1e30f : fabsf(1.0f / ray_x);
+            float delta_y = (ray_y == 0.0f) ? 1e30f : fabsf(1.0f / ray_y);
+            int step_x = (ray_x < 0.0f) ? -1 : 1, step_y = (ray_y < 0.0f) ? -1 : 1;
+            float side_x = (ray_x < 0.0f) ? (x - hit.cell_x) * delta_x : (hit.cell_x + 1.0f - x) * delta_x;
+            float side_y = (ray_y < 0.0f) ? (y - hit.cell_y) * delta_y : (hit.cell_y + 1.0f - y) * delta_y;
+            for(int i = 0; i < max_steps; i++)
+            {
+                if(side_x < side_y)
+                {
+                    side_x += delta_x;
+                    hit.cell_x += step_x;
+                    hit.y_side = false;
+                }
+                else
+                {
+                    side_y += delta_y;
+                    hit.cell_y += step_y;
+                    hit.y_side = true;
+                }
+                hit.wall = GetCell(hit.cell_x, hit.cell_y);
+                if(hit.wall != 0)
+                    break;
+            }
+            if(hit.wall == 0)
+                return hit;
+            // Perpendicular distance, so walls do not bulge towards the screen edges.
+            hit.distance = hit.y_side ? side_y - delta_y : side_x - delta_x;
+            float u = hit.y_side ? x + hit.distance * ray_x : y + hit.distance * ray_y;
+            hit.wall_u = u - floorf(u);
+            // Keep textures the same way round seen from either side.
+            if((!hit.y_side && ray_x < 0.0f) || (hit.y_side && ray_y > 0.0f))
+                hit.wall_u = 1.0f - hit.wall_u;
+            return hit;
+        }
+
+        void _RenderColumn(uint32_t* pixels, int w, int h, int x)
+        {
+            float camera = 2.0f * x / w - 1.0f;
+            float ray_x = dir_x + plane_x * camera, ray_y = dir_y + plane_y * camera;
+            _internal_ray_hit_t hit = _Cast(camera_x, camera_y, ray_x, ray_y, (map_width + map_height) * 2);
+            depth[x] = (hit.wall != 0) ? hit.distance : 1e30f;
+
+            int top = h, bottom = h;
+            if(hit.wall != 0)
+            {
+                int line = (int)(h / max(hit.distance, 1e-4f));
+                top = max(h / 2 - line / 2, 0);
+                bottom = min(h / 2 + line / 2, h);
+                int frame = min(hit.wall - 1, wall_texels.frames - 1);
+                int tw = wall_texels.frame_width, th = wall_texels.frame_height;
+                if(tw > 0 && th > 0 && frame >= 0)
+                {
+                    int u = min((int)(hit.wall_u * tw), tw - 1);
+                    const uint32_t* column = &wall_texels.texels[((size_t)frame * tw + u) * th];
+                    // 16.16 fixed point walk down the texture column.
+                    int64_t step = ((int64_t)th << 16) / max(line, 1);
+                    int64_t v = (int64_t)(top - (h / 2 - line / 2)) * step;
+                    // Darken the faces along y, the classic cheap lighting.
+                    uint32_t shade = hit.y_side ? 0x7F7F7F7F : 0xFFFFFFFF;
+                    int shift = hit.y_side ? 1 : 0;
+                    uint32_t* out = pixels + (size_t)top * w + x;
+                    for(int y = top; y < bottom; y++, out += w, v += step)
+                        *out = ((column[min((int)(v >> 16), th - 1)] >> shift) & shade) | alpha_mask;
+                }
+                else
+                {
+                    for(int y = top; y < bottom; y++)
+                        pixels[(size_t)y * w + x] = 0xFFFFFFFF;
+                }
+            }
+
+            // Floor below the wall, ceiling mirrored above it. Rows the wall covers are skipped.
+            bool textured = (flat_texels.frames > 0);
+            int fw = flat_texels.frame_width, fh = flat_texels.frame_height;
+            const uint32_t* floor_tex = (textured && floor_frame >= 0) ? &flat_texels.texels[(size_t)min(floor_frame, flat_texels.frames - 1) * fw * fh] : NULL;
+            const uint32_t* ceiling_tex = (textured && ceiling_frame >= 0) ? &flat_texels.texels[(size_t)min(ceiling_frame, flat_texels.frames - 1) * fw * fh] : NULL;
+            int first = max(bottom, h / 2 + 1);
+            for(int y = (hit.wall != 0) ? bottom : h / 2; y < first; y++)
+            {
+                pixels[(size_t)y * w + x] = floor_colour;
+                pixels[(size_t)(h - 1 - y) * w + x] = ceiling_colour;
+            }
+            for(int y = first; y < h; y++)
+            {
+                uint32_t floor = floor_colour, ceiling = ceiling_colour;
+                if(floor_tex != NULL || ceiling_tex != NULL)
+                {
+                    float distance = (0.5f * h) / (y - 0.5f * h);
+                    float fx = camera_x + distance * ray_x, fy = camera_y + distance * ray_y;
+                    int u = (int)((fx - floorf(fx)) * fw), v = (int)((fy - floorf(fy)) * fh);
+                    size_t texel = (size_t)min(u, fw - 1) * fh + min(v, fh - 1);
+                    if(floor_tex != NULL)
+                        floor = floor_tex[texel];
+                    if(ceiling_tex != NULL)
+                        ceiling = ceiling_tex[texel];
+                }
+                pixels[(size_t)y * w + x] = floor;
+                int ceiling_y = h - 1 - y;
+                if(ceiling_y < top)
+                    pixels[(size_t)ceiling_y * w + x] = ceiling;
+            }
+        }
+
+        // Projects the billboards in front of the camera and sorts them far to near.
+        void _PlaceBillboards(int w, int h)
+        {
+            sorted.clear();
+            float inverse = 1.0f / (plane_x * dir_y - dir_x * plane_y);
+            for(size_t i = 0; i < billboards.size(); i++)
+            {
+                RaycastBillboard& b = billboards[i];
+                float rx = b.x - camera_x, ry = b.y - camera_y;
+                float tx = inverse * (dir_y * rx - dir_x * ry);
+                b.depth = inverse * (-plane_y * rx + plane_x * ry);
+                if(b.depth <= 0.05f)
+                    continue;
+                b.screen_x = (int)((w / 2) * (1.0f + tx / b.depth));
+                b.size = abs((int)(h / b.depth));
+                if(b.screen_x + b.size / 2 < 0 || b.screen_x - b.size / 2 >= w)
+                    continue;
+                sorted.push_back((int)i);
+            }
+            sort(sorted.begin(), sorted.end(), [this](int a, int b) { return billboards[a].depth > billboards[b].depth; });
+            sorted_texels.resize(sorted.size());
+            for(size_t k = 0; k < sorted.size(); k++)
+            {
+                size_t sheet = find(billboard_sheets.begin(), billboard_sheets.end(), billboards[sorted[k]].sheet) - billboard_sheets.begin();
+                sorted_texels[k] = (sheet < billboard_texels.size()) ? &billboard_texels[sheet] : NULL;
+            }
+        }
+
+        void _RenderBillboardColumn(uint32_t* pixels, int w, int h, int x)
+        {
+            for(size_t k = 0; k < sorted.size(); k++)
+            {
+                const RaycastBillboard& b = billboards[sorted[k]];
+                int left = b.screen_x - b.size / 2;
+                if(x < left || x >= left + b.size || b.depth >= depth[x])
+                    continue;
+                if(sorted_texels[k] == NULL || sorted_texels[k]->frames == 0)
+                    continue;
+                const _internal_texel_sheet_t& t = *sorted_texels[k];
+                int u = (x - left) * t.frame_width / b.size;
+                const uint32_t* column = &t.texels[((size_t)min(max(b.frame, 0), t.frames - 1) * t.frame_width + u) * t.frame_height];
+                int top = h / 2 - b.size / 2;
+                int y0 = max(top, 0), y1 = min(top + b.size, h);
+                int64_t step = ((int64_t)t.frame_height << 16) / max(b.size, 1);
+                int64_t v = (int64_t)(y0 - top) * step;
+                uint32_t* out = pixels + (size_t)y0 * w + x;
+                for(int y = y0; y < y1; y++, out += w, v += step)
+                {
+                    uint32_t c = column[min((int)(v >> 16), t.frame_height - 1)];
+                    // Cut out: anything under half opacity is not drawn.
+                    if(((const uint8_t*)&c)[3] >= 128)
+                        *out = c;
+                }
+            }
+        }
+    };
+
+    class Canvas;
+    vector<Canvas*> live_canvases;
+
+    // Offscreen render target the normal draw functions can draw into between Begin() and
+    // End(). Its contents stay until Invalidate(), so static layers are drawn once and then
+    // composited every frame with Draw().
+    class Canvas
+    {
+        public:
+        int width, height;
+        SDL_Texture* data;
+        SDL_BlendMode blend = SDL_BLENDMODE_BLEND;
+        uint8_t opacity = 255;
+
+        Canvas(int w, int h)
+        {
+            this->width = w;
+            this->height = h;
+            this->data = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, w, h);
+            if(this->data == NULL)
+                ERROR_OUT("Could not create canvas texture!\nMessage: %s\n", SDL_GetError());
+            else
+                memory_stats.target_bytes += (size_t)w * h * 4;
+            live_canvases.push_back(this);
+        }
+
+        // True until something has been drawn into the canvas since the last Invalidate().
+        bool NeedsRedraw() { return !valid; }
+
+        void Invalidate() { valid = false; }
+
+        // Redirects drawing into the canvas, in canvas pixels with no camera, cleared to
+        // transparent unless clear is false. Canvases can be nested.
+        void Begin(bool clear = true)
+        {
+            if(recording_buffer != NULL)
+            {
+                // Draws recorded until End() are in canvas pixels as well.
+                recording_buffer->_AddCall([this, clear]() { Begin(clear); });
+                recorded_overridden = camera_overridden;
+                recorded_camera = camera_override;
+                camera_overridden = true;
+                camera_override = NULL;
+                return;
+            }
+            if(active)
+            {
+                ERROR_OUT("Canvas::Begin() called twice without End()!\n");
+                return;
+            }
+            active = true;
+            saved_target = SDL_GetRenderTarget(window_renderer);
+            saved_overridden = camera_overridden;
+            saved_camera = camera_override;
+            saved_clip = frame_clip;
+            saved_clip_enabled = frame_clip_enabled;
+
+            SDL_SetRenderTarget(window_renderer, this->data);
+            camera_overridden = true;
+            camera_override = NULL;
+            // The canvas bounds become the frame clip, which is also what culling tests against.
+            frame_clip.x = 0;
+            frame_clip.y = 0;
+            frame_clip.w = width;
+            frame_clip.h = height;
+            frame_clip_enabled = true;
+            _SetClip(NULL);
+            if(clear)
+            {
+                SDL_SetRenderDrawBlendMode(window_renderer, SDL_BLENDMODE_NONE);
+                SDL_SetRenderDrawColor(window_renderer, 0, 0, 0, 0);
+                SDL_RenderClear(window_renderer);
+            }
+        }
+
+        void End()
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this]() { End(); });
+                camera_overridden = recorded_overridden;
+                camera_override = recorded_camera;
+                valid = true;
+                return;
+            }
+            if(!active)
+            {
+                ERROR_OUT("Canvas::End() called without Begin()!\n");
+                return;
+            }
+            SDL_SetRenderTarget(window_renderer, saved_target);
+            camera_overridden = saved_overridden;
+            camera_override = saved_camera;
+            frame_clip = saved_clip;
+            frame_clip_enabled = saved_clip_enabled;
+            _SetClip(NULL);
+            active = false;
+            valid = true;
+        }
+
+        // Composites the canvas like Image::DrawImage, with its blend mode and opacity.
+        void Draw(int x, int y, float scale = 1.0f, float angle = 0.0f, int pivotx = 0, int pivoty = 0, bool h_flip = false, bool v_flip = false)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([=]() { Draw(x, y, scale, angle, pivotx, pivoty, h_flip, v_flip); });
+                return;
+            }
+            if(this->data == NULL)
+                return;
+            int flip = SDL_FLIP_NONE;
+            if(h_flip)
+                flip |= SDL_FLIP_HORIZONTAL;
+            if(v_flip)
+                flip |= SDL_FLIP_VERTICAL;
+            SDL_SetTextureBlendMode(this->data, blend);
+            SDL_SetTextureAlphaMod(this->data, opacity);
+            _DrawTexture(this->data, NULL, x, y, width * scale, height * scale, angle, pivotx, pivoty, (SDL_RendererFlip)flip);
+        }
+
+        ~Canvas()
+        {
+            if(active)
+                End();
+            live_canvases.erase(find(live_canvases.begin(), live_canvases.end(), this));
+            if(this->data != NULL)
+                memory_stats.target_bytes -= (size_t)width * height * 4;
+            SDL_DestroyTexture(this->data);
+        }
+
+        private:
+        bool valid = false;
+        bool active = false;
+        SDL_Texture* saved_target = NULL;
+        bool saved_overridden = false;
+        Camera* saved_camera = NULL;
+        bool recorded_overridden = false;
+        Camera* recorded_camera = NULL;
+        SDL_Rect saved_clip;
+        bool saved_clip_enabled = false;
+    };
+
+    class Sound
+    {
+        SDL_AudioSpec wav_spec;
+        uint32_t wav_length;
+        uint8_t* wav_buffer;
+        SDL_AudioDeviceID device_id;
+        float volume = 1.0f;
+        // The samples at volume, made by SetVolume() so Play() only has to queue them.
+        uint8_t* scaled_buffer = NULL;
+
+        public:
+        bool is_paused = true;
+
+        Sound(string s)
+        {
+            SDL_LoadWAV(s.c_str(), &wav_spec, &wav_buffer, &wav_length);
+            device_id = SDL_OpenAudioDevice(NULL, 0, &wav_spec, NULL, 0);
+            if(!device_id)
+            {
+                ERROR_OUT("Unable to open sound device!\nMessage: %s\n", SDL_GetError());
+            }
+        }
+
+        // The loaded samples are left as they are; a scaled copy is kept below full volume.
+        void SetVolume(float volume)
+        {
+            ALLOCATION_TAG("Sound::SetVolume");
+            this->volume = Clamp(volume, 0.0, 1.0);
+            if(this->volume >= 1.0f || wav_buffer == NULL)
+            {
+                SDL_free(scaled_buffer);
+                scaled_buffer = NULL;
+                return;
+            }
+            if(scaled_buffer == NULL)
+                scaled_buffer = (uint8_t*)SDL_malloc(wav_length);
+            if(scaled_buffer == NULL)
+                return;
+            memset(scaled_buffer, 0, wav_length);
+            SDL_MixAudioFormat(scaled_buffer, wav_buffer, wav_spec.format, wav_length, (int)(this->volume * SDL_MIX_MAXVOLUME));
+        }
+
+        void Play()
+        {
+            ALLOCATION_TAG("Sound::Play");
+            SDL_QueueAudio(device_id, (scaled_buffer != NULL) ? scaled_buffer : wav_buffer, wav_length);
+            UnPause();
+        }
+
+        // Drops whatever is still queued and pauses.
+        void Stop()
+        {
+            SDL_ClearQueuedAudio(device_id);
+            Pause();
+        }
+
+        bool IsFinished()
+        {
+            if(SDL_GetQueuedAudioSize(device_id) == 0) 
+                return true;
+            else
+                return false;
+        }
+
+        void Pause()
+        {
+            SDL_PauseAudioDevice(device_id, 1);
+            is_paused = true;
+        }
+
+        void UnPause()
+        {
+            SDL_PauseAudioDevice(device_id, 0);
+            is_paused = false;
+        }
+
+        bool IsPaused()
+        {
+            return is_paused;
+        }
+
+        ~Sound()
+        {
+            SDL_free(scaled_buffer);
+            SDL_FreeWAV(wav_buffer);
+        }
+    };
+
+    enum class ParticleShape
+    {
+        // One screen pixel per particle whatever the camera zoom, coloured like the quads.
+        POINT = 0,
+        QUAD,
+        SPRITE,
+    };
+
+    // Particles are kept as parallel arrays and packed at the front, dead ones are replaced
+    // by the last live particle. Draw() sends the whole emitter to SDL in a single call.
+    class ParticleEmitter
+    {
+        public:
+        float x = 0.0f, y = 0.0f;
+        // New particles appear anywhere in a spawn_w x spawn_h box centred on x, y.
+        float spawn_w = 0.0f, spawn_h = 0.0f;
+        // Particles per second released by Update().
+        float rate = 0.0f;
+        // Launch angle and the full width of the cone around it, in radians.
+        float direction = 0.0f, spread = 2.0f * _PI;
+        float speed_min = 50.0f, speed_max = 100.0f;
+        float life_min = 1.0f, life_max = 1.0f;
+        float gravity_x = 0.0f, gravity_y = 0.0f;
+        // Fraction of velocity lost per second.
+        float drag = 0.0f;
+        SDL_Color colour = {255, 255, 255, 255};
+        // When set, particles blend from their spawn colour to colour_end over their life.
+        bool fade = false;
+        SDL_Color colour_end = {255, 255, 255, 0};
+        ParticleShape shape = ParticleShape::QUAD;
+        // Quad side in pixels for QUAD, scale of the frame for SPRITE.
+        float size = 2.0f;
+        // SPRITE particles play through the sheet over their life when animate is set,
+        // otherwise they all show frame.
+        Sprite* sprite = NULL;
+        bool animate = true;
+        int frame = 0;
+        SDL_BlendMode blend = SDL_BLENDMODE_BLEND;
+        // Update() and Draw() split the work across the job workers above this many particles.
+        int parallel_threshold = 32768;
+
+        ParticleEmitter(int capacity)
+        {
+            this->capacity = max(capacity, 0);
+            px.resize(this->capacity);
+            py.resize(this->capacity);
+            vx.resize(this->capacity);
+            vy.resize(this->capacity);
+            life.resize(this->capacity);
+            inv_lifetime.resize(this->capacity);
+            tint.resize(this->capacity);
+        }
+
+        int GetCount() { return count; }
+        int GetCapacity() { return capacity; }
+
+        void Clear()
+        {
+            count = 0;
+            emit_accumulator = 0.0f;
+        }
+
+        // Adds one particle with explicit state. Returns false when the emitter is full.
+        bool Spawn(float x, float y, float vx, float vy, float lifetime, SDL_Color c)
+        {
+            if(count >= capacity || lifetime <= 0.0f)
+                return false;
+            int i = count++;
+            px[i] = x;
+            py[i] = y;
+            this->vx[i] = vx;
+            this->vy[i] = vy;
+            life[i] = lifetime;
+            inv_lifetime[i] = 1.0f / lifetime;
+            tint[i] = c;
+            return true;
+        }
+
+        // Releases n particles using the emitter settings.
+        void Emit(int n)
+        {
+            n = min(n, capacity - count);
+            for(int k = 0; k < n; k++)
+            {
+                float angle = direction + (_Random() - 0.5f) * spread;
+                float speed = speed_min + _Random() * (speed_max - speed_min);
+                float lifetime = max(life_min + _Random() * (life_max - life_min), 0.0001f);
+                Spawn(x + (_Random() - 0.5f) * spawn_w, y + (_Random() - 0.5f) * spawn_h,
+                      FastCos(angle) * speed, FastSin(angle) * speed, lifetime, colour);
+            }
+        }
+
+        void Update(float elapsed)
+        {
+            if(rate > 0.0f)
+            {
+                emit_accumulator += rate * elapsed;
+                int n = (int)emit_accumulator;
+                emit_accumulator -= n;
+                Emit(n);
+            }
+
+            if(count > parallel_threshold)
+                ParallelFor(count, 16384, [this, elapsed](int begin, int end) { _Integrate(begin, end, elapsed); });
+            else
+                _Integrate(0, count, elapsed);
+
+            // Swap-remove the dead. Order is not kept.
+            int i = 0;
+            while(i < count)
+            {
+                if(life[i] > 0.0f)
+                {
+                    i++;
+                    continue;
+                }
+                int last = --count;
+                px[i] = px[last];
+                py[i] = py[last];
+                vx[i] = vx[last];
+                vy[i] = vy[last];
+                life[i] = life[last];
+                inv_lifetime[i] = inv_lifetime[last];
+                tint[i] = tint[last];
+            }
+        }
+
+        void Draw()
+        {
+            if(count == 0)
+                return;
+            view = (_ActiveCamera() == NULL) ? Transform2D() : _ActiveCamera()->GetTransform();
+            view_scale = _ScreenScale();
+            // While recording, the vertices are built now and only the submit is deferred. Each
+            // frame builds into its own buffer, so the next frame can build while the previous
+            // one is replayed; drawing again in the same frame appends rather than overwrites.
+            build_slot = frame_serial & 1;
+            if(slot_frame[build_slot] != frame_serial)
+            {
+                slot_frame[build_slot] = frame_serial;
+                slot_used[build_slot] = 0;
+            }
+            build_base = slot_used[build_slot];
+            slot_used[build_slot] += count;
+            Image* image = NULL;
+            if(shape == ParticleShape::SPRITE)
+            {
+                if(sprite == NULL)
+                {
+                    ERROR_OUT("Sprite particles drawn without a sprite!\n");
+                    return;
+                }
+                image = sprite->im;
+                _BuildFrameTable();
+            }
+
+            if(vertices[build_slot].size() < (size_t)(build_base + count) * 4)
+                vertices[build_slot].resize((size_t)(build_base + count) * 4);
+
+            if(count > parallel_threshold)
+                ParallelFor(count, 16384, [this](int begin, int end) { _BuildVertices(begin, end); });
+            else
+                _BuildVertices(0, count);
+            _Submit(image, build_slot, build_base, count);
+        }
 
         private:
-        bool is_own_image = false;
+        // Structure of arrays, live particles are [0, count).
+        vector<float> px, py, vx, vy, life, inv_lifetime;
+        vector<SDL_Color> tint;
+        int count = 0;
+        int capacity = 0;
+        float emit_accumulator = 0.0f;
+        uint32_t seed = 0x9E3779B9;
+
+        vector<SDL_Vertex> vertices[2];
+        int build_slot = 0;
+        int build_base = 0;
+        uint32_t slot_frame[2] = {0, 0};
+        int slot_used[2] = {0, 0};
+        vector<SDL_FPoint> frame_uv;
+        // Camera transform captured by Draw(). Quads stay upright on screen.
+        Transform2D view;
+        float view_scale = 1.0f;
+
+        void _Submit(Image* image, int slot, int base, int n)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([this, image, slot, base, n]() { _Submit(image, slot, base, n); });
+                return;
+            }
+            SDL_Texture* texture = (image != NULL) ? image->GetTexture() : NULL;
+            draw_stats.drawn++;
+            // The sprite's image is shared, so its own blend mode is put back afterwards.
+            SDL_BlendMode previous = SDL_BLENDMODE_BLEND;
+            if(texture != NULL)
+            {
+                SDL_GetTextureBlendMode(texture, &previous);
+                SDL_SetTextureBlendMode(texture, blend);
+            }
+            else
+                SDL_SetRenderDrawBlendMode(window_renderer, blend);
+            SDL_RenderGeometry(window_renderer, texture, vertices[slot].data() + (size_t)base * 4, n * 4, _QuadIndices(n), n * 6);
+            if(texture != NULL)
+                SDL_SetTextureBlendMode(texture, previous);
+        }
+
+        // xorshift32, uniform in [0, 1).
+        float _Random()
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return (seed >> 8) * (1.0f / 16777216.0f);
+        }
+
+        void _Integrate(int begin, int end, float elapsed)
+        {
+            int n = end - begin;
+            if(gravity_x != 0.0f || gravity_y != 0.0f)
+                BatchTranslate(&vx[begin], &vy[begin], n, gravity_x * elapsed, gravity_y * elapsed);
+            if(drag != 0.0f)
+            {
+                float k = max(1.0f - drag * elapsed, 0.0f);
+                BatchScale(&vx[begin], &vy[begin], n, k, k);
+            }
+            BatchAddScaled(&px[begin], &py[begin], &vx[begin], &vy[begin], n, elapsed);
+            BatchAdd(&life[begin], n, -elapsed);
+        }
+
+        // Top-left texture coordinate of each sprite frame, plus the frame size at the end.
+        void _BuildFrameTable()
+        {
+            int columns = max(sprite->sheet_width / sprite->sprite_width, 1);
+            float iw = 1.0f / sprite->sheet_width, ih = 1.0f / sprite->sheet_height;
+            frame_uv.resize(sprite->total_frames + 1);
+            for(int f = 0; f < sprite->total_frames; f++)
+            {
+                frame_uv[f].x = (f % columns) * sprite->sprite_width * iw;
+                frame_uv[f].y = (f / columns) * sprite->sprite_height * ih;
+            }
+            frame_uv[sprite->total_frames].x = sprite->sprite_width * iw;
+            frame_uv[sprite->total_frames].y = sprite->sprite_height * ih;
+        }
+
+        void _BuildVertices(int begin, int end)
+        {
+            float hw = size * view_scale * 0.5f, hh = size * view_scale * 0.5f;
+            if(shape == ParticleShape::POINT)
+                hw = hh = 0.5f;
+            SDL_FPoint uv0 = {0.0f, 0.0f}, uv_size = {0.0f, 0.0f};
+            int frames = 0;
+            if(shape == ParticleShape::SPRITE)
+            {
+                hw = sprite->sprite_width * size * view_scale * 0.5f;
+                hh = sprite->sprite_height * size * view_scale * 0.5f;
+                frames = sprite->total_frames;
+                uv_size = frame_uv[frames];
+                uv0 = frame_uv[min(max(frame, 0), frames - 1)];
+            }
+
+            for(int i = begin; i < end; i++)
+            {
+                SDL_Color c = tint[i];
+                float t = 1.0f - life[i] * inv_lifetime[i];
+                if(fade)
+                {
+                    c.r = (uint8_t)(c.r + (colour_end.r - c.r) * t);
+                    c.g = (uint8_t)(c.g + (colour_end.g - c.g) * t);
+                    c.b = (uint8_t)(c.b + (colour_end.b - c.b) * t);
+                    c.a = (uint8_t)(c.a + (colour_end.a - c.a) * t);
+                }
+                SDL_FPoint uv = uv0;
+                if(frames > 0 && animate)
+                    uv = frame_uv[min((int)(t * frames), frames - 1)];
+
+                SDL_Vertex* v = &vertices[build_slot][(size_t)(build_base + i) * 4];
+                float cx = view.a * px[i] + view.c * py[i] + view.tx;
+                float cy = view.b * px[i] + view.d * py[i] + view.ty;
+                float x0 = cx - hw, x1 = cx + hw;
+                float y0 = cy - hh, y1 = cy + hh;
+                v[0].position.x = x0; v[0].position.y = y0;
+                v[1].position.x = x1; v[1].position.y = y0;
+                v[2].position.x = x1; v[2].position.y = y1;
+                v[3].position.x = x0; v[3].position.y = y1;
+                v[0].tex_coord.x = uv.x; v[0].tex_coord.y = uv.y;
+                v[1].tex_coord.x = uv.x + uv_size.x; v[1].tex_coord.y = uv.y;
+                v[2].tex_coord.x = uv.x + uv_size.x; v[2].tex_coord.y = uv.y + uv_size.y;
+                v[3].tex_coord.x = uv.x; v[3].tex_coord.y = uv.y + uv_size.y;
+                v[0].color = c; v[1].color = c; v[2].color = c; v[3].color = c;
+            }
+        }
+    };
 
+    // Grid of sprite frames in one or more layers. The map is cut into square chunks that
+    // are rendered once into their own target texture and redrawn only after a tile inside
+    // them changes, so drawing costs one copy per visible chunk per layer.
+    class TileMap;
+    vector<TileMap*> live_tile_maps;
+
+    class TileMap
+    {
         public:
-        BitmapFont(string s, int ch_w, int ch_h, uint8_t r = 0, uint8_t g = 0, uint8_t b = 0, uint8_t a = 0)
+        static const uint16_t EMPTY_TILE = 0xFFFF;
+        int width, height;
+        int layer_count;
+        int chunk_size;
+        int tile_width, tile_height;
+
+        TileMap(Sprite* tiles, int width, int height, int layers = 1, int chunk_size = 32)
         {
-            Image* im = new Image(s);
-            is_own_image = true;
-            CreateBitmapFont(im, ch_w, ch_h, r, g, b, a);
+            this->tiles = tiles;
+            this->width = max(width, 0);
+            this->height = max(height, 0);
+            this->layer_count = max(layers, 1);
+            this->chunk_size = max(chunk_size, 1);
+            this->tile_width = tiles->sprite_width;
+            this->tile_height = tiles->sprite_height;
+            chunks_x = (this->width + this->chunk_size - 1) / this->chunk_size;
+            chunks_y = (this->height + this->chunk_size - 1) / this->chunk_size;
+            cells.assign((size_t)layer_count * this->width * this->height, (uint16_t)EMPTY_TILE);
+            layer_visible.assign(layer_count, true);
+
+            _internal_tile_chunk_t empty = {NULL, true, 0};
+            chunks.assign((size_t)layer_count * chunks_x * chunks_y, empty);
+            live_tile_maps.push_back(this);
         }
 
-        BitmapFont(Image* im, int ch_w, int ch_h, uint8_t r = 0, uint8_t g = 0, uint8_t b = 0, uint8_t a = 0)
+        uint16_t GetTile(int layer, int x, int y)
         {
-            CreateBitmapFont(im, ch_w, ch_h, r, g, b, a);
+            if(!_InMap(layer, x, y))
+                return EMPTY_TILE;
+            return cells[_Cell(layer, x, y)];
         }
 
-        void CreateBitmapFont(Image* im, int ch_w, int ch_h, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        void SetTile(int layer, int x, int y, uint16_t tile)
         {
-            character_width = ch_w;
-            character_height = ch_h;
-            fontsheet_width = im->width;
-            fontsheet_height = im->height;
-            characters_per_line = fontsheet_width / character_width;
-            this->im = im;
-            this->im->TransparentColour(true, r, g, b, a);
+            if(!_InMap(layer, x, y))
+                return;
+            uint16_t& cell = cells[_Cell(layer, x, y)];
+            if(cell == tile)
+                return;
+            _internal_tile_chunk_t& chunk = chunks[_Chunk(layer, x / chunk_size, y / chunk_size)];
+            if(cell == EMPTY_TILE)
+                chunk.tile_count++;
+            if(tile == EMPTY_TILE)
+                chunk.tile_count--;
+            cell = tile;
+            chunk.dirty = true;
         }
 
-        void DrawChar(unsigned char s, int x, int y, float scale = 1)
+        void Fill(int layer, uint16_t tile)
         {
-            int fx = character_width * (s % characters_per_line);
-            int fy = character_height * (s / characters_per_line);
+            if(layer < 0 || layer >= layer_count)
+                return;
+            for(int y = 0; y < height; y++)
+                for(int x = 0; x < width; x++)
+                    SetTile(layer, x, y, tile);
+        }
 
-            this->im->DrawImage(x, y, fx, fy, character_width, character_height, 0, 0, 0, scale, false, false);
+        void SetLayerVisible(int layer, bool visible)
+        {
+            if(layer >= 0 && layer < layer_count)
+                layer_visible[layer] = visible;
         }
 
-        void Colourise(uint8_t r, uint8_t g, uint8_t b)
+        // Marks every chunk for redrawing, e.g. after the tile sheet changed or the renderer
+        // reported SDL_RENDER_TARGETS_RESET.
+        void Invalidate()
         {
-            this->im->Colourise(r, g, b);
+            for(unsigned int i = 0; i < chunks.size(); i++)
+                chunks[i].dirty = true;
         }
 
-        void DrawString(char* s, int x, int y, int scale = 1)
+        // Frees the chunk textures. They are rebuilt as they come back into view.
+        void ReleaseTextures()
         {
-            int n = strlen(s);
-            int x_now = x;
-            int y_now = y;
-            for(int i = 0; i < n; i++)
+            for(unsigned int i = 0; i < chunks.size(); i++)
+            {
+                if(chunks[i].texture != NULL)
+                    memory_stats.target_bytes -= (size_t)chunk_size * tile_width * chunk_size * tile_height * 4;
+                SDL_DestroyTexture(chunks[i].texture);
+                chunks[i].texture = NULL;
+                chunks[i].dirty = true;
+            }
+        }
+
+        // Draws the visible layers with the map pixel (view_x, view_y) at the screen position
+        // (x, y). The view covers w x h pixels, or the rest of the screen when they are 0.
+        // While a camera is set, (x, y) is a world position and the view is whatever part of
+        // the map the camera sees, so w and h are ignored.
+        void Draw(int x, int y, int view_x, int view_y, int w = 0, int h = 0)
+        {
+            for(int layer = 0; layer < layer_count; layer++)
+                if(layer_visible[layer])
+                    DrawLayer(layer, x, y, view_x, view_y, w, h);
+        }
+
+        void DrawLayer(int layer, int x, int y, int view_x, int view_y, int w = 0, int h = 0)
+        {
+            if(recording_buffer != NULL)
+            {
+                recording_buffer->_AddCall([=]() { DrawLayer(layer, x, y, view_x, view_y, w, h); });
+                return;
+            }
+            if(layer < 0 || layer >= layer_count)
+                return;
+            int chunk_w = chunk_size * tile_width, chunk_h = chunk_size * tile_height;
+            if(_ActiveCamera() != NULL)
+            {
+                _DrawLayerWithCamera(layer, x - view_x, y - view_y);
+                return;
+            }
+            if(w <= 0)
+                w = screen_width - x;
+            if(h <= 0)
+                h = screen_height - y;
+            if(w <= 0 || h <= 0)
+                return;
+
+            int cx0 = max(_FloorDiv(view_x, chunk_w), 0);
+            int cy0 = max(_FloorDiv(view_y, chunk_h), 0);
+            int cx1 = min(_FloorDiv(view_x + w - 1, chunk_w), chunks_x - 1);
+            int cy1 = min(_FloorDiv(view_y + h - 1, chunk_h), chunks_y - 1);
+
+            // Bring stale chunks up to date first so the render target only switches before
+            // the clipped copies start.
+            for(int cy = cy0; cy <= cy1; cy++)
+            {
+                for(int cx = cx0; cx <= cx1; cx++)
+                {
+                    _internal_tile_chunk_t& chunk = chunks[_Chunk(layer, cx, cy)];
+                    if(chunk.tile_count > 0 && (chunk.dirty || chunk.texture == NULL))
+                        _RenderChunk(layer, cx, cy, chunk);
+                }
+            }
+
+            SDL_Rect clip = {x, y, w, h};
+            _SetClip(&clip);
+            for(int cy = cy0; cy <= cy1; cy++)
             {
-                if(s[i] == '\n')
+                for(int cx = cx0; cx <= cx1; cx++)
                 {
-                    x_now = x;
-                    y_now += character_height * scale;
+                    _internal_tile_chunk_t& chunk = chunks[_Chunk(layer, cx, cy)];
+                    if(chunk.tile_count == 0 || chunk.texture == NULL)
+                        continue;
+                    _DrawTexture(chunk.texture, NULL, x + cx * chunk_w - view_x, y + cy * chunk_h - view_y, chunk_w, chunk_h, 0.0, 0, 0, SDL_FLIP_NONE);
                 }
-                else if(s[i] == '\r')
+            }
+            _SetClip(NULL);
+        }
+
+        ~TileMap()
+        {
+            live_tile_maps.erase(find(live_tile_maps.begin(), live_tile_maps.end(), this));
+            ReleaseTextures();
+        }
+
+        private:
+        typedef struct
+        {
+            SDL_Texture* texture;
+            bool dirty;
+            int tile_count;
+        } _internal_tile_chunk_t;
+
+        Sprite* tiles;
+        int chunks_x, chunks_y;
+        vector<uint16_t> cells;
+        vector<_internal_tile_chunk_t> chunks;
+        vector<bool> layer_visible;
+
+        bool _InMap(int layer, int x, int y)
+        {
+            return layer >= 0 && layer < layer_count && x >= 0 && y >= 0 && x < width && y < height;
+        }
+
+        size_t _Cell(int layer, int x, int y)
+        {
+            return ((size_t)layer * height + y) * width + x;
+        }
+
+        size_t _Chunk(int layer, int cx, int cy)
+        {
+            return ((size_t)layer * chunks_y + cy) * chunks_x + cx;
+        }
+
+        static int _FloorDiv(int a, int b)
+        {
+            return (a >= 0) ? a / b : -((-a + b - 1) / b);
+        }
+
+        // Map origin at world (ox, oy). Only chunks inside the camera's visible area are drawn.
+        void _DrawLayerWithCamera(int layer, int ox, int oy)
+        {
+            int chunk_w = chunk_size * tile_width, chunk_h = chunk_size * tile_height;
+            BoundingBox area = _ActiveCamera()->GetVisibleArea();
+            int cx0 = max(_FloorToInt((area.min_x - ox) / chunk_w), 0);
+            int cy0 = max(_FloorToInt((area.min_y - oy) / chunk_h), 0);
+            int cx1 = min(_FloorToInt((area.max_x - ox) / chunk_w), chunks_x - 1);
+            int cy1 = min(_FloorToInt((area.max_y - oy) / chunk_h), chunks_y - 1);
+            for(int cy = cy0; cy <= cy1; cy++)
+            {
+                for(int cx = cx0; cx <= cx1; cx++)
                 {
-                    x_now = x;
+                    _internal_tile_chunk_t& chunk = chunks[_Chunk(layer, cx, cy)];
+                    if(chunk.tile_count == 0)
+                        continue;
+                    if(chunk.dirty || chunk.texture == NULL)
+                        _RenderChunk(layer, cx, cy, chunk);
+                    if(chunk.texture != NULL)
+                        _DrawTexture(chunk.texture, NULL, ox + cx * chunk_w, oy + cy * chunk_h, chunk_w, chunk_h, 0.0, 0, 0, SDL_FLIP_NONE);
                 }
-                else if(s[i] == '\t')
+            }
+        }
+
+        void _RenderChunk(int layer, int cx, int cy, _internal_tile_chunk_t& chunk)
+        {
+            TRACE_ZONE("TileMap chunk");
+            int chunk_w = chunk_size * tile_width, chunk_h = chunk_size * tile_height;
+            if(chunk.texture == NULL)
+            {
+                chunk.texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, chunk_w, chunk_h);
+                if(chunk.texture == NULL)
                 {
-                    x_now += 4 * character_width * scale;
+                    ERROR_OUT("Could not create tile chunk texture!\nMessage: %s\n", SDL_GetError());
+                    return;
                 }
-                else
+                memory_stats.target_bytes += (size_t)chunk_w * chunk_h * 4;
+                SDL_SetTextureBlendMode(chunk.texture, SDL_BLENDMODE_BLEND);
+            }
+
+            SDL_Texture* previous = SDL_GetRenderTarget(window_renderer);
+            SDL_SetRenderTarget(window_renderer, chunk.texture);
+            SDL_RenderSetClipRect(window_renderer, NULL);
+            SDL_SetRenderDrawBlendMode(window_renderer, SDL_BLENDMODE_NONE);
+            SDL_SetRenderDrawColor(window_renderer, 0, 0, 0, 0);
+            SDL_RenderClear(window_renderer);
+
+            int x0 = cx * chunk_size, y0 = cy * chunk_size;
+            int x1 = min(x0 + chunk_size, width), y1 = min(y0 + chunk_size, height);
+            const SDL_Rect* frame_rects = tiles->frame_rects.data();
+            int frames = tiles->total_frames;
+            SDL_Texture* tiles_texture = tiles->im->GetTexture();
+            for(int y = y0; y < y1; y++)
+            {
+                const uint16_t* row = &cells[_Cell(layer, 0, y)];
+                for(int x = x0; x < x1; x++)
                 {
-                    DrawChar((unsigned char)s[i], x_now, y_now, scale);
-                    x_now += character_width * scale;
+                    if(row[x] == EMPTY_TILE || row[x] >= frames)
+                        continue;
+                    SDL_Rect dest = {(x - x0) * tile_width, (y - y0) * tile_height, tile_width, tile_height};
+                    SDL_RenderCopy(window_renderer, tiles_texture, &frame_rects[row[x]], &dest);
                 }
             }
+            SDL_SetRenderTarget(window_renderer, previous);
+            _SetClip(NULL);
+            chunk.dirty = false;
         }
+    };
 
-        void printf(int x, int y, int scale, const char* fmt, ...)
+    // Entities are a 24 bit slot index with an 8 bit generation on top, so handles to
+    // destroyed entities stop matching once their slot is reused.
+    typedef uint32_t Entity;
+    const Entity NULL_ENTITY = 0xFFFFFFFF;
+
+    enum class SystemPhase
+    {
+        UPDATE = 0,
+        DRAW,
+        TOTAL_PHASES,
+    };
+
+    class _internal_pool_base
+    {
+        public:
+        // Non-zero while this pool's first group_size entries line up with the other pools
+        // packed together with it by World::Pack(). group_pools is how many pools that was.
+        uint32_t group_id = 0;
+        uint32_t group_size = 0;
+        uint32_t group_pools = 0;
+        vector<Entity> entities;
+        vector<uint32_t> sparse;
+
+        bool Has(Entity e)
+        {
+            uint32_t index = e & 0xFFFFFF;
+            return index < sparse.size() && sparse[index] != 0xFFFFFFFF && entities[sparse[index]] == e;
+        }
+
+        uint32_t Size()
         {
-            va_list arg1, arg2;
-            va_start(arg1, fmt);
+            return entities.size();
+        }
+
+        virtual void Remove(Entity e) = 0;
+        virtual void Swap(uint32_t a, uint32_t b) = 0;
+        virtual ~_internal_pool_base() {}
+    };
 
-            va_copy(arg2, arg1);
-            size_t size = vsnprintf(NULL, 0, fmt, arg2) + 1;
-            va_end(arg2);
+    // Sparse set: components of one type sit contiguously in dense, in the same order as
+    // entities. sparse maps an entity's slot to its position in dense.
+    template<typename T>
+    class ComponentPool : public _internal_pool_base
+    {
+        public:
+        vector<T> dense;
 
-            char* buff = new char[size];
-            vsnprintf(buff, size, fmt, arg1);
-            va_end(arg1);
+        T& Add(Entity e, const T& value)
+        {
+            uint32_t index = e & 0xFFFFFF;
+            if(index >= sparse.size())
+                sparse.resize(index + 1, 0xFFFFFFFF);
+            if(Has(e))
+            {
+                dense[sparse[index]] = value;
+                return dense[sparse[index]];
+            }
+            group_id = 0;
+            sparse[index] = dense.size();
+            entities.push_back(e);
+            dense.push_back(value);
+            return dense.back();
+        }
 
-            DrawString(buff, x, y, scale);
-            delete[] buff;
+        T* Get(Entity e)
+        {
+            return Has(e) ? &dense[sparse[e & 0xFFFFFF]] : NULL;
         }
 
-        ~BitmapFont()
+        void Remove(Entity e)
         {
-            if(is_own_image)
-                delete this->im;
+            if(!Has(e))
+                return;
+            group_id = 0;
+            uint32_t at = sparse[e & 0xFFFFFF];
+            uint32_t last = dense.size() - 1;
+            if(at != last)
+            {
+                dense[at] = dense[last];
+                entities[at] = entities[last];
+                sparse[entities[at] & 0xFFFFFF] = at;
+            }
+            dense.pop_back();
+            entities.pop_back();
+            sparse[e & 0xFFFFFF] = 0xFFFFFFFF;
+        }
+
+        void Swap(uint32_t a, uint32_t b)
+        {
+            if(a == b)
+                return;
+            swap(dense[a], dense[b]);
+            swap(entities[a], entities[b]);
+            sparse[entities[a] & 0xFFFFFF] = a;
+            sparse[entities[b] & 0xFFFFFF] = b;
         }
     };
 
-    class PixelBlock
+    int _next_component_type = 0;
+
+    template<typename T>
+    int _ComponentType()
+    {
+        static int type = _next_component_type++;
+        return type;
+    }
+
+    // Entity storage for applications with many similar objects. Components are plain
+    // structs kept in one contiguous array per type; systems are functions run over every
+    // entity holding a given set of components. Attach a World with AttachWorld() to run
+    // its UPDATE systems after Application::Update and its DRAW systems after
+    // Application::Draw, where the usual draw functions can be called.
+    class World
     {
         public:
-        uint8_t* pixels;
-        int width, height;
-        bool blend;
-        int pixel_array_size;
+        ~World()
+        {
+            for(unsigned int i = 0; i < pools.size(); i++)
+                delete pools[i];
+        }
 
-        PixelBlock(int w, int h)
+        Entity Create()
         {
-            this->pixels = (uint8_t*)calloc(w * h * sizeof(uint32_t), sizeof(uint8_t));
-            this->width = w;
-            this->height = h;
-            this->pixel_array_size = w * h * sizeof(uint32_t);
+            uint32_t index;
+            if(!free_slots.empty())
+            {
+                index = free_slots.back();
+                free_slots.pop_back();
+            }
+            else
+            {
+                index = generations.size();
+                generations.push_back(0);
+            }
+            alive_count++;
+            return ((uint32_t)generations[index] << 24) | index;
         }
 
-        ~PixelBlock()
+        void Destroy(Entity e)
         {
-            free(this->pixels);
+            if(!IsAlive(e))
+                return;
+            for(unsigned int i = 0; i < pools.size(); i++)
+            {
+                if(pools[i] != NULL)
+                    pools[i]->Remove(e);
+            }
+            uint32_t index = e & 0xFFFFFF;
+            generations[index]++;
+            free_slots.push_back(index);
+            alive_count--;
         }
 
-        void DrawPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+        bool IsAlive(Entity e)
         {
-            int pos = (y * sizeof(uint32_t) * width) + x * sizeof(uint32_t);
-            if(pos < pixel_array_size-3 && pos > 0)
+            uint32_t index = e & 0xFFFFFF;
+            return e != NULL_ENTITY && index < generations.size() && generations[index] == (e >> 24);
+        }
+
+        uint32_t GetEntityCount()
+        {
+            return alive_count;
+        }
+
+        template<typename T>
+        T& Add(Entity e, const T& value = T())
+        {
+            return Pool<T>().Add(e, value);
+        }
+
+        template<typename T>
+        void Remove(Entity e)
+        {
+            Pool<T>().Remove(e);
+        }
+
+        template<typename T>
+        T* Get(Entity e)
+        {
+            return Pool<T>().Get(e);
+        }
+
+        template<typename T>
+        bool Has(Entity e)
+        {
+            return Pool<T>().Has(e);
+        }
+
+        template<typename T>
+        ComponentPool<T>& Pool()
+        {
+            int type = _ComponentType<T>();
+            if(type >= (int)pools.size())
+                pools.resize(type + 1, NULL);
+            if(pools[type] == NULL)
+                pools[type] = new ComponentPool<T>();
+            return *static_cast<ComponentPool<T>*>(pools[type]);
+        }
+
+        // Reorders the pools of T... so the entities holding all of them come first, in the
+        // same order in every pool. Each() and ParallelEach() over exactly these types then
+        // walk the arrays index by index with no lookups. Adding or removing any of these
+        // components undoes the packing, so call it again after structural changes.
+        template<typename... T>
+        void Pack()
+        {
+            _internal_pool_base* set[] = {&Pool<T>()...};
+            int n = sizeof...(T);
+            _internal_pool_base* lead = set[0];
+            for(int i = 1; i < n; i++)
             {
-                pixels[pos] = r;
-                pixels[pos+1] = g;
-                pixels[pos+2] = b;
-                pixels[pos+3] = a;
+                if(set[i]->Size() < lead->Size())
+                    lead = set[i];
+            }
+            uint32_t count = 0;
+            for(uint32_t i = 0; i < lead->Size(); i++)
+            {
+                Entity e = lead->entities[i];
+                bool in_all = true;
+                for(int p = 0; p < n && in_all; p++)
+                    in_all = set[p]->Has(e);
+                if(!in_all)
+                    continue;
+                for(int p = 0; p < n; p++)
+                    set[p]->Swap(set[p]->sparse[e & 0xFFFFFF], count);
+                count++;
+            }
+            next_group_id++;
+            for(int p = 0; p < n; p++)
+            {
+                set[p]->group_id = next_group_id;
+                set[p]->group_size = count;
+                set[p]->group_pools = n;
             }
         }
 
-        void GetPixel(int x, int y, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a)
+        // Calls f(entity, T&...) for every entity holding all of T...
+        template<typename... T, typename F>
+        void Each(F f)
         {
-            int pos = (y * 4 * width) + x * 4;
-            if(pos < pixel_array_size)
+            _EachRange<T...>(f, 0, _CandidateCount<T...>());
+        }
+
+        // As Each(), but split into chunks across the worker threads. f must only touch the
+        // entity it is given; adding or removing components inside it is not allowed.
+        template<typename... T, typename F>
+        void ParallelEach(F f, int chunk_size = 4096)
+        {
+            uint32_t count = _CandidateCount<T...>();
+            ParallelFor(count, chunk_size, [&](int begin, int end)
             {
-                *r = pixels[pos];
-                *g = pixels[pos+1];
-                *b = pixels[pos+2];
-                *a = pixels[pos+3];
+                _EachRange<T...>(f, begin, end);
+            });
+        }
+
+        void AddSystem(SystemPhase phase, function<void(World&, float)> system)
+        {
+            systems[static_cast<int>(phase)].push_back(system);
+        }
+
+        void RunSystems(SystemPhase phase, float elapsed)
+        {
+            vector<function<void(World&, float)> >& list = systems[static_cast<int>(phase)];
+            for(unsigned int i = 0; i < list.size(); i++)
+                list[i](*this, elapsed);
+        }
+
+        private:
+        vector<_internal_pool_base*> pools;
+        vector<uint8_t> generations;
+        vector<uint32_t> free_slots;
+        uint32_t alive_count = 0;
+        uint32_t next_group_id = 0;
+        vector<function<void(World&, float)> > systems[static_cast<int>(SystemPhase::TOTAL_PHASES)];
+
+        // Only a view over exactly the packed types can use the prefix; a subset of them
+        // would miss entities that lack the other packed components.
+        template<typename... T>
+        bool _IsPacked()
+        {
+            _internal_pool_base* set[] = {&Pool<T>()...};
+            for(unsigned int p = 0; p < sizeof...(T); p++)
+            {
+                if(set[p]->group_id == 0 || set[p]->group_id != set[0]->group_id || set[p]->group_pools != sizeof...(T))
+                    return false;
             }
+            return true;
         }
 
-        void Read(int x, int y)
+        template<typename... T>
+        _internal_pool_base* _LeadPool()
+        {
+            _internal_pool_base* set[] = {&Pool<T>()...};
+            _internal_pool_base* lead = set[0];
+            for(unsigned int p = 1; p < sizeof...(T); p++)
+            {
+                if(set[p]->Size() < lead->Size())
+                    lead = set[p];
+            }
+            return lead;
+        }
+
+        // Number of indices Each() walks: the packed prefix, or the smallest pool.
+        template<typename... T>
+        uint32_t _CandidateCount()
+        {
+            if(_IsPacked<T...>())
+                return _LeadPool<T...>()->group_size;
+            return _LeadPool<T...>()->Size();
+        }
+
+        template<typename... T, typename F>
+        void _EachRange(F& f, uint32_t begin, uint32_t end)
+        {
+            _EachRangeIn(f, begin, end, _IsPacked<T...>(), _LeadPool<T...>(), &Pool<T>()...);
+        }
+
+        // Pools are looked up once up front so the loops below only touch the arrays.
+        template<typename F, typename... T>
+        void _EachRangeIn(F& f, uint32_t begin, uint32_t end, bool packed, _internal_pool_base* lead, ComponentPool<T>*... pool)
+        {
+            if(packed)
+            {
+                _internal_pool_base* first[] = {pool...};
+                for(uint32_t i = begin; i < end; i++)
+                    f(first[0]->entities[i], pool->dense[i]...);
+                return;
+            }
+            for(uint32_t i = begin; i < end; i++)
+            {
+                Entity e = lead->entities[i];
+                bool has[] = {pool->Has(e)...};
+                bool in_all = true;
+                for(unsigned int p = 0; p < sizeof...(T); p++)
+                    in_all = in_all && has[p];
+                if(in_all)
+                    f(e, pool->dense[pool->sparse[e & 0xFFFFFF]]...);
+            }
+        }
+    };
+
+    World* attached_world = NULL;
+
+    // Runs the world's systems from the main loop. Pass NULL to detach.
+    void AttachWorld(World* world)
+    {
+        attached_world = world;
+    }
+
+    unsigned int GetWidth() { return screen_width; }
+    unsigned int GetHeight() { return screen_height; }
+    unsigned int GetScale() { return window_scale; }
+    enum class PresentMode
+    {
+        // Draw into screen_texture, then copy it to the window. Needed by retained mode.
+        INTERMEDIATE = 0,
+        // Draw straight into the window's back buffer, scaled by SDL_RenderSetLogicalSize.
+        DIRECT,
+    };
+
+    enum class ScaleFilter
+    {
+        NEAREST = 0,
+        LINEAR,
+    };
+
+    PresentMode present_mode = PresentMode::INTERMEDIATE;
+    bool integer_scaling = false;
+    float present_time = 0.0f;
+
+    // Call after Init(). integer_scale keeps the picture at a whole multiple of the screen
+    // size, centred with black borders. In DIRECT mode the filter applies to textures loaded
+    // afterwards, since every texture is scaled on its way to the window.
+    void SetPresentMode(PresentMode mode, ScaleFilter filter = ScaleFilter::NEAREST, bool integer_scale = false)
+    {
+        present_mode = mode;
+        integer_scaling = integer_scale;
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, (filter == ScaleFilter::LINEAR) ? "linear" : "nearest");
+        SDL_SetTextureScaleMode(screen_texture, (filter == ScaleFilter::LINEAR) ? SDL_ScaleModeLinear : SDL_ScaleModeNearest);
+        SDL_SetRenderTarget(window_renderer, NULL);
+        if(mode == PresentMode::DIRECT)
+        {
+            SDL_RenderSetLogicalSize(window_renderer, screen_width, screen_height);
+            SDL_RenderSetIntegerScale(window_renderer, integer_scale ? SDL_TRUE : SDL_FALSE);
+        }
+        else
         {
-            SDL_Rect rect;
-            rect.x = x;
-            rect.y = y;
-            rect.w = this->width;
-            rect.h = this->height;
-            SDL_RenderReadPixels(window_renderer, &rect, SDL_PIXELFORMAT_RGBA32, (void*)this->pixels, this->width * sizeof(uint32_t));
+            SDL_RenderSetLogicalSize(window_renderer, 0, 0);
+            SDL_RenderSetIntegerScale(window_renderer, SDL_FALSE);
         }
+        InvalidateScreen();
+    }
 
-        void Write(int x, int y, float scale=1.0f)
+    PresentMode GetPresentMode() { return present_mode; }
+    // Seconds the last frame spent copying to the window and presenting.
+    float GetPresentTime() { return present_time; }
+
+    // Retained mode needs the picture kept between frames, so it always goes through
+    // screen_texture.
+    SDL_Texture* _FrameTarget()
+    {
+        return (present_mode == PresentMode::DIRECT && !retained_mode) ? NULL : screen_texture;
+    }
+
+    void _Present()
+    {
+        TRACE_ZONE("Present");
+        uint64_t start = SDL_GetPerformanceCounter();
+        SDL_Texture* target = _FrameTarget();
+        if(target != NULL)
         {
-            #if BYTE_ORDER == LITTLE_ENDIAN
-            SDL_Surface* surf = SDL_CreateRGBSurfaceFrom((void*)this->pixels, this->width, this->height, 32, this->width * sizeof(uint32_t), 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
-            #elif BYTE_ORDER == BIG_ENDIAN
-            SDL_Surface* surf = SDL_CreateRGBSurfaceFrom((void*)this->pixels, this->width, this->height, 32, this->width * sizeof(uint32_t), 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
-            #else
-            #error "Endianness not defined for target machine. (Define BYTE_ORDER as LITTLE_ENDIAN or BIG_ENDIAN?)"
-            #endif
-            SDL_Texture* to_screen = SDL_CreateTextureFromSurface(window_renderer, surf);
-            SDL_Rect srect, drect;
-            srect.x = 0; srect.y = 0; srect.w = this->width; srect.h = this->height;
-            drect.x = x; drect.y = y; drect.w = this->width * scale; drect.h = this->height * scale;
-            if(blend)
-                SDL_SetRenderDrawBlendMode(window_renderer, SDL_BLENDMODE_BLEND);
-            SDL_RenderCopy(window_renderer, to_screen, &srect, &drect);
-            SDL_DestroyTexture(to_screen);
-            SDL_FreeSurface(surf);  
+            SDL_SetRenderTarget(window_renderer, NULL);
+            if(present_mode == PresentMode::DIRECT)
+            {
+                // Retained mode in DIRECT: the logical size set by SetPresentMode() already
+                // scales and letterboxes the copy, integer scaling included.
+                SDL_SetRenderDrawColor(window_renderer, 0, 0, 0, 255);
+                SDL_RenderClear(window_renderer);
+                SDL_RenderCopy(window_renderer, target, NULL, NULL);
+            }
+            else if(integer_scaling)
+            {
+                int out_w, out_h;
+                SDL_GetRendererOutputSize(window_renderer, &out_w, &out_h);
+                int scale = max(min(out_w / (int)screen_width, out_h / (int)screen_height), 1);
+                SDL_Rect dest = {(out_w - (int)screen_width * scale) / 2, (out_h - (int)screen_height * scale) / 2, (int)screen_width * scale, (int)screen_height * scale};
+                SDL_SetRenderDrawColor(window_renderer, 0, 0, 0, 255);
+                SDL_RenderClear(window_renderer);
+                SDL_RenderCopy(window_renderer, target, NULL, &dest);
+            }
+            else
+            {
+                SDL_RenderCopy(window_renderer, target, NULL, NULL);
+            }
         }
+        SDL_RenderPresent(window_renderer);
+        presented_frames++;
+        presented_texture_clock = texture_clock;
+        present_time = (SDL_GetPerformanceCounter() - start) / (float)SDL_GetPerformanceFrequency();
+    }
 
+    enum class CaptureFormat
+    {
+        // Every frame's RGBA32 pixels one after another in a single file.
+        RAW = 0,
+        // YUV4MPEG2, 4:4:4, one file that ffmpeg and most players open directly.
+        Y4M,
+        // One PNG per frame; the path is a printf pattern given the frame number.
+        PNG,
     };
 
-    class Sound
+    typedef struct
     {
-        SDL_AudioSpec wav_spec;
-        uint32_t wav_length;
-        uint8_t* wav_buffer;
-        SDL_AudioDeviceID device_id;
+        int captured;               // Frames copied on the GPU.
+        int dropped;                // Frames skipped because every buffer was still queued.
+        int written;                // Frames the encoder thread has finished.
+        float main_thread_time;     // Seconds the last capture took on the main thread.
+    } CaptureStats;
+
+    CaptureStats capture_stats = CaptureStats();
+    bool capture_active = false;
+    CaptureFormat capture_format = CaptureFormat::RAW;
+    string capture_path;
+    int capture_fps = 60;
+    FILE* capture_file = NULL;
+    // Target textures the frames are copied into on the GPU, read back once the copy is
+    // several frames old so the read does not wait for the frame being drawn.
+    vector<SDL_Texture*> capture_textures;
+    int capture_slot = 0;
+    int capture_pending = 0;
+    int64_t capture_frame = 0;
+    // Buffers go from capture_free to capture_queue on the main thread and back on the
+    // encoder thread. No free buffer means the frame is dropped.
+    vector<vector<uint8_t>> capture_buffers;
+    vector<int64_t> capture_buffer_frame;
+    vector<int> capture_free;
+    vector<int> capture_queue;
+    SDL_mutex* capture_lock = NULL;
+    SDL_cond* capture_ready = NULL;
+    SDL_Thread* capture_thread = NULL;
+    bool capture_quit = false;
+
+    CaptureStats GetCaptureStats()
+    {
+        if(capture_lock == NULL)
+            return capture_stats;
+        SDL_LockMutex(capture_lock);
+        CaptureStats s = capture_stats;
+        SDL_UnlockMutex(capture_lock);
+        return s;
+    }
 
-        public:
-        bool is_paused = true;
+    bool IsCapturing() { return capture_active; }
 
-        Sound(string s)
+    void _EncodeFrame(const uint8_t* pixels, int64_t frame, vector<uint8_t>& scratch)
+    {
+        int w = screen_width, h = screen_height;
+        if(capture_format == CaptureFormat::RAW)
         {
-            SDL_LoadWAV(s.c_str(), &wav_spec, &wav_buffer, &wav_length);
-            device_id = SDL_OpenAudioDevice(NULL, 0, &wav_spec, NULL, 0);
-            if(!device_id)
+            fwrite(pixels, 4, (size_t)w * h, capture_file);
+        }
+        else if(capture_format == CaptureFormat::Y4M)
+        {
+            // BT.601 studio range, the default players assume for Y4M.
+            size_t plane = (size_t)w * h;
+            scratch.resize(plane * 3);
+            uint8_t* ys = scratch.data();
+            uint8_t* us = ys + plane;
+            uint8_t* vs = us + plane;
+            for(size_t i = 0; i < plane; i++)
             {
-                ERROR_OUT("Unable to open sound device!\nMessage: %s\n", SDL_GetError());
+                int r = pixels[4 * i], g = pixels[4 * i + 1], b = pixels[4 * i + 2];
+                ys[i] = (uint8_t)(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+                us[i] = (uint8_t)(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+                vs[i] = (uint8_t)(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
             }
+            fputs("FRAME\n", capture_file);
+            fwrite(scratch.data(), 1, scratch.size(), capture_file);
         }
-
-        void SetVolume(float volume)
+        else
         {
-            volume = Clamp(volume, 0.0, 1.0);
-            uint8_t* new_buffer = (uint8_t*)calloc(wav_length, sizeof(uint8_t));
-            SDL_MixAudioFormat(new_buffer, wav_buffer, wav_spec.format, wav_length, (int)(volume * SDL_MIX_MAXVOLUME) % SDL_MIX_MAXVOLUME);
-            SDL_FreeWAV(wav_buffer);
-            wav_buffer = new_buffer;
+            char filename[1024];
+            snprintf(filename, sizeof(filename), capture_path.c_str(), (int)frame);
+            SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom((void*)pixels, w, h, 32, w * 4, SDL_PIXELFORMAT_RGBA32);
+            if(surface == NULL || IMG_SavePNG(surface, filename) != 0)
+                ERROR_OUT("Could not write capture frame %s\nMessage: %s\n", filename, SDL_GetError());
+            SDL_FreeSurface(surface);
         }
+    }
 
-        void Play()
+    int _CaptureMain(void* data)
+    {
+        SetTraceThreadName("capture");
+        vector<uint8_t> scratch;
+        SDL_LockMutex(capture_lock);
+        while(true)
         {
-            SDL_QueueAudio(device_id, wav_buffer, wav_length);
-            UnPause();
+            while(capture_queue.empty() && !capture_quit)
+                SDL_CondWait(capture_ready, capture_lock);
+            if(capture_queue.empty())
+                break;
+            int buffer = capture_queue.front();
+            capture_queue.erase(capture_queue.begin());
+            SDL_UnlockMutex(capture_lock);
+            {
+                TRACE_ZONE("Encode frame");
+                _EncodeFrame(capture_buffers[buffer].data(), capture_buffer_frame[buffer], scratch);
+            }
+            SDL_LockMutex(capture_lock);
+            capture_free.push_back(buffer);
+            capture_stats.written++;
         }
+        SDL_UnlockMutex(capture_lock);
+        return 0;
+    }
 
-        bool IsFinished()
+    // Reads back the oldest GPU copy into a free buffer and queues it for the encoder.
+    void _ReadCaptureTexture(SDL_Texture* texture)
+    {
+        SDL_LockMutex(capture_lock);
+        int buffer = -1;
+        if(!capture_free.empty())
         {
-            if(SDL_GetQueuedAudioSize(device_id) == 0) 
-                return true;
-            else
-                return false;
+            buffer = capture_free.back();
+            capture_free.pop_back();
         }
-
-        void Pause()
+        SDL_UnlockMutex(capture_lock);
+        int64_t frame = capture_frame++;
+        if(buffer < 0)
         {
-            SDL_PauseAudioDevice(device_id, 1);
-            is_paused = true;
+            capture_stats.dropped++;
+            return;
         }
+        SDL_SetRenderTarget(window_renderer, texture);
+        SDL_RenderReadPixels(window_renderer, NULL, SDL_PIXELFORMAT_RGBA32, capture_buffers[buffer].data(), screen_width * 4);
+        capture_buffer_frame[buffer] = frame;
+        SDL_LockMutex(capture_lock);
+        capture_queue.push_back(buffer);
+        SDL_CondSignal(capture_ready);
+        SDL_UnlockMutex(capture_lock);
+    }
 
-        void UnPause()
+    // Called once per frame by the main loop, after the frame is presented.
+    void _CaptureFrame()
+    {
+        TRACE_ZONE("Capture");
+        uint64_t start = SDL_GetPerformanceCounter();
+        SDL_Texture* source = _FrameTarget();
+        SDL_Texture* target = SDL_GetRenderTarget(window_renderer);
+        int slots = (int)capture_textures.size();
+        SDL_BlendMode blend;
+        SDL_GetTextureBlendMode(source, &blend);
+        SDL_SetTextureBlendMode(source, SDL_BLENDMODE_NONE);
+        SDL_SetRenderTarget(window_renderer, capture_textures[capture_slot]);
+        SDL_RenderCopy(window_renderer, source, NULL, NULL);
+        SDL_SetTextureBlendMode(source, blend);
+        capture_stats.captured++;
+        capture_slot = (capture_slot + 1) % slots;
+        // Once every slot holds a frame, the next one to be overwritten is the oldest.
+        if(capture_pending == slots - 1)
+            _ReadCaptureTexture(capture_textures[capture_slot]);
+        else
+            capture_pending++;
+        SDL_SetRenderTarget(window_renderer, target);
+        capture_stats.main_thread_time = (SDL_GetPerformanceCounter() - start) / (float)SDL_GetPerformanceFrequency();
+    }
+
+    // Records every frame from now on to path. gpu_frames copies are kept on the GPU, so a
+    // frame is read back gpu_frames - 1 frames after it was drawn; buffers frames can wait
+    // for the encoder thread before new ones are dropped. Needs PresentMode::INTERMEDIATE or
+    // retained mode, so the picture is in a texture. Not available under Emscripten.
+    bool StartCapture(string path, CaptureFormat format = CaptureFormat::Y4M, int fps = 60, int gpu_frames = 3, int buffers = 8)
+    {
+        #ifdef ENGINE2D_EMSCRIPTEN_IMPLEMENTATION
+        ERROR_OUT("Frame capture is not supported under Emscripten!\n");
+        return false;
+        #else
+        if(capture_active)
+            return false;
+        if(_FrameTarget() == NULL)
         {
-            SDL_PauseAudioDevice(device_id, 0);
-            is_paused = false;
+            ERROR_OUT("Frame capture needs PresentMode::INTERMEDIATE!\n");
+            return false;
         }
-
-        bool IsPaused()
+        capture_path = path;
+        capture_format = format;
+        capture_fps = max(fps, 1);
+        if(format != CaptureFormat::PNG)
         {
-            return is_paused;
+            capture_file = fopen(path.c_str(), "wb");
+            if(capture_file == NULL)
+            {
+                ERROR_OUT("Could not open capture file: %s\n", path.c_str());
+                return false;
+            }
+            if(format == CaptureFormat::Y4M)
+                fprintf(capture_file, "YUV4MPEG2 W%u H%u F%d:1 Ip A1:1 C444\n", screen_width, screen_height, capture_fps);
+        }
+        for(int i = 0; i < max(gpu_frames, 1); i++)
+        {
+            SDL_Texture* texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, screen_width, screen_height);
+            if(texture == NULL)
+            {
+                ERROR_OUT("Could not create capture texture!\nMessage: %s\n", SDL_GetError());
+                break;
+            }
+            capture_textures.push_back(texture);
         }
+        buffers = max(buffers, 1);
+        capture_buffers.assign(buffers, vector<uint8_t>((size_t)screen_width * screen_height * 4));
+        capture_buffer_frame.assign(buffers, 0);
+        capture_free.clear();
+        for(int i = 0; i < buffers; i++)
+            capture_free.push_back(i);
+        capture_queue.clear();
+        capture_queue.reserve(buffers);
+        memory_stats.target_bytes += capture_textures.size() * screen_width * screen_height * 4;
+        capture_stats = CaptureStats();
+        capture_slot = capture_pending = 0;
+        capture_frame = 0;
+        capture_quit = false;
+        capture_lock = SDL_CreateMutex();
+        capture_ready = SDL_CreateCond();
+        capture_thread = SDL_CreateThread(_CaptureMain, "engine2D capture", NULL);
+        capture_active = (capture_thread != NULL && !capture_textures.empty());
+        if(capture_thread == NULL)
+            ERROR_OUT("Could not start the capture thread!\nMessage: %s\n", SDL_GetError());
+        return capture_active;
+        #endif
+    }
 
-        ~Sound()
+    // Reads back the frames still on the GPU, waits for the encoder to write everything
+    // queued, and closes the output.
+    void StopCapture()
+    {
+        if(capture_lock == NULL)
+            return;
+        SDL_Texture* target = SDL_GetRenderTarget(window_renderer);
+        int slots = (int)capture_textures.size();
+        for(int i = capture_pending; i > 0 && capture_active; i--)
         {
-            SDL_FreeWAV(wav_buffer);
+            // Wait for a free buffer rather than dropping the last frames.
+            while(true)
+            {
+                SDL_LockMutex(capture_lock);
+                bool free_buffer = !capture_free.empty();
+                SDL_UnlockMutex(capture_lock);
+                if(free_buffer)
+                    break;
+                SDL_Delay(1);
+            }
+            _ReadCaptureTexture(capture_textures[(capture_slot - i + slots) % slots]);
         }
-    };
+        SDL_SetRenderTarget(window_renderer, target);
+        capture_active = false;
+
+        SDL_LockMutex(capture_lock);
+        capture_quit = true;
+        SDL_CondSignal(capture_ready);
+        SDL_UnlockMutex(capture_lock);
+        if(capture_thread != NULL)
+            SDL_WaitThread(capture_thread, NULL);
+        capture_thread = NULL;
+        SDL_DestroyCond(capture_ready);
+        SDL_DestroyMutex(capture_lock);
+        capture_ready = NULL;
+        capture_lock = NULL;
+
+        memory_stats.target_bytes -= capture_textures.size() * screen_width * screen_height * 4;
+        for(size_t i = 0; i < capture_textures.size(); i++)
+            SDL_DestroyTexture(capture_textures[i]);
+        capture_textures.clear();
+        capture_buffers.clear();
+        capture_buffers.shrink_to_fit();
+        if(capture_file != NULL)
+            fclose(capture_file);
+        capture_file = NULL;
+    }
 
-    unsigned int GetWidth() { return screen_width; }
-    unsigned int GetHeight() { return screen_height; }
-    unsigned int GetScale() { return window_scale; }
     void CaptureMouse() { SDL_SetRelativeMouseMode(SDL_TRUE); }
     void UncaptureMouse() { SDL_SetRelativeMouseMode(SDL_FALSE); }
 
@@ -685,6 +6855,7 @@ namespace engine2D
         window_width = screen_width * scale;
         window_height = screen_height * scale;
         window_scale = scale;
+        SetTraceThreadName("main");
 
         if(SDL_Init(SDL_INIT_VIDEO) < 0)
         {
@@ -704,7 +6875,18 @@ namespace engine2D
             exit(-1);
         }
         window_renderer = SDL_CreateRenderer(application_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
+        if(!window_renderer)
+        {
+            // No GPU renderer, e.g. under the dummy video driver. The software one still draws.
+            window_renderer = SDL_CreateRenderer(application_window, -1, SDL_RENDERER_SOFTWARE | SDL_RENDERER_TARGETTEXTURE);
+        }
+        if(!window_renderer)
+        {
+            ERROR_OUT("Could not initialize SDL renderer! Quitting.\nMessage: %s\n", SDL_GetError());
+            exit(-1);
+        }
         screen_texture = SDL_CreateTexture(window_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, w, h);
+        memory_stats.target_bytes += (size_t)w * h * 4;
     }
 
     void _SetDrawColor(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
@@ -715,20 +6897,43 @@ namespace engine2D
     
     void Clear(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
     {
+        if(recording_buffer != NULL)
+        {
+            recording_buffer->_Add(_DrawOp::CLEAR, r, g, b, a);
+            return;
+        }
         _SetDrawColor(r, g, b, a);
         SDL_RenderClear(window_renderer);
     }
 
     void DrawPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
     {
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::PIXEL, r, g, b, a);
+            c.v[0] = x; c.v[1] = y;
+            return;
+        }
+        Vector2 p = _ToScreen(x, y);
+        if(_CullScreenBox(p.x, p.y, p.x, p.y))
+            return;
         _SetDrawColor(r, g, b, a);
-        SDL_RenderDrawPoint(window_renderer, x, y);
+        SDL_RenderDrawPointF(window_renderer, p.x, p.y);
     }
 
     void DrawLine(int x1, int y1, int x2, int y2, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
     {
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::LINE, r, g, b, a);
+            c.v[0] = x1; c.v[1] = y1; c.v[2] = x2; c.v[3] = y2;
+            return;
+        }
+        Vector2 p1 = _ToScreen(x1, y1), p2 = _ToScreen(x2, y2);
+        if(_CullScreenBox(min(p1.x, p2.x), min(p1.y, p2.y), max(p1.x, p2.x), max(p1.y, p2.y)))
+            return;
         _SetDrawColor(r, g, b, a);
-        SDL_RenderDrawLine(window_renderer, x1, y1, x2, y2);
+        SDL_RenderDrawLineF(window_renderer, p1.x, p1.y, p2.x, p2.y);
     }
 
     void DrawVLine(int x, int y1, int y2, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
@@ -743,16 +6948,62 @@ namespace engine2D
 
     void DrawBlock(int x, int y, int w, int h, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
     {
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::BLOCK, r, g, b, a);
+            c.v[0] = x; c.v[1] = y; c.v[2] = w; c.v[3] = h;
+            c.fill = fill;
+            return;
+        }
+        if(_ActiveCamera() != NULL && _ActiveCamera()->rotation != 0.0f)
+        {
+            // A turned camera makes the block a general quad.
+            Vector2 c[4] = {_ToScreen(x, y), _ToScreen(x + w, y), _ToScreen(x + w, y + h), _ToScreen(x, y + h)};
+            float x0 = c[0].x, y0 = c[0].y, x1 = c[0].x, y1 = c[0].y;
+            for(int i = 1; i < 4; i++)
+            {
+                x0 = min(x0, c[i].x); x1 = max(x1, c[i].x);
+                y0 = min(y0, c[i].y); y1 = max(y1, c[i].y);
+            }
+            if(_CullScreenBox(x0, y0, x1, y1))
+                return;
+            _SetDrawColor(r, g, b, a);
+            if(fill)
+            {
+                SDL_Color colour = {r, g, b, a};
+                SDL_Vertex v[4];
+                for(int i = 0; i < 4; i++)
+                {
+                    v[i].position.x = c[i].x;
+                    v[i].position.y = c[i].y;
+                    v[i].color = colour;
+                    v[i].tex_coord.x = 0.0f;
+                    v[i].tex_coord.y = 0.0f;
+                }
+                const int indices[6] = {0, 1, 2, 2, 3, 0};
+                SDL_RenderGeometry(window_renderer, NULL, v, 4, indices, 6);
+            }
+            else
+            {
+                for(int i = 0; i < 4; i++)
+                    SDL_RenderDrawLineF(window_renderer, c[i].x, c[i].y, c[(i + 1) & 3].x, c[(i + 1) & 3].y);
+            }
+            return;
+        }
+
+        Vector2 p = _ToScreen(x, y);
+        float zoom = _ScreenScale();
+        SDL_FRect rect = {p.x, p.y, w * zoom, h * zoom};
+        if(_CullScreenBox(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h))
+            return;
         _SetDrawColor(r, g, b, a);
-        SDL_Rect rect;
-        rect.x = x; rect.y = y; rect.w = w; rect.h = h;
         if(fill)
         {
-            SDL_RenderFillRect(window_renderer, &rect);
+            SDL_RenderFillRectF(window_renderer, &rect);
         }
         else
         {
-            SDL_RenderDrawRect(window_renderer, &rect);
+            SDL_RenderDrawRectF(window_renderer, &rect);
         }
     }
 
@@ -765,34 +7016,54 @@ namespace engine2D
     };
     void DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
     {
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::TRIANGLE, r, g, b, a);
+            c.v[0] = x1; c.v[1] = y1; c.v[2] = x2; c.v[3] = y2; c.v[4] = x3; c.v[5] = y3;
+            c.fill = fill;
+            return;
+        }
+        Vector2 p1 = _ToScreen(x1, y1), p2 = _ToScreen(x2, y2), p3 = _ToScreen(x3, y3);
+        if(_CullScreenBox(min(p1.x, min(p2.x, p3.x)), min(p1.y, min(p2.y, p3.y)), max(p1.x, max(p2.x, p3.x)), max(p1.y, max(p2.y, p3.y))))
+            return;
         if(!fill)
         {
             _SetDrawColor(r, g, b, a);
-            SDL_RenderDrawLine(window_renderer, x1, y1, x2, y2);
-            SDL_RenderDrawLine(window_renderer, x2, y2, x3, y3);
-            SDL_RenderDrawLine(window_renderer, x3, y3, x1, x2);
+            SDL_RenderDrawLineF(window_renderer, p1.x, p1.y, p2.x, p2.y);
+            SDL_RenderDrawLineF(window_renderer, p2.x, p2.y, p3.x, p3.y);
+            SDL_RenderDrawLineF(window_renderer, p3.x, p3.y, p1.x, p1.y);
         }
         else
         {
-            sdl2_gfx_filledTrigonColor(window_renderer, x1, y1, x2, y2, x3, y3, r, g, b, a);
+            sdl2_gfx_filledTrigonColor(window_renderer, lround(p1.x), lround(p1.y), lround(p2.x), lround(p2.y), lround(p3.x), lround(p3.y), r, g, b, a);
         }
 
     }
 
-    void DrawCircle(int x, int y, int rad, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
+    // Under a turned camera ellipses keep their axes lined up with the screen.
+    void DrawEllipse(int x, int y, int rx, int ry, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
     {
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::ELLIPSE, r, g, b, a);
+            c.v[0] = x; c.v[1] = y; c.v[2] = rx; c.v[3] = ry;
+            c.fill = fill;
+            return;
+        }
+        Vector2 p = _ToScreen(x, y);
+        float zoom = _ScreenScale();
+        float srx = rx * zoom, sry = ry * zoom;
+        if(_CullScreenBox(p.x - srx, p.y - sry, p.x + srx, p.y + sry))
+            return;
         if(fill)
-            sdl2_gfx_filledEllipseRGBA(window_renderer, x, y, rad, rad, r, g, b, a);
+            sdl2_gfx_filledEllipseRGBA(window_renderer, lround(p.x), lround(p.y), lround(srx), lround(sry), r, g, b, a);
         else
-            sdl2_gfx_ellipseRGBA(window_renderer, x, y, rad, rad, r, g, b, a);
+            sdl2_gfx_ellipseRGBA(window_renderer, lround(p.x), lround(p.y), lround(srx), lround(sry), r, g, b, a);
     }
 
-    void DrawEllipse(int x, int y, int rx, int ry, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
+    void DrawCircle(int x, int y, int rad, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
     {
-        if(fill)
-            sdl2_gfx_filledEllipseRGBA(window_renderer, x, y, rx, ry, r, g, b, a);
-        else
-            sdl2_gfx_ellipseRGBA(window_renderer, x, y, rx, ry, r, g, b, a);
+        DrawEllipse(x, y, rad, rad, r, g, b, a, fill);
     }
 
     void PolygonBegin(int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a, bool fill)
@@ -818,25 +7089,190 @@ namespace engine2D
     
     void PolygonVertex(int x, int y)
     {
+        ALLOCATION_TAG("PolygonVertex");
         shape_array_x.push_back(shape_x + x);
         shape_array_y.push_back(shape_y + y);
     }
 
     void PolygonEnd(void)
     {
+        ALLOCATION_TAG("PolygonEnd");
+        int n = shape_array_x.size();
+        shape_free = true;
+        if(n == 0)
+            return;
+        if(recording_buffer != NULL)
+        {
+            _internal_draw_command_t& c = recording_buffer->_Add(_DrawOp::POLYGON, shape_r, shape_g, shape_b, shape_a);
+            c.fill = shape_fill;
+            c.v[0] = n;
+            c.data = recording_buffer->ints.size();
+            for(int i = 0; i < n; i++)
+            {
+                recording_buffer->ints.push_back((Sint16)shape_array_x[i]);
+                recording_buffer->ints.push_back((Sint16)shape_array_y[i]);
+            }
+            return;
+        }
+
+        // Move the outline to screen space once, then cull it as a whole.
+        float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+        for(int i = 0; i < n; i++)
+        {
+            Vector2 p = _ToScreen((Sint16)shape_array_x[i], (Sint16)shape_array_y[i]);
+            shape_array_x[i] = (uint16_t)lround(p.x);
+            shape_array_y[i] = (uint16_t)lround(p.y);
+            x0 = min(x0, p.x); x1 = max(x1, p.x);
+            y0 = min(y0, p.y); y1 = max(y1, p.y);
+        }
+        if(_CullScreenBox(x0, y0, x1, y1))
+            return;
+
         if(shape_fill)
-            sdl2_gfx_filledPolygonRGBAMT(window_renderer, reinterpret_cast<const Sint16*>(&shape_array_x[0]), reinterpret_cast<const Sint16*>(&shape_array_y[0]), shape_array_y.size(), shape_r, shape_g, shape_b, shape_a, NULL, NULL);
+        {
+            int* poly_ints = FrameAllocate<int>(n);
+            int poly_allocated = n;
+            sdl2_gfx_filledPolygonRGBAMT(window_renderer, reinterpret_cast<const Sint16*>(&shape_array_x[0]), reinterpret_cast<const Sint16*>(&shape_array_y[0]), shape_array_y.size(), shape_r, shape_g, shape_b, shape_a, &poly_ints, &poly_allocated);
+        }
         else
         {
-            int n = shape_array_x.size();
-            for(unsigned int i = 0; i < n - 1; i++)
+            _SetDrawColor(shape_r, shape_g, shape_b, shape_a);
+            for(int i = 0; i < n; i++)
             {
-                DrawLine(shape_array_x[i], shape_array_y[i], shape_array_x[i+1], shape_array_y[i+1], shape_r, shape_g, shape_b, shape_a);
+                int j = (i + 1 == n) ? 0 : i + 1;
+                SDL_RenderDrawLine(window_renderer, (Sint16)shape_array_x[i], (Sint16)shape_array_y[i], (Sint16)shape_array_x[j], (Sint16)shape_array_y[j]);
             }
-            DrawLine(shape_array_x[n-1], shape_array_y[n-1], shape_array_x[0], shape_array_y[0], shape_r, shape_g, shape_b, shape_a);
         }
-        shape_free = true;
+    }
+
+    void CommandBuffer::Replay()
+    {
+        CommandBuffer* saved_recording = recording_buffer;
+        bool saved_overridden = camera_overridden;
+        Camera* saved_override = camera_override;
+        // Replaying while recording copies the commands into the buffer being recorded.
+        if(saved_recording != NULL)
+        {
+            saved_recording->Append(*this);
+            return;
+        }
+
+        for(size_t i = 0; i < commands.size(); i++)
+        {
+            const _internal_draw_command_t& c = commands[i];
+            switch(c.op)
+            {
+                case _DrawOp::CAMERA:
+                    camera_overridden = true;
+                    camera_override = NULL;
+                    if(c.fill)
+                    {
+                        replay_camera.x = c.f[0];
+                        replay_camera.y = c.f[1];
+                        replay_camera.zoom = c.f[2];
+                        replay_camera.rotation = c.f[3];
+                        camera_override = &replay_camera;
+                    }
+                    break;
+                case _DrawOp::CLEAR:
+                    engine2D::Clear(c.r, c.g, c.b, c.a);
+                    break;
+                case _DrawOp::PIXEL:
+                    DrawPixel(c.v[0], c.v[1], c.r, c.g, c.b, c.a);
+                    break;
+                case _DrawOp::LINE:
+                    DrawLine(c.v[0], c.v[1], c.v[2], c.v[3], c.r, c.g, c.b, c.a);
+                    break;
+                case _DrawOp::BLOCK:
+                    DrawBlock(c.v[0], c.v[1], c.v[2], c.v[3], c.r, c.g, c.b, c.a, c.fill);
+                    break;
+                case _DrawOp::TRIANGLE:
+                    DrawTriangle(c.v[0], c.v[1], c.v[2], c.v[3], c.v[4], c.v[5], c.r, c.g, c.b, c.a, c.fill);
+                    break;
+                case _DrawOp::ELLIPSE:
+                    DrawEllipse(c.v[0], c.v[1], c.v[2], c.v[3], c.r, c.g, c.b, c.a, c.fill);
+                    break;
+                case _DrawOp::POLYGON:
+                    PolygonBegin(0, 0, c.r, c.g, c.b, c.a, c.fill);
+                    for(int k = 0; k < c.v[0]; k++)
+                        PolygonVertex(ints[c.data + 2 * k], ints[c.data + 2 * k + 1]);
+                    PolygonEnd();
+                    break;
+                case _DrawOp::TEXTURE:
+                case _DrawOp::IMAGE:
+                {
+                    SDL_Rect src;
+                    if(c.data != _NO_COMMAND_DATA)
+                    {
+                        src.x = ints[c.data]; src.y = ints[c.data + 1];
+                        src.w = ints[c.data + 2]; src.h = ints[c.data + 3];
+                    }
+                    if(c.op == _DrawOp::IMAGE && c.data != _NO_COMMAND_DATA)
+                        ((Image*)c.object)->_DrawImageRect(src, c.v[0], c.v[1], c.v[2], c.v[3], c.f[0], c.v[4], c.v[5], (SDL_RendererFlip)c.r);
+                    else
+                    {
+                        SDL_Texture* texture = (c.op == _DrawOp::IMAGE) ? ((Image*)c.object)->GetTexture() : (SDL_Texture*)c.object;
+                        _DrawTexture(texture, (c.data != _NO_COMMAND_DATA) ? &src : NULL, c.v[0], c.v[1], c.v[2], c.v[3], c.f[0], c.v[4], c.v[5], (SDL_RendererFlip)c.r);
+                    }
+                    break;
+                }
+                case _DrawOp::TEXT:
+                    ((BitmapFont*)c.object)->DrawText(&text[c.data], c.v[0], c.v[1], c.f[0]);
+                    break;
+                case _DrawOp::CALL:
+                    calls[c.data]();
+                    break;
+            }
+        }
+        camera_overridden = saved_overridden;
+        camera_override = saved_override;
+    }
 
+    // Like ParallelFor, but each chunk's draw calls are recorded on their own and then played
+    // in chunk order - into the buffer being recorded, or straight to the renderer - so the
+    // result does not depend on which thread ran which chunk. Call it from the thread that
+    // owns the renderer or from a recording thread.
+    void ParallelDraw(int count, int chunk_size, const function<void(int, int)>& job)
+    {
+        static thread_local vector<vector<CommandBuffer>> pools;
+        static thread_local unsigned int depth = 0;
+        if(count <= 0)
+            return;
+        chunk_size = max(chunk_size, 1);
+        int chunks = (count + chunk_size - 1) / chunk_size;
+        // Nested calls use the next pool; moving the outer vector leaves each pool's buffers in place.
+        if(depth == pools.size())
+            pools.emplace_back();
+        if((int)pools[depth].size() < chunks)
+            pools[depth].resize(chunks);
+        CommandBuffer* parts = pools[depth].data();
+        for(int i = 0; i < chunks; i++)
+            parts[i].Clear();
+
+        // Workers draw as the caller would, including a camera a Canvas has swapped in.
+        bool caller_overridden = camera_overridden;
+        Camera* caller_override = camera_override;
+        depth++;
+        ParallelFor(count, chunk_size, [&](int begin, int end)
+        {
+            CommandBuffer* saved = recording_buffer;
+            bool saved_overridden = camera_overridden;
+            Camera* saved_override = camera_override;
+            camera_overridden = caller_overridden;
+            camera_override = caller_override;
+            for(int c = begin; c < end; c += chunk_size)
+            {
+                recording_buffer = &parts[c / chunk_size];
+                job(c, min(c + chunk_size, end));
+            }
+            recording_buffer = saved;
+            camera_overridden = saved_overridden;
+            camera_override = saved_override;
+        });
+        depth--;
+
+        for(int i = 0; i < chunks; i++)
+            parts[i].Replay();
     }
 
     void _ProcessEvents(float elapsed);
@@ -856,6 +7292,181 @@ namespace engine2D
     }
 
 
+    // Pipelined mode runs Update() and Draw() for the next frame on a separate thread while
+    // the main thread replays the previous frame's recorded draw calls and presents them.
+    // Draw() only records, so anything it hands over by pointer (pixel blocks, tile maps,
+    // canvases) is read one frame later; keep such state in DoubleBuffered or leave it
+    // alone during Update(). Input and timer callbacks still run on the main thread, between
+    // frames. Retained mode is ignored while pipelined.
+    SDL_Thread* pipeline_thread = NULL;
+    SDL_sem* pipeline_start = NULL;
+    SDL_sem* pipeline_done = NULL;
+    bool pipeline_quit = false;
+    bool quit_requested = false;
+    float pipeline_elapsed = 0.0f;
+    CommandBuffer frame_commands[2];
+    int pipeline_write = 0;
+    static thread_local bool is_pipeline_thread = false;
+
+    int _PipelineMain(void* data)
+    {
+        is_pipeline_thread = true;
+        worker_index = _UPDATE_THREAD_INDEX;
+        SetTraceThreadName("update");
+        while(true)
+        {
+            SDL_SemWait(pipeline_start);
+            if(pipeline_quit)
+                return 0;
+            CommandBuffer& commands = frame_commands[pipeline_write];
+            commands.Clear();
+            frame_serial++;
+            recording_buffer = &commands;
+            {
+                TRACE_ZONE("Update");
+                app->Update(pipeline_elapsed);
+                if(attached_world != NULL)
+                    attached_world->RunSystems(SystemPhase::UPDATE, pipeline_elapsed);
+            }
+            {
+                TRACE_ZONE("Draw");
+                app->Draw(pipeline_elapsed);
+                if(attached_world != NULL)
+                    attached_world->RunSystems(SystemPhase::DRAW, pipeline_elapsed);
+            }
+            recording_buffer = NULL;
+            SDL_SemPost(pipeline_done);
+        }
+    }
+
+    void SetPipelined(bool enable)
+    {
+        #ifndef ENGINE2D_EMSCRIPTEN_IMPLEMENTATION
+        if(enable == (pipeline_thread != NULL))
+            return;
+        if(enable)
+        {
+            pipeline_start = SDL_CreateSemaphore(0);
+            pipeline_done = SDL_CreateSemaphore(0);
+            pipeline_quit = false;
+            frame_commands[0].Clear();
+            frame_commands[1].Clear();
+            pipeline_thread = SDL_CreateThread(_PipelineMain, "engine2D update", NULL);
+            if(pipeline_thread == NULL)
+                ERROR_OUT("Could not start the update thread!\nMessage: %s\n", SDL_GetError());
+        }
+        else
+        {
+            // Called between frames, so the update thread is waiting for its next start.
+            pipeline_quit = true;
+            SDL_SemPost(pipeline_start);
+            SDL_WaitThread(pipeline_thread, NULL);
+            pipeline_thread = NULL;
+            SDL_DestroySemaphore(pipeline_start);
+            SDL_DestroySemaphore(pipeline_done);
+        }
+        #endif
+    }
+
+    bool IsPipelined() { return pipeline_thread != NULL; }
+
+    void _Frame(float elapsed)
+    {
+        frame_serial++;
+        _ProcessEvents(elapsed);
+        // Update
+        {
+            TRACE_ZONE("Update");
+            app->Update(elapsed);
+            if(attached_world != NULL)
+                attached_world->RunSystems(SystemPhase::UPDATE, elapsed);
+        }
+        // Render
+        if(!retained_mode || dirty_count > 0)
+        {
+            SDL_SetRenderTarget(window_renderer, _FrameTarget());
+            // Regions invalidated while drawing belong to the next frame.
+            SDL_Rect passes[_MAX_DIRTY_RECTS];
+            int pass_count = retained_mode ? dirty_count : 1;
+            copy(dirty_rects, dirty_rects + dirty_count, passes);
+            dirty_count = 0;
+            draw_stats = DrawStats();
+            for(int pass = 0; pass < pass_count; pass++)
+            {
+                if(retained_mode)
+                {
+                    frame_clip = passes[pass];
+                    frame_clip_enabled = true;
+                    _SetClip(NULL);
+                    _SetDrawColor(0, 0, 0, 255);
+                    SDL_RenderFillRect(window_renderer, &frame_clip);
+                }
+                else
+                {
+                    _SetDrawColor(0, 0, 0, 255);
+                    SDL_RenderClear(window_renderer);
+                }
+                // Drawing code goes here
+                TRACE_ZONE("Draw");
+                app->Draw(elapsed);
+                if(attached_world != NULL)
+                    attached_world->RunSystems(SystemPhase::DRAW, elapsed);
+            }
+            last_draw_stats = draw_stats;
+            frame_clip_enabled = false;
+            SDL_RenderSetClipRect(window_renderer, NULL);
+            needs_present = true;
+        }
+        // Render to screen
+        if(needs_present)
+        {
+            _Present();
+            needs_present = false;
+        }
+        #ifndef ENGINE2D_EMSCRIPTEN_IMPLEMENTATION
+        else
+        {
+            // Idle in retained mode: sleep until input arrives or a short timeout for timers.
+            SDL_WaitEventTimeout(NULL, 10);
+        }
+        #endif
+    }
+
+    // Frame N + 1 is updated and recorded on the update thread while frame N is replayed here.
+    void _PipelinedFrame(float elapsed)
+    {
+        _ProcessEvents(elapsed);
+        pipeline_elapsed = elapsed;
+        SDL_SemPost(pipeline_start);
+
+        SDL_SetRenderTarget(window_renderer, _FrameTarget());
+        _SetDrawColor(0, 0, 0, 255);
+        SDL_RenderClear(window_renderer);
+        draw_stats = DrawStats();
+        {
+            TRACE_ZONE("Replay");
+            frame_commands[pipeline_write ^ 1].Replay();
+        }
+        last_draw_stats = draw_stats;
+        _Present();
+
+        TRACE_ZONE("Wait for update");
+        SDL_SemWait(pipeline_done);
+        pipeline_write ^= 1;
+        if(quit_requested)
+            Quit();
+    }
+
+    // With a fixed step every frame is given the same elapsed time whatever it really took,
+    // so headless runs and stress tests behave the same on any machine. 0 uses real time.
+    float fixed_step = 0.0f;
+    float frame_time = 0.0f;
+
+    void SetFixedStep(float step) { fixed_step = max(step, 0.0f); }
+    float GetFixedStep() { return fixed_step; }
+    // Wall clock seconds the last frame took, whether or not a fixed step is set.
+    float GetFrameTime() { return frame_time; }
+
     void MainLoop(void)
     {
         SDL_Event e;
@@ -864,37 +7475,45 @@ namespace engine2D
         while(true)
         {
             uint64_t start = SDL_GetPerformanceCounter();
-            _ProcessEvents(elapsed);
-            // Update
-            app->Update(elapsed);
-            // Render
-            SDL_SetRenderTarget(window_renderer, screen_texture);
-            _SetDrawColor(0, 0, 0, 255);
-            SDL_RenderClear(window_renderer);
-            // Drawing code goes here
-            app->Draw(elapsed);
-            // Render to screen
-            SDL_SetRenderTarget(window_renderer, NULL);
-            //SDL_SetRenderDrawColor(window_renderer, 0, 0, 0, 255);
-            //SDL_RenderClear(window_renderer);
-            SDL_RenderCopyEx(window_renderer, screen_texture, NULL, NULL, 0, NULL, SDL_FLIP_NONE);
-            SDL_RenderPresent(window_renderer);
-            SDL_UpdateWindowSurface(application_window);
+            {
+                TRACE_ZONE("Frame");
+                if(pipeline_thread != NULL)
+                    _PipelinedFrame(elapsed);
+                else
+                    _Frame(elapsed);
+            }
+            if(capture_active)
+                _CaptureFrame();
             uint64_t end = SDL_GetPerformanceCounter();
-            elapsed = ((end - start) / (float)SDL_GetPerformanceFrequency());
+            frame_time = ((end - start) / (float)SDL_GetPerformanceFrequency());
+            elapsed = (fixed_step > 0.0f) ? fixed_step : frame_time;
 
-            for(unsigned int i = 0; i < 256; i++)
             {
-                if(timers[i].active == true)
+                TRACE_ZONE("Timers");
+                for(unsigned int i = 0; i < 256; i++)
                 {
-                    timers[i].time -= elapsed;
-                    if(timers[i].time <= 0)
+                    if(timers[i].active == true)
                     {
-                        timers[i].time = timers[i].duration;
-                        app->OnTimerTick(elapsed, i);
+                        timers[i].time -= elapsed;
+                        if(timers[i].time <= 0)
+                        {
+                            timers[i].time = timers[i].duration;
+                            app->OnTimerTick(elapsed, i);
+                        }
                     }
                 }
             }
+            if(perf_enabled)
+                _PerfEndFrame();
+            if(allocation_tracking)
+                _AllocationEndFrame();
+            if(trace_enabled)
+            {
+                TraceCounter("drawn", last_draw_stats.drawn);
+                TraceCounter("culled", last_draw_stats.culled);
+                TraceCounter("frame arena bytes", (double)GetFrameArenaStats().used);
+            }
+            _ResetFrameArenas();
         }
     }
 
@@ -912,6 +7531,17 @@ namespace engine2D
     
     void Quit()
     {
+        // From the update thread, leave it to the main thread once the frame is done.
+        if(is_pipeline_thread)
+        {
+            quit_requested = true;
+            return;
+        }
+        SetPipelined(false);
+        StopWorkers();
+        StopCapture();
+        if(allocation_tracking)
+            PrintAllocationReport();
         SDL_DestroyWindow(application_window);
         SDL_Quit();
 
@@ -924,6 +7554,7 @@ namespace engine2D
 
     void _ProcessEvents(float elapsed)
     {
+        TRACE_ZONE("ProcessEvents");
         SDL_Event e;
         while(SDL_PollEvent(&e) != 0)
         {
@@ -931,6 +7562,19 @@ namespace engine2D
             {
                 Quit();
             }
+            else if(e.type == SDL_WINDOWEVENT)
+            {
+                if(e.window.event == SDL_WINDOWEVENT_EXPOSED)
+                    needs_present = true;
+            }
+            else if(e.type == SDL_RENDER_TARGETS_RESET || e.type == SDL_RENDER_DEVICE_RESET)
+            {
+                InvalidateScreen();
+                for(unsigned int i = 0; i < live_canvases.size(); i++)
+                    live_canvases[i]->Invalidate();
+                for(unsigned int i = 0; i < live_tile_maps.size(); i++)
+                    live_tile_maps[i]->Invalidate();
+            }
             else if(e.type == SDL_MOUSEMOTION)
             {
                 int x, y;
@@ -1585,7 +8229,11 @@ namespace engine2D
             vy[1]=y2;
             vy[2]=y3;
 
-            return(sdl2_gfx_filledPolygonRGBAMT(renderer,vx,vy,3,r,g,b,a,NULL,NULL));
+            int ints[3];
+            int *poly_ints = ints;
+            int poly_allocated = 3;
+
+            return(sdl2_gfx_filledPolygonRGBAMT(renderer,vx,vy,3,r,g,b,a,&poly_ints,&poly_allocated));
         }
     }
     /* ........................... */
@@ -1596,4 +8244,57 @@ namespace engine2D
     /* End of SDL2_gfx code */
 };
 
+#ifdef ENGINE2D_TRACK_ALLOCATIONS
+#include <new>
+
+// C++ allocations go straight to malloc; only their count and requested size are kept.
+namespace engine2D
+{
+    void* _TrackedNew(size_t size)
+    {
+        // new must hand out a distinct pointer even for zero bytes.
+        void* p = malloc((size > 0) ? size : 1);
+        if(p == NULL)
+            return NULL;
+        _TrackAllocation(size, false);
+        return p;
+    }
+
+    void _TrackedDelete(void* p)
+    {
+        if(p == NULL)
+            return;
+        _TrackFree();
+        free(p);
+    }
+}
+
+void* operator new(size_t size)
+{
+    void* p = engine2D::_TrackedNew(size);
+    if(p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    void* p = engine2D::_TrackedNew(size);
+    if(p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return engine2D::_TrackedNew(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return engine2D::_TrackedNew(size); }
+void operator delete(void* p) noexcept { engine2D::_TrackedDelete(p); }
+void operator delete[](void* p) noexcept { engine2D::_TrackedDelete(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { engine2D::_TrackedDelete(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { engine2D::_TrackedDelete(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept { engine2D::_TrackedDelete(p); }
+void operator delete[](void* p, size_t) noexcept { engine2D::_TrackedDelete(p); }
+#endif
+#endif
+
 #endif
\ No newline at end of file